@@ -0,0 +1,194 @@
+#include "blosc.h"
+
+#include "brickcodec.h"
+#include "inflate.h"
+
+#include <cstring>
+
+namespace {
+
+// The header is the format version, the codec's version, the flags and the
+// type size, then the decoded size, block size and frame size as 32 bit
+// little endian numbers.
+const size_t HeaderBytes = 16;
+const int MaxFormatVersion = 2;
+const uint8_t ByteShuffleFlag = 0x1;
+const uint8_t MemcpyFlag = 0x2;
+const uint8_t BitShuffleFlag = 0x4;
+const uint8_t NoSplitFlag = 0x10;
+// The codec is in the top three bits of the flags.
+const int Lz4Format = 1;
+const int ZlibFormat = 3;
+// Writers from before NoSplitFlag split every whole block of a small enough
+// type, so the flag alone does not say whether a block was split.
+const size_t MaxSplits = 16;
+const size_t MinSplitBytes = 128;
+// Zarr's shuffle setting.
+const int AutoShuffle = -1;
+const int BitShuffle = 2;
+
+const char* FormatName(int format)
+{
+	switch (format) {
+	case 0: return "BloscLZ";
+	case 1: return "LZ4";
+	case 2: return "Snappy";
+	case 3: return "zlib";
+	case 4: return "Zstd";
+	default: return "an unknown codec";
+	}
+}
+
+uint32_t Read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return value;
+}
+
+// One stream of a block. A stream that did not get smaller is stored raw.
+bool DecodeStream(int format, const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, std::string& error)
+{
+	if (srcSize == dstSize) {
+		memcpy(dst, src, dstSize);
+		return true;
+	}
+	if (format == Lz4Format) {
+		return LzDecompress(src, srcSize, dst, dstSize, error);
+	}
+	size_t written;
+	if (!InflateZlib(src, srcSize, dst, dstSize, written, error)) {
+		return false;
+	}
+	if (written != dstSize) {
+		error = "Blosc zlib stream is short";
+		return false;
+	}
+	return true;
+}
+
+}
+
+bool CheckBloscSettings(const std::string& cname, int shuffle, size_t typeSize, std::string& error)
+{
+	if (cname != "lz4" && cname != "lz4hc" && cname != "zlib") {
+		error = "Blosc with " + cname + " is not supported, only lz4, lz4hc and zlib; recompress the array with one of those";
+		return false;
+	}
+	if (shuffle == BitShuffle || (shuffle == AutoShuffle && typeSize == 1)) {
+		error = "Blosc bit shuffle is not supported; recompress the array with byte shuffle or none";
+		return false;
+	}
+	return true;
+}
+
+bool DecompressBlosc(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error)
+{
+	written = 0;
+	if (srcSize < HeaderBytes) {
+		error = "Truncated Blosc header";
+		return false;
+	}
+	auto version = src[0];
+	auto flags = src[2];
+	size_t typeSize = src[3];
+	size_t nbytes = Read32(src + 4);
+	size_t blockSize = Read32(src + 8);
+	size_t cbytes = Read32(src + 12);
+	if (version == 0 || version > MaxFormatVersion) {
+		error = "Unsupported Blosc format version " + std::to_string(version);
+		return false;
+	}
+	if (cbytes > srcSize || typeSize == 0) {
+		error = "Bad Blosc header";
+		return false;
+	}
+	auto size = glm::min(nbytes, dstSize);
+	if (flags & MemcpyFlag) {
+		if (HeaderBytes + size > cbytes) {
+			error = "Truncated Blosc frame";
+			return false;
+		}
+		memcpy(dst, src + HeaderBytes, size);
+		written = size;
+		return true;
+	}
+	auto format = flags >> 5;
+	if (format != Lz4Format && format != ZlibFormat) {
+		error = std::string("Blosc with ") + FormatName(format) + " is not supported, only LZ4 and zlib; recompress the array with one of those";
+		return false;
+	}
+	if (flags & BitShuffleFlag) {
+		error = "Blosc bit shuffle is not supported; recompress the array with byte shuffle or none";
+		return false;
+	}
+	if (nbytes == 0) {
+		return true;
+	}
+	if (blockSize == 0 || blockSize > nbytes) {
+		error = "Bad Blosc block size";
+		return false;
+	}
+	auto blockCount = (nbytes + blockSize - 1) / blockSize;
+	if (HeaderBytes + blockCount * 4 > cbytes) {
+		error = "Truncated Blosc frame";
+		return false;
+	}
+
+	auto shuffled = (flags & ByteShuffleFlag) && typeSize > 1;
+	thread_local std::vector<uint8_t> block;
+	thread_local std::vector<uint8_t> planes;
+	for (size_t index = 0; index * blockSize < size; ++index) {
+		auto offset = index * blockSize;
+		auto leftover = nbytes - offset < blockSize;
+		auto bytes = glm::min(blockSize, nbytes - offset);
+		// A block that only partly fits in dst goes through block first.
+		auto out = dst + offset;
+		if (offset + bytes > size) {
+			block.resize(bytes);
+			out = block.data();
+		}
+		auto streamOut = out;
+		if (shuffled) {
+			planes.resize(bytes);
+			streamOut = planes.data();
+		}
+
+		auto split = !(flags & NoSplitFlag) && typeSize <= MaxSplits && blockSize / typeSize >= MinSplitBytes && !leftover;
+		auto streams = split ? typeSize : 1;
+		if (bytes % streams != 0) {
+			error = "Bad Blosc block size";
+			return false;
+		}
+		auto streamBytes = bytes / streams;
+		size_t in = Read32(src + HeaderBytes + index * 4);
+		for (size_t stream = 0; stream < streams; ++stream) {
+			if (in < HeaderBytes || in + 4 > cbytes) {
+				error = "Truncated Blosc frame";
+				return false;
+			}
+			size_t streamSize = Read32(src + in);
+			in += 4;
+			if (streamSize == 0 || streamSize > cbytes - in) {
+				error = "Truncated Blosc frame";
+				return false;
+			}
+			if (!DecodeStream(format, src + in, streamSize, streamOut + stream * streamBytes, streamBytes, error)) {
+				return false;
+			}
+			in += streamSize;
+		}
+
+		if (shuffled) {
+			// Bytes past the last whole element are left as they were.
+			auto count = bytes / typeSize;
+			InterleavePlanes(planes.data(), count, typeSize, out);
+			memcpy(out + count * typeSize, planes.data() + count * typeSize, bytes - count * typeSize);
+		}
+		if (out != dst + offset) {
+			memcpy(dst + offset, out, size - offset);
+		}
+		written = offset + glm::min(bytes, size - offset);
+	}
+	return true;
+}
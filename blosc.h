@@ -0,0 +1,16 @@
+#pragma once
+
+// Blosc (version 1) frames, the default compressor of zarr-python and so of
+// most OME-Zarr data. A frame is a small header, a table of block offsets,
+// then the blocks, each optionally byte shuffled and split into a stream per
+// byte of the type before compression. Blocks compressed with LZ4, LZ4HC or
+// zlib are read; BloscLZ, Snappy, Zstd and bit shuffled frames are refused.
+
+// Checks the cname and shuffle of a Zarr Blosc compressor, so arrays that
+// could not be read fail when they are opened instead of on every chunk.
+bool CheckBloscSettings(const std::string& cname, int shuffle, size_t typeSize, std::string& error);
+
+// Decompresses a frame into dst. Decoding stops when the frame is done or
+// dst is full, whichever is first, and blocks past the end of dst are never
+// decompressed; written is how much of dst was filled.
+bool DecompressBlosc(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error);
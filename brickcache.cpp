@@ -0,0 +1,520 @@
+#include "brickcache.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <queue>
+
+struct BrickCache::Decodes
+{
+	std::shared_ptr<BrickFile> file;
+	std::mutex mutex;
+	// Decoded bricks for the host cache; null data means the brick failed.
+	std::vector<std::pair<uint32_t, std::shared_ptr<std::vector<uint8_t>>>> finished;
+	// Fills still writing into each staging batch.
+	std::array<std::atomic<int>, StagingBatches> pendingFills;
+	std::atomic<bool> cancelled = false;
+};
+
+BrickCache::BrickCache(std::shared_ptr<BrickFile> file, const VolumeRegion& region, const TextureFormat& format, ThreadPool& pool, size_t gpuBytes)
+	: file_(std::move(file))
+	, region_(region)
+	, format_(format)
+	, pool_(pool)
+	, decodes_(std::make_shared<Decodes>())
+{
+	auto& desc = file_->Desc();
+	levels_ = BrickLevels(desc);
+	decodes_->file = file_;
+	for (auto& pending : decodes_->pendingFills) {
+		pending = 0;
+	}
+	// Enough to keep every worker busy without queueing far ahead of a view
+	// that keeps moving.
+	maxDecodes_ = 2 * (size_t)pool_.ThreadCount();
+
+	// As close to a cube of slots as the budget allows. Slot coordinates go to
+	// the shader as bytes.
+	GLint max3dSize = 0;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max3dSize);
+	// The whole coarsest level is always resident, whatever the budget, as it is
+	// what everything else falls back on.
+	auto maxSlotsPerAxis = glm::clamp(max3dSize / desc.brickSize, 1, 255);
+	auto topBricks = levels_.back().bricks;
+	auto minSlots = (size_t)topBricks.x * topBricks.y * topBricks.z;
+	auto slotCount = glm::clamp(gpuBytes / desc.BrickBytes(), minSlots, (size_t)file_->BrickCount());
+	auto side = glm::clamp((int)std::cbrt((double)slotCount), 1, maxSlotsPerAxis);
+	auto layer = (size_t)side * side;
+	auto depth = glm::clamp((int)glm::max(slotCount / layer, (minSlots + layer - 1) / layer), 1, maxSlotsPerAxis);
+	slotGrid_ = glm::ivec3(side, side, depth);
+	slots_.resize((size_t)side * side * depth);
+
+	auto atlasSize = AtlasSize();
+	glGenTextures(1, &atlas_);
+	glBindTexture(GL_TEXTURE_3D, atlas_);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	if (GLEW_ARB_texture_storage) {
+		glTexStorage3D(GL_TEXTURE_3D, 1, format_.internalFormat, atlasSize.x, atlasSize.y, atlasSize.z);
+	} else {
+		glTexImage3D(GL_TEXTURE_3D, 0, format_.internalFormat, atlasSize.x, atlasSize.y, atlasSize.z, 0, format_.pixelFormat, format_.type, nullptr);
+	}
+
+	auto pageGrid = levels_[0].bricks;
+	pages_.assign((size_t)pageGrid.x * pageGrid.y * pageGrid.z * 4, EmptyBrickPage);
+	glGenTextures(1, &pageTable_);
+	glBindTexture(GL_TEXTURE_3D, pageTable_);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8UI, pageGrid.x, pageGrid.y, pageGrid.z, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, pages_.data());
+
+	Log("Brick cache: %d atlas slots (%.1f MB), page table %dx%dx%d\n", SlotCount(),
+		slots_.size() * desc.BrickBytes() / 1.0e6, pageGrid.x, pageGrid.y, pageGrid.z);
+	if (slots_.size() < minSlots) {
+		Log("Brick cache: the %d bricks of the coarsest level do not fit in the atlas, parts of the volume may not be drawn\n", (int)minSlots);
+	}
+}
+
+BrickCache::~BrickCache()
+{
+	// Fills write into mapped staging memory, which has to outlive them.
+	decodes_->cancelled = true;
+	for (auto& pending : decodes_->pendingFills) {
+		while (pending > 0) {
+			std::this_thread::yield();
+		}
+	}
+	for (auto& batch : batches_) {
+		if (batch.mapped) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, batch.pbo);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (batch.fence) {
+			glDeleteSync(batch.fence);
+		}
+		if (batch.pbo) {
+			glDeleteBuffers(1, &batch.pbo);
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteTextures(1, &atlas_);
+	glDeleteTextures(1, &pageTable_);
+}
+
+size_t BrickCache::Update(const glm::mat4& mvp, glm::vec2 viewportSize, size_t hostBytes, size_t uploadBytes)
+{
+	++frame_;
+	// Checked before collecting, so every decode of a finished batch has
+	// already reported whether it failed.
+	bool filled[StagingBatches];
+	for (int i = 0; i < StagingBatches; ++i) {
+		filled[i] = batches_[i].mapped && decodes_->pendingFills[i] == 0;
+	}
+	CollectDecodes();
+	size_t uploaded = 0;
+	for (int i = 0; i < StagingBatches; ++i) {
+		if (filled[i]) {
+			uploaded += FinishBatch(i);
+		}
+	}
+
+	SelectBricks(mvp, viewportSize);
+	for (auto& wanted : wanted_) {
+		auto resident = atlasSlots_.find(wanted.index);
+		if (resident != atlasSlots_.end()) {
+			slots_[resident->second].lastUsedFrame = frame_;
+		}
+		auto host = hostBricks_.find(wanted.index);
+		if (host != hostBricks_.end()) {
+			TouchHostBrick(host->second);
+		}
+	}
+	FillBatch(uploadBytes);
+
+	if (pagesDirty_) {
+		UpdatePageTable();
+	}
+	EvictHostBricks(hostBytes);
+	return uploaded;
+}
+
+// False if the brick is outside the view frustum or the region. Otherwise
+// pixelsPerVoxel is roughly how many pixels one of its voxels covers on screen.
+bool BrickCache::ProjectBrick(const glm::mat4& mvp, glm::vec2 viewportSize, int level, glm::ivec3 brick, float& pixelsPerVoxel) const
+{
+	auto origin = glm::vec3(region_.origin);
+	auto dims = glm::vec3(region_.dims);
+	auto scale = Desc().brickSize << level;
+	auto lo = glm::clamp(glm::vec3(brick * scale), origin, origin + dims);
+	auto hi = glm::clamp(glm::vec3((brick + 1) * scale), origin, origin + dims);
+	if (glm::any(glm::lessThanEqual(hi, lo))) {
+		return false;
+	}
+
+	int outside = 0x3f;
+	bool behindCamera = false;
+	auto screenMin = glm::vec2(std::numeric_limits<float>::max());
+	auto screenMax = glm::vec2(std::numeric_limits<float>::lowest());
+	for (int corner = 0; corner < 8; ++corner) {
+		auto voxel = glm::vec3(corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z);
+		// Same mapping as the shader, texture y runs down the proxy cube.
+		auto uvw = (voxel - origin) / dims;
+		auto position = glm::vec3(uvw.x, 1.0f - uvw.y, uvw.z) * 2.0f - 1.0f;
+		auto clip = mvp * glm::vec4(position, 1.0f);
+		outside &= (clip.x < -clip.w) | (clip.x > clip.w) << 1 | (clip.y < -clip.w) << 2 |
+			(clip.y > clip.w) << 3 | (clip.z < -clip.w) << 4 | (clip.z > clip.w) << 5;
+		if (clip.w <= 0.0f) {
+			behindCamera = true;
+			continue;
+		}
+		auto screen = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * viewportSize;
+		screenMin = glm::min(screenMin, screen);
+		screenMax = glm::max(screenMax, screen);
+	}
+	// All eight corners beyond the same clip plane.
+	if (outside) {
+		return false;
+	}
+
+	// A brick reaching behind the camera is as close as it gets.
+	if (behindCamera) {
+		pixelsPerVoxel = std::numeric_limits<float>::max();
+		return true;
+	}
+	auto voxels = (hi - lo) / (float)(1 << level);
+	auto extent = screenMax - screenMin;
+	pixelsPerVoxel = glm::max(extent.x, extent.y) / glm::max(glm::max(voxels.x, voxels.y), glm::max(voxels.z, 1.0f));
+	return true;
+}
+
+void BrickCache::SelectBricks(const glm::mat4& mvp, glm::vec2 viewportSize)
+{
+	wanted_.clear();
+	auto lessMagnified = [](const WantedBrick& a, const WantedBrick& b) { return a.pixelsPerVoxel < b.pixelsPerVoxel; };
+	std::priority_queue<WantedBrick, std::vector<WantedBrick>, decltype(lessMagnified)> candidates(lessMagnified);
+
+	// Every visible brick of the coarsest level is always wanted, so there is
+	// something to fall back on anywhere finer bricks are still loading. With
+	// the full set of levels that is a single brick, but files written with
+	// fewer levels have a grid of them.
+	auto coarsest = (int)levels_.size() - 1;
+	auto topBricks = levels_[coarsest].bricks;
+	for (int z = 0; z < topBricks.z; ++z) {
+		for (int y = 0; y < topBricks.y; ++y) {
+			for (int x = 0; x < topBricks.x; ++x) {
+				WantedBrick root;
+				root.level = coarsest;
+				root.brick = glm::ivec3(x, y, z);
+				if (ProjectBrick(mvp, viewportSize, root.level, root.brick, root.pixelsPerVoxel)) {
+					root.index = file_->BrickIndex(root.level, root.brick);
+					candidates.push(root);
+				}
+			}
+		}
+	}
+	// Coarsest bricks that were split, still wanted alongside their children.
+	std::vector<WantedBrick> splitRoots;
+
+	// Split whichever brick is most magnified on screen into its visible
+	// children, until every brick is down to about a voxel per pixel or the
+	// next split would not fit in the atlas.
+	std::vector<WantedBrick> children;
+	while (!candidates.empty()) {
+		auto parent = candidates.top();
+		candidates.pop();
+		if (parent.level == 0 || parent.pixelsPerVoxel <= 1.0f) {
+			wanted_.push_back(parent);
+			continue;
+		}
+
+		children.clear();
+		auto& finer = levels_[parent.level - 1];
+		auto first = parent.brick * 2;
+		auto last = glm::min(first + 2, finer.bricks);
+		for (int z = first.z; z < last.z; ++z) {
+			for (int y = first.y; y < last.y; ++y) {
+				for (int x = first.x; x < last.x; ++x) {
+					WantedBrick child;
+					child.level = parent.level - 1;
+					child.brick = glm::ivec3(x, y, z);
+					if (ProjectBrick(mvp, viewportSize, child.level, child.brick, child.pixelsPerVoxel)) {
+						child.index = file_->BrickIndex(child.level, child.brick);
+						children.push_back(child);
+					}
+				}
+			}
+		}
+		auto kept = parent.level == coarsest ? 1 : 0;
+		if (wanted_.size() + candidates.size() + splitRoots.size() + kept + children.size() > slots_.size()) {
+			wanted_.push_back(parent);
+			continue;
+		}
+		if (kept) {
+			splitRoots.push_back(parent);
+		}
+		for (auto& child : children) {
+			candidates.push(child);
+		}
+	}
+	wanted_.insert(wanted_.end(), splitRoots.begin(), splitRoots.end());
+
+	// Coarse bricks first, so the whole view is covered before it is refined.
+	std::sort(wanted_.begin(), wanted_.end(), [](const WantedBrick& a, const WantedBrick& b) {
+		return a.level != b.level ? a.level > b.level : a.pixelsPerVoxel > b.pixelsPerVoxel;
+	});
+}
+
+void BrickCache::CollectDecodes()
+{
+	std::vector<std::pair<uint32_t, std::shared_ptr<std::vector<uint8_t>>>> finished;
+	{
+		std::lock_guard<std::mutex> lock(decodes_->mutex);
+		finished.swap(decodes_->finished);
+	}
+	for (auto& decoded : finished) {
+		if (!decoded.second) {
+			failed_.insert(decoded.first);
+			continue;
+		}
+		hostLru_.push_front(decoded.first);
+		auto& host = hostBricks_[decoded.first];
+		host.data = std::move(decoded.second);
+		host.lruPosition = hostLru_.begin();
+	}
+}
+
+void BrickCache::TouchHostBrick(HostBrick& host)
+{
+	hostLru_.splice(hostLru_.begin(), hostLru_, host.lruPosition);
+}
+
+void BrickCache::EvictHostBricks(size_t hostBytes)
+{
+	auto maxBricks = hostBytes / Desc().BrickBytes();
+	while (hostBricks_.size() > maxBricks) {
+		hostBricks_.erase(hostLru_.back());
+		hostLru_.pop_back();
+	}
+}
+
+// A free slot if there is one, otherwise the one unused for longest. Slots
+// used this frame hold bricks the current view needs and are never taken.
+int BrickCache::AllocateSlot()
+{
+	int oldest = -1;
+	for (int i = 0; i < (int)slots_.size(); ++i) {
+		auto& slot = slots_[i];
+		if (slot.index == NoBrick) {
+			return i;
+		}
+		if (!slot.loading && slot.lastUsedFrame < frame_ && (oldest < 0 || slot.lastUsedFrame < slots_[oldest].lastUsedFrame)) {
+			oldest = i;
+		}
+	}
+	return oldest;
+}
+
+glm::ivec3 BrickCache::SlotPosition(int slot) const
+{
+	return glm::ivec3(slot % slotGrid_.x, slot / slotGrid_.x % slotGrid_.y, slot / (slotGrid_.x * slotGrid_.y));
+}
+
+void BrickCache::ReserveSlot(int slot, const WantedBrick& wanted)
+{
+	auto& entry = slots_[slot];
+	if (entry.index != NoBrick) {
+		atlasSlots_.erase(entry.index);
+		pagesDirty_ = true;
+	}
+	entry.index = wanted.index;
+	entry.level = wanted.level;
+	entry.brick = wanted.brick;
+	entry.lastUsedFrame = frame_;
+	entry.loading = true;
+	pending_.insert(wanted.index);
+}
+
+// Starts the next staging batch on the wanted bricks missing from the atlas,
+// coarse first, up to the upload budget.
+void BrickCache::FillBatch(size_t uploadBytes)
+{
+	auto& batch = batches_[nextBatch_];
+	if (batch.mapped) {
+		return;
+	}
+	// The GPU may still be copying out of this buffer from a previous frame.
+	if (batch.fence) {
+		if (glClientWaitSync(batch.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			return;
+		}
+		glDeleteSync(batch.fence);
+		batch.fence = nullptr;
+	}
+
+	auto brickBytes = Desc().BrickBytes();
+	auto maxBricks = glm::max(uploadBytes / brickBytes, (size_t)1);
+	// Host copy of each brick, or null where it has to be decoded.
+	std::vector<std::shared_ptr<std::vector<uint8_t>>> sources;
+	size_t decodes = 0;
+	batch.slots.clear();
+	for (auto& wanted : wanted_) {
+		if (batch.slots.size() == maxBricks) {
+			break;
+		}
+		if (atlasSlots_.count(wanted.index) || pending_.count(wanted.index) || failed_.count(wanted.index)) {
+			continue;
+		}
+		auto host = hostBricks_.find(wanted.index);
+		if (host == hostBricks_.end() && decodes == maxDecodes_) {
+			continue;
+		}
+		auto slot = AllocateSlot();
+		if (slot < 0) {
+			break;
+		}
+		ReserveSlot(slot, wanted);
+		batch.slots.push_back(slot);
+		if (host != hostBricks_.end()) {
+			sources.push_back(host->second.data);
+		} else {
+			sources.push_back(nullptr);
+			++decodes;
+		}
+	}
+	if (batch.slots.empty()) {
+		return;
+	}
+
+	auto bytes = batch.slots.size() * brickBytes;
+	if (!batch.pbo) {
+		glGenBuffers(1, &batch.pbo);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, batch.pbo);
+	// Re-specifying the store orphans whatever the GPU was still reading.
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	batch.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!batch.mapped) {
+		for (auto slot : batch.slots) {
+			pending_.erase(slots_[slot].index);
+			slots_[slot] = Slot();
+		}
+		batch.slots.clear();
+		return;
+	}
+
+	auto batchIndex = nextBatch_;
+	decodes_->pendingFills[batchIndex] = (int)batch.slots.size();
+	for (size_t i = 0; i < batch.slots.size(); ++i) {
+		auto decodes = decodes_;
+		auto index = slots_[batch.slots[i]].index;
+		auto source = sources[i];
+		auto dst = batch.mapped + i * brickBytes;
+		pool_.Submit([decodes, batchIndex, index, source, dst] {
+			if (source) {
+				memcpy(dst, source->data(), source->size());
+			} else if (!decodes->cancelled) {
+				auto& file = *decodes->file;
+				auto decoded = std::make_shared<std::vector<uint8_t>>(file.Desc().BrickBytes());
+				std::string error;
+				if (file.ReadBrick(index, decoded->data(), error)) {
+					memcpy(dst, decoded->data(), decoded->size());
+				} else {
+					Log("Failed to read brick: %s\n", error.c_str());
+					decoded.reset();
+				}
+				std::lock_guard<std::mutex> lock(decodes->mutex);
+				decodes->finished.emplace_back(index, std::move(decoded));
+			}
+			--decodes->pendingFills[batchIndex];
+		});
+	}
+	nextBatch_ = (nextBatch_ + 1) % StagingBatches;
+}
+
+// Render thread, once the pool has filled every brick of the batch.
+size_t BrickCache::FinishBatch(int batchIndex)
+{
+	auto& batch = batches_[batchIndex];
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, batch.pbo);
+	// The store can be lost while mapped (a mode switch, say); the bricks
+	// are then simply asked for again.
+	auto intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+	batch.mapped = nullptr;
+
+	auto brickSize = Desc().brickSize;
+	auto brickBytes = Desc().BrickBytes();
+	size_t uploaded = 0;
+	glBindTexture(GL_TEXTURE_3D, atlas_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t i = 0; i < batch.slots.size(); ++i) {
+		auto slot = batch.slots[i];
+		auto& entry = slots_[slot];
+		pending_.erase(entry.index);
+		if (!intact || failed_.count(entry.index)) {
+			entry = Slot();
+			continue;
+		}
+		auto origin = SlotPosition(slot) * brickSize;
+		glTexSubImage3D(GL_TEXTURE_3D, 0, origin.x, origin.y, origin.z, brickSize, brickSize, brickSize,
+			format_.pixelFormat, format_.type, (const void*)(i * brickBytes));
+		uploaded += brickBytes;
+		entry.loading = false;
+		atlasSlots_[entry.index] = slot;
+	}
+	batch.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	batch.slots.clear();
+	pagesDirty_ = true;
+	return uploaded;
+}
+
+// Paints every resident brick over the level 0 bricks it covers, coarsest
+// first, so each page ends up pointing at the finest brick available for it.
+void BrickCache::UpdatePageTable()
+{
+	auto grid = levels_[0].bricks;
+	std::fill(pages_.begin(), pages_.end(), EmptyBrickPage);
+
+	std::vector<int> order;
+	for (int i = 0; i < (int)slots_.size(); ++i) {
+		if (slots_[i].index != NoBrick && !slots_[i].loading) {
+			order.push_back(i);
+		}
+	}
+	std::sort(order.begin(), order.end(), [this](int a, int b) { return slots_[a].level > slots_[b].level; });
+
+	for (auto i : order) {
+		auto& slot = slots_[i];
+		auto position = SlotPosition(i);
+		auto first = slot.brick << slot.level;
+		auto last = glm::min((slot.brick + 1) << slot.level, grid);
+		for (int z = first.z; z < last.z; ++z) {
+			for (int y = first.y; y < last.y; ++y) {
+				auto page = &pages_[(((size_t)z * grid.y + y) * grid.x + first.x) * 4];
+				for (int x = first.x; x < last.x; ++x, page += 4) {
+					page[0] = (uint8_t)position.x;
+					page[1] = (uint8_t)position.y;
+					page[2] = (uint8_t)position.z;
+					page[3] = (uint8_t)slot.level;
+				}
+			}
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_3D, pageTable_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, grid.x, grid.y, grid.z, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, pages_.data());
+	pagesDirty_ = false;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "brickfile.h"
+#include "threadpool.h"
+#include "volumeupload.h"
+
+#include <array>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+// Page table entry level for parts of the volume with nothing resident.
+const uint8_t EmptyBrickPage = 255;
+
+// Out-of-core rendering of a brick file too big for host memory or VRAM.
+// Bricks live in three tiers: the memory mapped file, a host side LRU of
+// decoded bricks, and a fixed size atlas texture of brick slots on the GPU.
+// Every frame the bricks intersecting the view are chosen at the coarsest
+// level that still gives about a voxel per pixel, missing ones are decoded on
+// the pool and uploaded, and a page table texture tells the shader which atlas
+// slot covers each level 0 brick. Parts of the volume without a resident
+// brick fall back to the finest coarser one that is. When only a region of
+// the volume is shown, the proxy cube spans that region and bricks outside it
+// are never loaded.
+//
+// Uploads go through a small ring of staging batches, pixel buffers holding
+// a frame's worth of bricks back to back. The render thread only maps a batch
+// and hands out brick sized pieces of it; pool workers decode bricks from the
+// file, or copy them out of host memory, straight into the mapping. Once every
+// piece is filled the batch is unmapped and copied into the atlas slots.
+class BrickCache
+{
+public:
+	BrickCache(std::shared_ptr<BrickFile> file, const VolumeRegion& region, const TextureFormat& format, ThreadPool& pool, size_t gpuBytes);
+	~BrickCache();
+	BrickCache(const BrickCache&) = delete;
+	BrickCache& operator=(const BrickCache&) = delete;
+
+	// Render thread, once per frame. mvp takes the [-1, 1] proxy cube, which
+	// spans Region(), to clip space. hostBytes caps the decoded brick LRU,
+	// uploadBytes the atlas uploads this frame. Returns the bytes copied into
+	// the atlas.
+	size_t Update(const glm::mat4& mvp, glm::vec2 viewportSize, size_t hostBytes, size_t uploadBytes);
+
+	const BrickFileDesc& Desc() const { return file_->Desc(); }
+	// Level 0 voxels shown.
+	const VolumeRegion& Region() const { return region_; }
+	// RGBA8UI, one texel per level 0 brick: atlas slot in xyz, level in w, or
+	// w == EmptyBrickPage where nothing covering that brick is resident.
+	GLuint PageTable() const { return pageTable_; }
+	GLuint Atlas() const { return atlas_; }
+	// In voxels, slots times brick size.
+	glm::ivec3 AtlasSize() const { return slotGrid_ * Desc().brickSize; }
+
+	int WantedBricks() const { return (int)wanted_.size(); }
+	int GpuBricks() const { return (int)atlasSlots_.size(); }
+	int SlotCount() const { return (int)slots_.size(); }
+	int HostBricks() const { return (int)hostBricks_.size(); }
+	// Bricks in a staging batch on their way to the atlas.
+	int LoadingBricks() const { return (int)pending_.size(); }
+
+private:
+	static const uint32_t NoBrick = 0xffffffff;
+	static const int StagingBatches = 3;
+
+	struct WantedBrick
+	{
+		uint32_t index;
+		int level;
+		glm::ivec3 brick;
+		float pixelsPerVoxel;
+	};
+
+	struct Slot
+	{
+		uint32_t index = NoBrick;
+		int level = 0;
+		glm::ivec3 brick = glm::ivec3(0);
+		uint64_t lastUsedFrame = 0;
+		// Reserved for a brick in a staging batch; not in the page table yet.
+		bool loading = false;
+	};
+
+	struct HostBrick
+	{
+		// Shared with any fill still copying out of it.
+		std::shared_ptr<std::vector<uint8_t>> data;
+		std::list<uint32_t>::iterator lruPosition;
+	};
+
+	struct StagingBatch
+	{
+		GLuint pbo = 0;
+		GLsync fence = nullptr;
+		uint8_t* mapped = nullptr;
+		// Atlas slot of each brick in the buffer, in order.
+		std::vector<int> slots;
+	};
+
+	// Shared with the decode tasks, so one finishing after the cache has gone
+	// still has somewhere to put its result.
+	struct Decodes;
+
+	bool ProjectBrick(const glm::mat4& mvp, glm::vec2 viewportSize, int level, glm::ivec3 brick, float& pixelsPerVoxel) const;
+	void SelectBricks(const glm::mat4& mvp, glm::vec2 viewportSize);
+	void CollectDecodes();
+	void TouchHostBrick(HostBrick& host);
+	void EvictHostBricks(size_t hostBytes);
+	int AllocateSlot();
+	void ReserveSlot(int slot, const WantedBrick& wanted);
+	glm::ivec3 SlotPosition(int slot) const;
+	void FillBatch(size_t uploadBytes);
+	size_t FinishBatch(int batch);
+	void UpdatePageTable();
+
+	std::shared_ptr<BrickFile> file_;
+	VolumeRegion region_;
+	std::vector<BrickLevel> levels_;
+	TextureFormat format_;
+	ThreadPool& pool_;
+	std::shared_ptr<Decodes> decodes_;
+	// Bricks decoded per batch, so a view that keeps moving is not stuck
+	// behind a long queue.
+	size_t maxDecodes_;
+	uint64_t frame_ = 0;
+
+	std::vector<WantedBrick> wanted_;
+
+	std::unordered_map<uint32_t, HostBrick> hostBricks_;
+	// Most recently used at the front.
+	std::list<uint32_t> hostLru_;
+	std::unordered_set<uint32_t> pending_;
+	StagingBatch batches_[StagingBatches];
+	int nextBatch_ = 0;
+	// Bricks that failed to decode are not asked for again.
+	std::unordered_set<uint32_t> failed_;
+
+	GLuint atlas_ = 0;
+	glm::ivec3 slotGrid_ = glm::ivec3(0);
+	std::vector<Slot> slots_;
+	// Brick index to atlas slot.
+	std::unordered_map<uint32_t, int> atlasSlots_;
+
+	GLuint pageTable_ = 0;
+	std::vector<uint8_t> pages_;
+	bool pagesDirty_ = true;
+};
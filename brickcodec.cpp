@@ -0,0 +1,248 @@
+#include "brickcodec.h"
+
+#include "prefixsum.h"
+
+#include <cstring>
+#include <emmintrin.h>
+
+namespace {
+
+// The LZ stage is a byte oriented LZ77 in the style of LZ4: a stream of
+// sequences, each a token byte (literal count in the high nibble, match
+// length - MinMatch in the low), the literals, then a 16 bit match offset.
+// A nibble of 15 continues in extra bytes of 255 until one is smaller. The
+// last sequence has literals only.
+const size_t MinMatch = 4;
+const size_t MaxOffset = 65535;
+const int HashBits = 14;
+// Matches are not started this close to the end, so the search never reads
+// past the input.
+const size_t EndMargin = 8;
+
+uint32_t Read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return value;
+}
+
+uint32_t Hash(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - HashBits);
+}
+
+void WriteLength(std::vector<uint8_t>& out, size_t length)
+{
+	for (; length >= 255; length -= 255) {
+		out.push_back(255);
+	}
+	out.push_back((uint8_t)length);
+}
+
+void WriteSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength)
+{
+	auto matchCode = matchLength ? matchLength - MinMatch : 0;
+	out.push_back((uint8_t)(glm::min(literalCount, (size_t)15) << 4 | glm::min(matchCode, (size_t)15)));
+	if (literalCount >= 15) {
+		WriteLength(out, literalCount - 15);
+	}
+	out.insert(out.end(), literals, literals + literalCount);
+	if (matchLength == 0) {
+		return;
+	}
+	out.push_back((uint8_t)offset);
+	out.push_back((uint8_t)(offset >> 8));
+	if (matchCode >= 15) {
+		WriteLength(out, matchCode - 15);
+	}
+}
+
+void LzCompress(const uint8_t* src, size_t size, std::vector<uint8_t>& out)
+{
+	thread_local std::vector<uint32_t> table;
+	table.assign((size_t)1 << HashBits, 0);
+	out.clear();
+
+	size_t anchor = 0;
+	size_t pos = 0;
+	auto limit = size > EndMargin ? size - EndMargin : 0;
+	while (pos < limit) {
+		auto value = Read32(src + pos);
+		auto& slot = table[Hash(value)];
+		size_t candidate = slot;
+		slot = (uint32_t)pos;
+		if (candidate >= pos || pos - candidate > MaxOffset || Read32(src + candidate) != value) {
+			// Step further through data that is not matching, so noise costs
+			// less time.
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+
+		auto length = MinMatch;
+		while (pos + length < size && src[candidate + length] == src[pos + length]) {
+			++length;
+		}
+		WriteSequence(out, src + anchor, pos - anchor, pos - candidate, length);
+		pos += length;
+		anchor = pos;
+	}
+	WriteSequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+bool ReadLength(const uint8_t*& in, const uint8_t* end, size_t& length)
+{
+	uint8_t byte;
+	do {
+		if (in == end) {
+			return false;
+		}
+		byte = *in++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+}
+
+bool LzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, std::string& error)
+{
+	auto in = src;
+	auto end = src + srcSize;
+	auto out = dst;
+	auto outEnd = dst + dstSize;
+	while (true) {
+		if (in == end) {
+			error = "Truncated LZ stream";
+			return false;
+		}
+		auto token = *in++;
+		size_t literalCount = token >> 4;
+		if (literalCount == 15 && !ReadLength(in, end, literalCount)) {
+			error = "Truncated LZ stream";
+			return false;
+		}
+		if (literalCount > (size_t)(end - in) || literalCount > (size_t)(outEnd - out)) {
+			error = "LZ literals overrun";
+			return false;
+		}
+		memcpy(out, in, literalCount);
+		in += literalCount;
+		out += literalCount;
+		if (in == end) {
+			break;
+		}
+
+		if (end - in < 2) {
+			error = "Truncated LZ stream";
+			return false;
+		}
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		size_t length = token & 15;
+		if (length == 15 && !ReadLength(in, end, length)) {
+			error = "Truncated LZ stream";
+			return false;
+		}
+		length += MinMatch;
+		if (offset == 0 || offset > (size_t)(out - dst) || length > (size_t)(outEnd - out)) {
+			error = "LZ match overrun";
+			return false;
+		}
+		auto from = out - offset;
+		if (offset >= length) {
+			memcpy(out, from, length);
+		} else {
+			for (size_t i = 0; i < length; ++i) {
+				out[i] = from[i];
+			}
+		}
+		out += length;
+	}
+	if (out != outEnd) {
+		error = "LZ stream decoded to " + std::to_string(out - dst) + " of " + std::to_string(dstSize) + " bytes";
+		return false;
+	}
+	return true;
+}
+
+// Two and four byte voxels are interleaved 16 at a time with unpacks.
+void InterleavePlanes(const uint8_t* planes, size_t voxelCount, size_t voxelBytes, uint8_t* dst)
+{
+	size_t i = 0;
+	if (voxelBytes == 2) {
+		auto p0 = planes;
+		auto p1 = planes + voxelCount;
+		for (; i + 16 <= voxelCount; i += 16) {
+			auto a = _mm_loadu_si128((const __m128i*)(p0 + i));
+			auto b = _mm_loadu_si128((const __m128i*)(p1 + i));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi8(a, b));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+		}
+	} else if (voxelBytes == 4) {
+		auto p0 = planes;
+		auto p1 = planes + voxelCount;
+		auto p2 = planes + 2 * voxelCount;
+		auto p3 = planes + 3 * voxelCount;
+		for (; i + 16 <= voxelCount; i += 16) {
+			auto a = _mm_loadu_si128((const __m128i*)(p0 + i));
+			auto b = _mm_loadu_si128((const __m128i*)(p1 + i));
+			auto c = _mm_loadu_si128((const __m128i*)(p2 + i));
+			auto d = _mm_loadu_si128((const __m128i*)(p3 + i));
+			auto abLow = _mm_unpacklo_epi8(a, b);
+			auto abHigh = _mm_unpackhi_epi8(a, b);
+			auto cdLow = _mm_unpacklo_epi8(c, d);
+			auto cdHigh = _mm_unpackhi_epi8(c, d);
+			_mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_unpacklo_epi16(abLow, cdLow));
+			_mm_storeu_si128((__m128i*)(dst + 4 * i + 16), _mm_unpackhi_epi16(abLow, cdLow));
+			_mm_storeu_si128((__m128i*)(dst + 4 * i + 32), _mm_unpacklo_epi16(abHigh, cdHigh));
+			_mm_storeu_si128((__m128i*)(dst + 4 * i + 48), _mm_unpackhi_epi16(abHigh, cdHigh));
+		}
+	}
+	for (; i < voxelCount; ++i) {
+		for (size_t plane = 0; plane < voxelBytes; ++plane) {
+			dst[i * voxelBytes + plane] = planes[plane * voxelCount + i];
+		}
+	}
+}
+
+bool EncodeBrick(const uint8_t* brick, size_t size, size_t voxelBytes, std::vector<uint8_t>& encoded)
+{
+	thread_local std::vector<uint8_t> planes;
+	planes.resize(size);
+	auto voxelCount = size / voxelBytes;
+	for (size_t plane = 0; plane < voxelBytes; ++plane) {
+		auto out = planes.data() + plane * voxelCount;
+		uint8_t previous = 0;
+		for (size_t i = 0; i < voxelCount; ++i) {
+			auto value = brick[i * voxelBytes + plane];
+			out[i] = (uint8_t)(value - previous);
+			previous = value;
+		}
+	}
+
+	LzCompress(planes.data(), size, encoded);
+	return encoded.size() < size;
+}
+
+bool DecodeBrick(const uint8_t* src, size_t srcSize, size_t voxelBytes, uint8_t* dst, size_t dstSize, std::string& error)
+{
+	if (voxelBytes == 1) {
+		if (!LzDecompress(src, srcSize, dst, dstSize, error)) {
+			return false;
+		}
+		PrefixSumBytes(dst, dstSize);
+		return true;
+	}
+
+	thread_local std::vector<uint8_t> planes;
+	planes.resize(dstSize);
+	if (!LzDecompress(src, srcSize, planes.data(), dstSize, error)) {
+		return false;
+	}
+	auto voxelCount = dstSize / voxelBytes;
+	for (size_t plane = 0; plane < voxelBytes; ++plane) {
+		PrefixSumBytes(planes.data() + plane * voxelCount, voxelCount);
+	}
+	InterleavePlanes(planes.data(), voxelCount, voxelBytes, dst);
+	return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Lossless brick compression tuned for voxel data. Each byte of a voxel goes
+// to its own plane (low bytes, high bytes, R, G, B, A...), each plane is delta
+// coded against the previous voxel, then the planes are LZ compressed. Smooth
+// data leaves mostly small deltas in the low planes and long runs of zeros in
+// the high ones, which the LZ stage collapses cheaply.
+
+// Returns false if the brick did not get smaller; store it raw instead.
+bool EncodeBrick(const uint8_t* brick, size_t size, size_t voxelBytes, std::vector<uint8_t>& encoded);
+// dstSize is the decoded brick size.
+bool DecodeBrick(const uint8_t* src, size_t srcSize, size_t voxelBytes, uint8_t* dst, size_t dstSize, std::string& error);
+
+// The LZ stage on its own. Its stream is the LZ4 block format, so this also
+// reads blocks written by LZ4 itself; dst must be filled exactly.
+bool LzDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, std::string& error);
+// Puts voxelBytes planes of voxelCount bytes each back together into voxels,
+// which also undoes a Blosc byte shuffle.
+void InterleavePlanes(const uint8_t* planes, size_t voxelCount, size_t voxelBytes, uint8_t* dst);
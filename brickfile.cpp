@@ -0,0 +1,346 @@
+#include "brickfile.h"
+
+#include "brickcodec.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+const char BrickFileMagic[8] = { 'V', 'R', 'B', 'R', 'I', 'C', 'K', 'S' };
+const uint32_t BrickFileVersion = 1;
+// Brick payloads start on this boundary so they can be read in place as any
+// voxel type.
+const uint64_t BrickAlignment = 16;
+
+struct BrickFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t voxelType;
+	int32_t dims[3];
+	uint32_t channels;
+	float spacing[3];
+	uint32_t brickSize;
+	uint32_t levelCount;
+	uint32_t histogramBins;
+	float valueRange[2];
+	uint64_t brickCount;
+};
+static_assert(sizeof(BrickFileHeader) == 72, "BrickFileHeader is written to disk as is");
+
+uint64_t TableOffset(uint32_t histogramBins)
+{
+	return sizeof(BrickFileHeader) + histogramBins * sizeof(uint64_t);
+}
+
+template<typename T>
+void StatsForType(const uint8_t* brick, int channels, int brickSize, glm::ivec3 validSize, BrickStats& stats)
+{
+	auto minValue = std::numeric_limits<double>::max();
+	auto maxValue = std::numeric_limits<double>::lowest();
+	double sum = 0.0;
+	size_t count = 0;
+	auto voxelBytes = sizeof(T) * channels;
+	auto channelOffset = sizeof(T) * (channels - 1);
+	for (int z = 0; z < validSize.z; ++z) {
+		for (int y = 0; y < validSize.y; ++y) {
+			auto row = brick + ((size_t)z * brickSize + y) * brickSize * voxelBytes + channelOffset;
+			for (int x = 0; x < validSize.x; ++x) {
+				T value;
+				memcpy(&value, row + x * voxelBytes, sizeof(T));
+				auto v = (double)value;
+				if (std::isfinite(v)) {
+					minValue = glm::min(minValue, v);
+					maxValue = glm::max(maxValue, v);
+					sum += v;
+					++count;
+				}
+			}
+		}
+	}
+	if (count == 0) {
+		stats = BrickStats();
+		return;
+	}
+	stats.min = (float)minValue;
+	stats.max = (float)maxValue;
+	stats.mean = (float)(sum / count);
+}
+
+}
+
+std::vector<BrickLevel> BrickLevels(const BrickFileDesc& desc)
+{
+	std::vector<BrickLevel> levels(desc.levelCount);
+	uint32_t firstBrick = 0;
+	for (int i = 0; i < desc.levelCount; ++i) {
+		auto& level = levels[i];
+		// Rounded up without adding first, so sizes near the top of an int
+		// cannot overflow.
+		level.dims = ((desc.volume.dims - 1) >> i) + 1;
+		level.bricks = (level.dims - 1) / desc.brickSize + 1;
+		level.firstBrick = firstBrick;
+		firstBrick += level.BrickCount();
+	}
+	return levels;
+}
+
+bool IsValidBrickLayout(const BrickFileDesc& desc)
+{
+	if (desc.brickSize < MinBrickSize || desc.brickSize > MaxBrickSize || (desc.brickSize & (desc.brickSize - 1)) != 0
+		|| desc.levelCount < 1 || desc.levelCount > MaxBrickLevels || glm::any(glm::lessThanEqual(desc.volume.dims, glm::ivec3(0)))) {
+		return false;
+	}
+	// Counted in 64 bits, as BrickLevels wraps if there are too many.
+	uint64_t brickCount = 0;
+	for (auto& level : BrickLevels(desc)) {
+		auto layer = (uint64_t)level.bricks.x * level.bricks.y;
+		if (layer > std::numeric_limits<uint32_t>::max()) {
+			return false;
+		}
+		brickCount += layer * level.bricks.z;
+		if (brickCount > std::numeric_limits<uint32_t>::max()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void ExtractBrick(const uint8_t* volume, glm::ivec3 dims, size_t voxelBytes, glm::ivec3 origin, int brickSize, uint8_t* brick)
+{
+	auto validSize = glm::min(dims - origin, glm::ivec3(brickSize));
+	auto brickRowBytes = brickSize * voxelBytes;
+	auto validRowBytes = validSize.x * voxelBytes;
+	for (int z = 0; z < brickSize; ++z) {
+		auto srcZ = origin.z + glm::min(z, validSize.z - 1);
+		for (int y = 0; y < brickSize; ++y) {
+			auto srcY = origin.y + glm::min(y, validSize.y - 1);
+			auto src = volume + (((size_t)srcZ * dims.y + srcY) * dims.x + origin.x) * voxelBytes;
+			auto dst = brick + ((size_t)z * brickSize + y) * brickRowBytes;
+			memcpy(dst, src, validRowBytes);
+			for (auto x = validRowBytes; x < brickRowBytes; x += voxelBytes) {
+				memcpy(dst + x, src + validRowBytes - voxelBytes, voxelBytes);
+			}
+		}
+	}
+}
+
+void CalculateBrickStats(const uint8_t* brick, VoxelType voxelType, int channels, int brickSize, glm::ivec3 validSize, BrickStats& stats)
+{
+	switch (voxelType) {
+	case VoxelType::UInt8: StatsForType<uint8_t>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::Int8: StatsForType<int8_t>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::UInt16: StatsForType<uint16_t>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::Int16: StatsForType<int16_t>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::UInt32: StatsForType<uint32_t>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::Int32: StatsForType<int32_t>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::Float32: StatsForType<float>(brick, channels, brickSize, validSize, stats); break;
+	case VoxelType::Float64: StatsForType<double>(brick, channels, brickSize, validSize, stats); break;
+	}
+}
+
+bool BrickFileWriter::Open(const std::experimental::filesystem::path& filepath, const BrickFileDesc& desc, std::string& error)
+{
+	if (!IsValidBrickLayout(desc)) {
+		error = "Bad brick file layout";
+		return false;
+	}
+	desc_ = desc;
+	levels_ = BrickLevels(desc_);
+	auto brickCount = levels_.back().firstBrick + levels_.back().BrickCount();
+	entries_.assign(brickCount, BrickEntry());
+
+	file_.open(filepath, std::ios::binary | std::ios::trunc);
+	if (!file_) {
+		error = "Failed to create " + filepath.string();
+		return false;
+	}
+	// The header and table are written last, payloads go after their space.
+	auto headerBytes = TableOffset(HistogramBins) + brickCount * sizeof(BrickEntry);
+	nextOffset_ = (headerBytes + BrickAlignment - 1) & ~(BrickAlignment - 1);
+	return true;
+}
+
+bool BrickFileWriter::WriteBrick(uint32_t brickIndex, const uint8_t* data, size_t size, BrickEncoding encoding, const BrickStats& stats, std::string& error)
+{
+	if (brickIndex >= entries_.size()) {
+		error = "Brick index out of range";
+		return false;
+	}
+	auto& entry = entries_[brickIndex];
+	entry.offset = nextOffset_;
+	entry.storedSize = size;
+	entry.encoding = encoding;
+	entry.stats = stats;
+
+	file_.seekp(nextOffset_);
+	file_.write((const char*)data, size);
+	if (!file_) {
+		error = "Failed to write brick " + std::to_string(brickIndex);
+		return false;
+	}
+	nextOffset_ = (nextOffset_ + size + BrickAlignment - 1) & ~(BrickAlignment - 1);
+	return true;
+}
+
+bool BrickFileWriter::Finish(std::string& error)
+{
+	BrickFileHeader header = {};
+	memcpy(header.magic, BrickFileMagic, sizeof(header.magic));
+	header.version = BrickFileVersion;
+	header.voxelType = (uint32_t)desc_.volume.voxelType;
+	header.channels = desc_.volume.channels;
+	for (int i = 0; i < 3; ++i) {
+		header.dims[i] = desc_.volume.dims[i];
+		header.spacing[i] = desc_.volume.spacing[i];
+	}
+	header.brickSize = desc_.brickSize;
+	header.levelCount = desc_.levelCount;
+	header.histogramBins = HistogramBins;
+	header.valueRange[0] = desc_.stats.valueRange.x;
+	header.valueRange[1] = desc_.stats.valueRange.y;
+	header.brickCount = entries_.size();
+
+	auto histogram = desc_.stats.histogram;
+	histogram.resize(HistogramBins, 0);
+	file_.seekp(0);
+	file_.write((const char*)&header, sizeof(header));
+	file_.write((const char*)histogram.data(), histogram.size() * sizeof(uint64_t));
+	file_.write((const char*)entries_.data(), entries_.size() * sizeof(BrickEntry));
+	file_.close();
+	if (!file_) {
+		error = "Failed to write brick file header";
+		return false;
+	}
+	return true;
+}
+
+bool BrickFile::Open(const std::experimental::filesystem::path& filepath, std::string& error)
+{
+	if (!file_.Open(filepath)) {
+		error = "Failed to open " + filepath.string();
+		return false;
+	}
+
+	BrickFileHeader header;
+	if (file_.Size() < sizeof(header)) {
+		error = "Not a brick file";
+		return false;
+	}
+	memcpy(&header, file_.Data(), sizeof(header));
+	if (memcmp(header.magic, BrickFileMagic, sizeof(header.magic)) != 0) {
+		error = "Not a brick file";
+		return false;
+	}
+	if (header.version != BrickFileVersion) {
+		error = "Unsupported brick file version " + std::to_string(header.version);
+		return false;
+	}
+	if (header.voxelType > (uint32_t)VoxelType::Float64 || header.channels < 1 || header.channels > 4
+		|| header.brickSize > (uint32_t)MaxBrickSize || header.levelCount > (uint32_t)MaxBrickLevels) {
+		error = "Bad brick file header";
+		return false;
+	}
+
+	desc_ = BrickFileDesc();
+	desc_.volume.dataFile = filepath;
+	desc_.volume.voxelType = (VoxelType)header.voxelType;
+	desc_.volume.channels = header.channels;
+	desc_.volume.dims = glm::ivec3(header.dims[0], header.dims[1], header.dims[2]);
+	desc_.volume.spacing = glm::vec3(header.spacing[0], header.spacing[1], header.spacing[2]);
+	desc_.brickSize = header.brickSize;
+	desc_.levelCount = header.levelCount;
+	desc_.stats.valueRange = glm::vec2(header.valueRange[0], header.valueRange[1]);
+	if (!IsValidBrickLayout(desc_)) {
+		error = "Bad brick file header";
+		return false;
+	}
+	levels_ = BrickLevels(desc_);
+
+	auto tableOffset = TableOffset(header.histogramBins);
+	brickCount_ = levels_.back().firstBrick + levels_.back().BrickCount();
+	if (header.brickCount != brickCount_ || file_.Size() < tableOffset + brickCount_ * sizeof(BrickEntry)) {
+		error = "Brick file table is truncated";
+		return false;
+	}
+	auto histogram = (const uint64_t*)(file_.Data() + sizeof(header));
+	desc_.stats.histogram.assign(histogram, histogram + header.histogramBins);
+	entries_ = (const BrickEntry*)(file_.Data() + tableOffset);
+	for (uint32_t i = 0; i < brickCount_; ++i) {
+		auto& entry = entries_[i];
+		if (entry.offset > file_.Size() || entry.storedSize > file_.Size() - entry.offset) {
+			error = "Brick " + std::to_string(i) + " is past the end of the file";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BrickFile::ReadBrick(uint32_t index, uint8_t* dst, std::string& error) const
+{
+	auto& entry = entries_[index];
+	switch (entry.encoding) {
+	case BrickEncoding::Raw:
+		if (entry.storedSize != desc_.BrickBytes()) {
+			error = "Brick " + std::to_string(index) + " has the wrong size";
+			return false;
+		}
+		memcpy(dst, BrickData(index), entry.storedSize);
+		return true;
+	case BrickEncoding::DeltaLz:
+		if (!DecodeBrick(BrickData(index), (size_t)entry.storedSize, desc_.volume.VoxelBytes(), dst, desc_.BrickBytes(), error)) {
+			error = "Brick " + std::to_string(index) + ": " + error;
+			return false;
+		}
+		return true;
+	default:
+		error = "Brick " + std::to_string(index) + " has unknown encoding " + std::to_string((uint32_t)entry.encoding);
+		return false;
+	}
+}
+
+bool BrickFile::ReadSlices(int level, int firstSlice, int sliceCount, uint8_t* dst, std::string& error) const
+{
+	auto& info = levels_[level];
+	auto brickSize = desc_.brickSize;
+	auto voxelBytes = desc_.volume.VoxelBytes();
+	auto rowBytes = (size_t)info.dims.x * voxelBytes;
+	auto sliceBytes = rowBytes * info.dims.y;
+	auto brickRowBytes = brickSize * voxelBytes;
+	std::vector<uint8_t> scratch;
+
+	auto lastSlice = firstSlice + sliceCount;
+	for (int bz = firstSlice / brickSize; bz * brickSize < lastSlice; ++bz) {
+		auto z0 = glm::max(firstSlice, bz * brickSize);
+		auto z1 = glm::min(lastSlice, (bz + 1) * brickSize);
+		for (int by = 0; by < info.bricks.y; ++by) {
+			for (int bx = 0; bx < info.bricks.x; ++bx) {
+				auto index = BrickIndex(level, glm::ivec3(bx, by, bz));
+				// Raw bricks are copied straight out of the mapping.
+				const uint8_t* brick;
+				if (entries_[index].encoding == BrickEncoding::Raw && entries_[index].storedSize == desc_.BrickBytes()) {
+					brick = BrickData(index);
+				} else {
+					scratch.resize(desc_.BrickBytes());
+					if (!ReadBrick(index, scratch.data(), error)) {
+						return false;
+					}
+					brick = scratch.data();
+				}
+
+				auto width = glm::min(brickSize, info.dims.x - bx * brickSize) * voxelBytes;
+				auto rows = glm::min(brickSize, info.dims.y - by * brickSize);
+				for (int z = z0; z < z1; ++z) {
+					auto src = brick + (size_t)(z - bz * brickSize) * brickSize * brickRowBytes;
+					auto out = dst + (z - firstSlice) * sliceBytes + (size_t)by * brickSize * rowBytes + bx * brickRowBytes;
+					for (int y = 0; y < rows; ++y) {
+						memcpy(out + y * rowBytes, src + y * brickRowBytes, width);
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
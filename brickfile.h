@@ -0,0 +1,138 @@
+#pragma once
+
+#include "mappedfile.h"
+#include "volumeformat.h"
+#include "volumestats.h"
+
+#include <fstream>
+
+// Bricked volume file (.bricks). The volume is cut into brickSize^3 bricks,
+// each stored whole (edge bricks repeat the last voxel) so every brick has the
+// same size once decoded. Layout, all little endian:
+//   BrickFileHeader
+//   uint64_t histogram[histogramBins]
+//   BrickEntry table[brickCount], level by level, x fastest within a level
+//   brick payloads, in whatever order they were written
+// Finding a brick is an index into the table, reading it one contiguous range
+// of the file.
+
+const int DefaultBrickSize = 64;
+// Brick edges are a power of two in this range.
+const int MinBrickSize = 8;
+const int MaxBrickSize = 256;
+// Level n is 2^n times coarser than level 0, which has to fit in an int.
+const int MaxBrickLevels = 31;
+
+enum class BrickEncoding : uint32_t
+{
+	Raw = 0,
+	// Byte planes, delta coded, LZ compressed; see brickcodec.h.
+	DeltaLz = 1,
+};
+
+struct BrickStats
+{
+	// In voxel units. For multi-channel volumes these cover the last channel,
+	// which is alpha for image stacks.
+	float min = 0.0f;
+	float max = 0.0f;
+	float mean = 0.0f;
+};
+
+struct BrickEntry
+{
+	uint64_t offset;
+	uint64_t storedSize;
+	BrickEncoding encoding;
+	BrickStats stats;
+};
+static_assert(sizeof(BrickEntry) == 32, "BrickEntry is written to disk as is");
+
+// One resolution level. Level n halves level n - 1, rounding up.
+struct BrickLevel
+{
+	glm::ivec3 dims;
+	glm::ivec3 bricks;
+	uint32_t firstBrick;
+
+	uint32_t BrickCount() const { return (uint32_t)bricks.x * bricks.y * bricks.z; }
+};
+
+struct BrickFileDesc
+{
+	// Size and type of level 0. dataFile is the brick file itself.
+	VolumeDesc volume;
+	int brickSize = DefaultBrickSize;
+	int levelCount = 1;
+	// Whole volume range and histogram, so reopening skips the stats pass.
+	VolumeStats stats;
+
+	size_t BrickVoxels() const { return (size_t)brickSize * brickSize * brickSize; }
+	size_t BrickBytes() const { return BrickVoxels() * volume.VoxelBytes(); }
+};
+
+std::vector<BrickLevel> BrickLevels(const BrickFileDesc& desc);
+// Brick size, level count and dims are all in range, and the bricks of
+// every level can be indexed with 32 bits.
+bool IsValidBrickLayout(const BrickFileDesc& desc);
+
+// Copies the brick whose lowest corner is origin out of a tightly packed
+// volume of the given dims. Voxels past the edge repeat the last one.
+void ExtractBrick(const uint8_t* volume, glm::ivec3 dims, size_t voxelBytes, glm::ivec3 origin, int brickSize, uint8_t* brick);
+// Stats over the validSize corner of a decoded brick; the rest is padding.
+void CalculateBrickStats(const uint8_t* brick, VoxelType voxelType, int channels, int brickSize, glm::ivec3 validSize, BrickStats& stats);
+
+// Writes bricks in any order, then the header and table once all are in.
+// Not thread safe: encode bricks in parallel, write them from one thread.
+class BrickFileWriter
+{
+public:
+	bool Open(const std::experimental::filesystem::path& filepath, const BrickFileDesc& desc, std::string& error);
+	bool WriteBrick(uint32_t brickIndex, const uint8_t* data, size_t size, BrickEncoding encoding, const BrickStats& stats, std::string& error);
+	// Stats are usually only known once every brick has been seen.
+	void SetStats(const VolumeStats& stats) { desc_.stats = stats; }
+	bool Finish(std::string& error);
+
+	const std::vector<BrickLevel>& Levels() const { return levels_; }
+	uint64_t BytesWritten() const { return nextOffset_; }
+
+private:
+	std::ofstream file_;
+	BrickFileDesc desc_;
+	std::vector<BrickLevel> levels_;
+	std::vector<BrickEntry> entries_;
+	uint64_t nextOffset_ = 0;
+};
+
+// Maps a brick file and serves bricks straight out of the mapping.
+class BrickFile
+{
+public:
+	bool Open(const std::experimental::filesystem::path& filepath, std::string& error);
+
+	const BrickFileDesc& Desc() const { return desc_; }
+	const BrickLevel& Level(int level) const { return levels_[level]; }
+	uint32_t BrickCount() const { return brickCount_; }
+	uint32_t BrickIndex(int level, glm::ivec3 brick) const
+	{
+		auto& info = levels_[level];
+		return info.firstBrick + ((uint32_t)brick.z * info.bricks.y + brick.y) * info.bricks.x + brick.x;
+	}
+	const BrickEntry& Brick(uint32_t index) const { return entries_[index]; }
+	// Stored bytes of a brick, Brick(index).storedSize long.
+	const uint8_t* BrickData(uint32_t index) const { return file_.Data() + entries_[index].offset; }
+	const MappedFile& File() const { return file_; }
+
+	// Decodes a brick into dst, BrickBytes() long.
+	bool ReadBrick(uint32_t index, uint8_t* dst, std::string& error) const;
+	// Reassembles slices [firstSlice, firstSlice + sliceCount) of a level into
+	// a tightly packed slab.
+	bool ReadSlices(int level, int firstSlice, int sliceCount, uint8_t* dst, std::string& error) const;
+
+private:
+	MappedFile file_;
+	BrickFileDesc desc_;
+	std::vector<BrickLevel> levels_;
+	const BrickEntry* entries_ = nullptr;
+	uint32_t brickCount_ = 0;
+};
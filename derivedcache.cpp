@@ -0,0 +1,310 @@
+#include "derivedcache.h"
+
+#include "log.h"
+
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+using namespace std::experimental::filesystem;
+
+namespace {
+
+const char DerivedDataMagic[8] = { 'V', 'R', 'D', 'E', 'R', 'I', 'V', 'E' };
+const uint32_t DerivedDataVersion = 1;
+const uint64_t SectionAlignment = 16;
+const size_t SectionNameLength = 24;
+
+// Blocks of payload that go into the key, first and last included.
+const size_t KeySampleCount = 64;
+const size_t KeySampleBytes = 16 * 1024;
+
+struct DerivedDataHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t sectionCount;
+};
+static_assert(sizeof(DerivedDataHeader) == 16, "DerivedDataHeader is written to disk as is");
+
+struct DerivedDataSection
+{
+	char name[SectionNameLength];
+	uint64_t offset;
+	uint64_t size;
+};
+static_assert(sizeof(DerivedDataSection) == 40, "DerivedDataSection is written to disk as is");
+
+struct StatsSection
+{
+	float valueRange[2];
+	uint32_t histogramBins;
+	uint32_t reserved;
+};
+
+// 64 bit multiply-xorshift hash, eight bytes per step.
+uint64_t HashBytes(const uint8_t* data, size_t size, uint64_t hash)
+{
+	const uint64_t Multiplier = 0x9E3779B97F4A7C15ull;
+	hash ^= size * Multiplier;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t value;
+		memcpy(&value, data + i, 8);
+		hash = (hash ^ value) * Multiplier;
+		hash ^= hash >> 29;
+	}
+	for (; i < size; ++i) {
+		hash = (hash ^ data[i]) * Multiplier;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+template<typename T>
+uint64_t HashValue(const T& value, uint64_t hash)
+{
+	return HashBytes((const uint8_t*)&value, sizeof(value), hash);
+}
+
+path DerivedDataDirectory()
+{
+	wchar_t localAppData[MAX_PATH];
+	auto length = GetEnvironmentVariableW(L"LOCALAPPDATA", localAppData, MAX_PATH);
+	auto base = length > 0 && length < MAX_PATH ? path(localAppData) : temp_directory_path();
+	return base / "volumerenderer" / "derived";
+}
+
+path DerivedDataPath(const std::string& key)
+{
+	return DerivedDataDirectory() / (key + ".derived");
+}
+
+}
+
+std::string DerivedDataKey(const VolumeDesc& desc, const uint8_t* payload)
+{
+	uint64_t hash = 0;
+	hash = HashValue(desc.dataOffset, hash);
+	hash = HashValue(desc.dims, hash);
+	hash = HashValue(desc.voxelType, hash);
+	hash = HashValue(desc.channels, hash);
+	hash = HashValue(desc.bigEndian, hash);
+
+	std::error_code error;
+	auto fileSize = file_size(desc.dataFile, error);
+	hash = HashValue(error ? 0 : fileSize, hash);
+	auto writeTime = last_write_time(desc.dataFile, error);
+	hash = HashValue(error ? 0 : (int64_t)writeTime.time_since_epoch().count(), hash);
+
+	auto size = desc.PayloadSize();
+	if (size <= KeySampleCount * KeySampleBytes) {
+		hash = HashBytes(payload, size, hash);
+	} else {
+		auto stride = (size - KeySampleBytes) / (KeySampleCount - 1);
+		for (size_t i = 0; i < KeySampleCount; ++i) {
+			hash = HashBytes(payload + i * stride, KeySampleBytes, hash);
+		}
+	}
+
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+	return key;
+}
+
+bool DerivedData::Open(const std::string& key)
+{
+	sections_.clear();
+	if (!file_.Open(DerivedDataPath(key))) {
+		return false;
+	}
+
+	auto data = file_.Data();
+	auto size = file_.Size();
+	DerivedDataHeader header;
+	if (size < sizeof(header)) {
+		file_.Close();
+		return false;
+	}
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, DerivedDataMagic, sizeof(header.magic)) != 0 || header.version != DerivedDataVersion ||
+		header.sectionCount > (size - sizeof(header)) / sizeof(DerivedDataSection)) {
+		file_.Close();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header.sectionCount; ++i) {
+		DerivedDataSection section;
+		memcpy(&section, data + sizeof(header) + i * sizeof(section), sizeof(section));
+		if (section.offset > size || section.size > size - section.offset) {
+			sections_.clear();
+			file_.Close();
+			return false;
+		}
+		auto nameLength = strnlen(section.name, SectionNameLength);
+		sections_.push_back({ std::string(section.name, nameLength), section.offset, section.size });
+	}
+	return true;
+}
+
+const uint8_t* DerivedData::Section(const char* name, size_t& size) const
+{
+	for (auto& section : sections_) {
+		if (section.name == name) {
+			size = (size_t)section.size;
+			return file_.Data() + section.offset;
+		}
+	}
+	return nullptr;
+}
+
+std::vector<std::string> DerivedData::SectionNames() const
+{
+	std::vector<std::string> names;
+	for (auto& section : sections_) {
+		names.push_back(section.name);
+	}
+	return names;
+}
+
+bool StoreDerivedData(const std::string& key, const char* name, const void* data, size_t size, std::string& error)
+{
+	if (strlen(name) >= SectionNameLength) {
+		error = std::string("Section name ") + name + " is too long";
+		return false;
+	}
+
+	// Everything else already stored for this dataset is carried over.
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> sections;
+	{
+		DerivedData existing;
+		if (existing.Open(key)) {
+			for (auto& sectionName : existing.SectionNames()) {
+				if (sectionName == name) {
+					continue;
+				}
+				size_t sectionSize;
+				auto sectionData = existing.Section(sectionName.c_str(), sectionSize);
+				sections.emplace_back(sectionName, std::vector<uint8_t>(sectionData, sectionData + sectionSize));
+			}
+		}
+	}
+	sections.emplace_back(name, std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size));
+
+	std::error_code fsError;
+	create_directories(DerivedDataDirectory(), fsError);
+	auto finalPath = DerivedDataPath(key);
+	auto tempPath = finalPath;
+	tempPath += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			error = "Failed to create " + tempPath.string();
+			return false;
+		}
+
+		DerivedDataHeader header;
+		memcpy(header.magic, DerivedDataMagic, sizeof(header.magic));
+		header.version = DerivedDataVersion;
+		header.sectionCount = (uint32_t)sections.size();
+		file.write((const char*)&header, sizeof(header));
+
+		auto offset = sizeof(header) + sections.size() * sizeof(DerivedDataSection);
+		for (auto& section : sections) {
+			offset = (offset + SectionAlignment - 1) / SectionAlignment * SectionAlignment;
+			DerivedDataSection entry = {};
+			memcpy(entry.name, section.first.c_str(), section.first.size());
+			entry.offset = offset;
+			entry.size = section.second.size();
+			file.write((const char*)&entry, sizeof(entry));
+			offset += section.second.size();
+		}
+		for (auto& section : sections) {
+			auto padding = (size_t)(SectionAlignment - (uint64_t)file.tellp() % SectionAlignment) % SectionAlignment;
+			const char zeros[SectionAlignment] = {};
+			file.write(zeros, padding);
+			file.write((const char*)section.second.data(), section.second.size());
+		}
+		if (!file) {
+			error = "Failed to write " + tempPath.string();
+			file.close();
+			remove(tempPath, fsError);
+			return false;
+		}
+	}
+
+	if (!MoveFileExW(tempPath.wstring().c_str(), finalPath.wstring().c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		error = "Failed to replace " + finalPath.string();
+		remove(tempPath, fsError);
+		return false;
+	}
+	return true;
+}
+
+void DropDerivedData(const std::string& key)
+{
+	std::error_code error;
+	remove(DerivedDataPath(key), error);
+}
+
+bool FindCachedStats(const std::string& key, VolumeStats& stats)
+{
+	DerivedData cached;
+	if (!cached.Open(key)) {
+		return false;
+	}
+	size_t size;
+	auto data = cached.Section("stats", size);
+	StatsSection section;
+	if (!data || size < sizeof(section)) {
+		return false;
+	}
+	memcpy(&section, data, sizeof(section));
+	if (size != sizeof(section) + (size_t)section.histogramBins * sizeof(uint64_t)) {
+		return false;
+	}
+	stats.valueRange = glm::vec2(section.valueRange[0], section.valueRange[1]);
+	stats.histogram.resize(section.histogramBins);
+	memcpy(stats.histogram.data(), data + sizeof(section), section.histogramBins * sizeof(uint64_t));
+	return true;
+}
+
+void CacheStats(const std::string& key, const VolumeStats& stats)
+{
+	StatsSection section = {};
+	section.valueRange[0] = stats.valueRange.x;
+	section.valueRange[1] = stats.valueRange.y;
+	section.histogramBins = (uint32_t)stats.histogram.size();
+	std::vector<uint8_t> data(sizeof(section) + stats.histogram.size() * sizeof(uint64_t));
+	memcpy(data.data(), &section, sizeof(section));
+	memcpy(data.data() + sizeof(section), stats.histogram.data(), stats.histogram.size() * sizeof(uint64_t));
+
+	std::string error;
+	if (!StoreDerivedData(key, "stats", data.data(), data.size(), error)) {
+		Log("Failed to cache stats: %s\n", error.c_str());
+	}
+}
+
+bool FindCachedChecksum(const std::string& key, uint64_t& checksum)
+{
+	DerivedData cached;
+	if (!cached.Open(key)) {
+		return false;
+	}
+	size_t size;
+	auto data = cached.Section("checksum", size);
+	if (!data || size != sizeof(checksum)) {
+		return false;
+	}
+	memcpy(&checksum, data, sizeof(checksum));
+	return true;
+}
+
+void CacheChecksum(const std::string& key, uint64_t checksum)
+{
+	std::string error;
+	if (!StoreDerivedData(key, "checksum", &checksum, sizeof(checksum), error)) {
+		Log("Failed to cache checksum: %s\n", error.c_str());
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "mappedfile.h"
+#include "volumeformat.h"
+#include "volumestats.h"
+
+// Products computed from a dataset (histogram, and anything else that is slow
+// to derive from the voxels) kept between runs, so reopening a dataset skips
+// the passes that made them. Entries live in a per-user cache directory, one
+// file per dataset, named by a key that hashes a sample of the payload with
+// its size, modification time and layout. The file is a small table of named
+// sections, each 16 byte aligned so it can be used in place once mapped:
+//   DerivedDataHeader
+//   DerivedDataSection table[sectionCount]
+//   section payloads
+
+// Key for the dataset desc describes, payload being its mapped voxels.
+// Hashing reads a fixed number of small blocks spread over the payload, so it
+// costs the same few milliseconds whatever the size of the dataset.
+std::string DerivedDataKey(const VolumeDesc& desc, const uint8_t* payload);
+
+// Maps the cache entry of a key and finds sections in it.
+class DerivedData
+{
+public:
+	// False if there is no entry for key, or it is damaged.
+	bool Open(const std::string& key);
+	// Section bytes, valid while this stays open; nullptr if there is none.
+	const uint8_t* Section(const char* name, size_t& size) const;
+	std::vector<std::string> SectionNames() const;
+
+private:
+	struct SectionEntry
+	{
+		std::string name;
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	MappedFile file_;
+	std::vector<SectionEntry> sections_;
+};
+
+// Adds or replaces one section of a key's entry, keeping the others. The
+// entry is written beside the old one and renamed over it, so readers never
+// see it half written.
+bool StoreDerivedData(const std::string& key, const char* name, const void* data, size_t size, std::string& error);
+
+// Deletes the entry of a key, every section of it.
+void DropDerivedData(const std::string& key);
+
+// Histogram and value range, under the "stats" section.
+bool FindCachedStats(const std::string& key, VolumeStats& stats);
+void CacheStats(const std::string& key, const VolumeStats& stats);
+
+// Hash of the whole payload the entry was made from, under the "checksum"
+// section. The key only samples the payload, so a load that reads all of it
+// can tell an entry made from other data.
+bool FindCachedChecksum(const std::string& key, uint64_t& checksum);
+void CacheChecksum(const std::string& key, uint64_t checksum);
@@ -0,0 +1,93 @@
+#include "folderwatch.h"
+
+#include "log.h"
+
+namespace {
+
+// Notification buffer; bursts bigger than this are reported as an overflow.
+const DWORD NotifyBufferBytes = 64 * 1024;
+
+}
+
+FolderWatch::FolderWatch(const std::experimental::filesystem::path& directory)
+	: path_(directory)
+{
+	directory_ = CreateFileW(directory.wstring().c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+	if (directory_ == INVALID_HANDLE_VALUE) {
+		Log("Failed to watch %s\n", directory.string().c_str());
+		watching_ = false;
+		return;
+	}
+	stopEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	ioEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	watcher_ = std::thread([this] { WatcherMain(); });
+}
+
+FolderWatch::~FolderWatch()
+{
+	if (directory_ == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	SetEvent(stopEvent_);
+	watcher_.join();
+	CloseHandle(directory_);
+	CloseHandle(stopEvent_);
+	CloseHandle(ioEvent_);
+}
+
+bool FolderWatch::TakeChanges(std::vector<std::experimental::filesystem::path>& files)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	files.insert(files.end(), changes_.begin(), changes_.end());
+	changes_.clear();
+	auto complete = !overflowed_ && watching_;
+	overflowed_ = false;
+	return complete;
+}
+
+void FolderWatch::WatcherMain()
+{
+	// DWORD aligned, as the notification records have to be.
+	std::vector<DWORD> buffer(NotifyBufferBytes / sizeof(DWORD));
+	while (true) {
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = ioEvent_;
+		if (!ReadDirectoryChangesW(directory_, buffer.data(), NotifyBufferBytes, FALSE,
+			FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &overlapped, nullptr)) {
+			Log("Stopped watching %s\n", path_.string().c_str());
+			watching_ = false;
+			return;
+		}
+		HANDLE events[] = { ioEvent_, stopEvent_ };
+		DWORD bytes = 0;
+		if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+			CancelIoEx(directory_, &overlapped);
+			GetOverlappedResult(directory_, &overlapped, &bytes, TRUE);
+			return;
+		}
+		if (!GetOverlappedResult(directory_, &overlapped, &bytes, FALSE)) {
+			Log("Stopped watching %s\n", path_.string().c_str());
+			watching_ = false;
+			return;
+		}
+
+		std::vector<std::experimental::filesystem::path> changes;
+		auto record = (const uint8_t*)buffer.data();
+		while (bytes) {
+			auto& info = *(const FILE_NOTIFY_INFORMATION*)record;
+			if (info.Action == FILE_ACTION_ADDED || info.Action == FILE_ACTION_MODIFIED || info.Action == FILE_ACTION_RENAMED_NEW_NAME) {
+				changes.push_back(path_ / std::wstring(info.FileName, info.FileNameLength / sizeof(wchar_t)));
+			}
+			if (!info.NextEntryOffset) {
+				break;
+			}
+			record += info.NextEntryOffset;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Nothing returned means the buffer overflowed and the batch is lost.
+		overflowed_ |= bytes == 0;
+		changes_.insert(changes_.end(), changes.begin(), changes.end());
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Reports files added to or rewritten in one directory as it happens, from
+// ReadDirectoryChangesW on a thread of its own, so the directory never has
+// to be listed again to find them.
+class FolderWatch
+{
+public:
+	explicit FolderWatch(const std::experimental::filesystem::path& directory);
+	~FolderWatch();
+	FolderWatch(const FolderWatch&) = delete;
+	FolderWatch& operator=(const FolderWatch&) = delete;
+
+	// False once the directory could not be opened or the notifications
+	// stopped coming; there is no recovering from either.
+	bool IsWatching() const { return watching_; }
+	// Appends the files changed since the last call. False if notifications
+	// were lost in between, or the watch is no longer working, in which case
+	// the directory has to be listed to catch up.
+	bool TakeChanges(std::vector<std::experimental::filesystem::path>& files);
+
+private:
+	void WatcherMain();
+
+	std::experimental::filesystem::path path_;
+	HANDLE directory_ = INVALID_HANDLE_VALUE;
+	HANDLE stopEvent_ = nullptr;
+	HANDLE ioEvent_ = nullptr;
+
+	std::mutex mutex_;
+	std::vector<std::experimental::filesystem::path> changes_;
+	bool overflowed_ = false;
+	std::atomic<bool> watching_ = true;
+
+	std::thread watcher_;
+};
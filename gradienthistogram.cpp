@@ -0,0 +1,137 @@
+#include "gradienthistogram.h"
+
+#include <cmath>
+
+namespace {
+
+// Block edge lengths in voxels. With the border, a block of floats is about
+// 80 KB, so it stays in L2 while its gradients are taken.
+const glm::ivec3 GradientBlockSize(64, 16, 16);
+
+// Copies the block at origin, one voxel of border included, out of the
+// payload as floats. Coordinates outside the volume are clamped to its edge.
+template<typename T, bool Swap>
+void LoadBlock(const uint8_t* payload, const VolumeDesc& desc, glm::ivec3 origin, glm::ivec3 size, float* block)
+{
+	auto voxelBytes = desc.VoxelBytes();
+	for (int z = -1; z <= size.z; ++z) {
+		auto zz = glm::clamp(origin.z + z, 0, desc.dims.z - 1);
+		for (int y = -1; y <= size.y; ++y) {
+			auto yy = glm::clamp(origin.y + y, 0, desc.dims.y - 1);
+			auto row = payload + ((size_t)zz * desc.dims.y + yy) * desc.dims.x * voxelBytes;
+			for (int x = -1; x <= size.x; ++x) {
+				auto xx = glm::clamp(origin.x + x, 0, desc.dims.x - 1);
+				*block++ = (float)LoadVoxel<T, Swap>(row + xx * voxelBytes);
+			}
+		}
+	}
+}
+
+template<typename T, bool Swap>
+void CountVoxels(const uint8_t* payload, const VolumeDesc& desc, int firstSlice, glm::vec2 valueRange, uint32_t* counts)
+{
+	auto span = glm::max(valueRange.y - valueRange.x, 1e-30f);
+	auto valueScale = GradientValueBins / span;
+	auto gradientScale = GradientMagnitudeBins / (0.5f * span);
+	auto depth = glm::min(GradientBlockSize.z, desc.dims.z - firstSlice);
+	std::vector<float> block((GradientBlockSize.x + 2) * (GradientBlockSize.y + 2) * (GradientBlockSize.z + 2));
+
+	for (int y0 = 0; y0 < desc.dims.y; y0 += GradientBlockSize.y) {
+		for (int x0 = 0; x0 < desc.dims.x; x0 += GradientBlockSize.x) {
+			auto origin = glm::ivec3(x0, y0, firstSlice);
+			auto size = glm::min(GradientBlockSize, desc.dims - origin);
+			size.z = depth;
+			LoadBlock<T, Swap>(payload, desc, origin, size, block.data());
+
+			auto rowStride = size.x + 2;
+			auto sliceStride = rowStride * (size.y + 2);
+			for (int z = 0; z < size.z; ++z) {
+				for (int y = 0; y < size.y; ++y) {
+					auto center = block.data() + (z + 1) * sliceStride + (y + 1) * rowStride + 1;
+					for (int x = 0; x < size.x; ++x) {
+						auto voxel = center + x;
+						auto gx = 0.5f * (voxel[1] - voxel[-1]);
+						auto gy = 0.5f * (voxel[rowStride] - voxel[-rowStride]);
+						auto gz = 0.5f * (voxel[sliceStride] - voxel[-sliceStride]);
+						auto value = (*voxel - valueRange.x) * valueScale;
+						auto gradient = std::sqrt(gx * gx + gy * gy + gz * gz) * gradientScale;
+						// Also drops NaNs, and voxels next to them.
+						if (!(value >= 0.0f && value <= (float)GradientValueBins && gradient <= 1e9f)) {
+							continue;
+						}
+						auto valueBin = glm::min((int)value, GradientValueBins - 1);
+						auto gradientBin = glm::min((int)gradient, GradientMagnitudeBins - 1);
+						counts[gradientBin * GradientValueBins + valueBin]++;
+					}
+				}
+			}
+		}
+	}
+}
+
+template<bool Swap>
+void CountVoxels(VoxelType type, const uint8_t* payload, const VolumeDesc& desc, int firstSlice, glm::vec2 valueRange, uint32_t* counts)
+{
+	switch (type) {
+	case VoxelType::UInt8: CountVoxels<uint8_t, false>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::Int8: CountVoxels<int8_t, false>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::UInt16: CountVoxels<uint16_t, Swap>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::Int16: CountVoxels<int16_t, Swap>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::UInt32: CountVoxels<uint32_t, Swap>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::Int32: CountVoxels<int32_t, Swap>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::Float32: CountVoxels<float, Swap>(payload, desc, firstSlice, valueRange, counts); break;
+	case VoxelType::Float64: CountVoxels<double, Swap>(payload, desc, firstSlice, valueRange, counts); break;
+	}
+}
+
+}
+
+GradientHistogram::GradientHistogram(std::shared_ptr<const uint8_t> payload, const VolumeDesc& desc, glm::vec2 valueRange)
+	: payload_(payload)
+	, desc_(desc)
+	, valueRange_(valueRange)
+	, slabCount_((desc.dims.z + GradientBlockSize.z - 1) / GradientBlockSize.z)
+	, counts_(GradientValueBins * GradientMagnitudeBins, 0)
+{
+}
+
+void GradientHistogram::Start(ThreadPool& pool)
+{
+	auto self = shared_from_this();
+	for (int slab = 0; slab < slabCount_; ++slab) {
+		pool.Submit([self, slab] {
+			self->CountSlab(slab);
+		});
+	}
+}
+
+bool GradientHistogram::TakeCounts(std::vector<uint64_t>& counts)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!changed_) {
+		return false;
+	}
+	counts = counts_;
+	changed_ = false;
+	return true;
+}
+
+void GradientHistogram::CountSlab(int slab)
+{
+	if (!cancelled_) {
+		// A slab is only a few slices deep, so 32 bit counts are plenty.
+		std::vector<uint32_t> counts(counts_.size(), 0);
+		auto swapBytes = desc_.bigEndian && VoxelSize(desc_.voxelType) > 1;
+		auto countVoxels = swapBytes ? CountVoxels<true> : CountVoxels<false>;
+		countVoxels(desc_.voxelType, payload_.get(), desc_, slab * GradientBlockSize.z, valueRange_, counts.data());
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (size_t bin = 0; bin < counts.size(); ++bin) {
+			counts_[bin] += counts[bin];
+		}
+		changed_ = true;
+	}
+	if (++countedSlabs_ == slabCount_) {
+		payload_.reset();
+	}
+}
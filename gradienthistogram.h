@@ -0,0 +1,49 @@
+#pragma once
+
+#include "threadpool.h"
+#include "volumeformat.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+const int GradientValueBins = 256;
+const int GradientMagnitudeBins = 128;
+
+// Joint histogram of voxel value against gradient magnitude, for picking out
+// material boundaries when designing a transfer function: each one shows up
+// as an arch between the values on either side of it. Gradients are central
+// differences, clamped at the edges of the volume. They are worked out a
+// small block at a time from a copy of the block with a one voxel border, so
+// there is never a gradient volume in memory. Multi-channel data only uses
+// its first channel.
+class GradientHistogram : public std::enable_shared_from_this<GradientHistogram>
+{
+public:
+	// Values are binned over valueRange, gradient magnitudes over [0, half its
+	// span], which is as steep as a single axis can get; steeper ones land in
+	// the last bin. payload is kept until every slab has been counted.
+	GradientHistogram(std::shared_ptr<const uint8_t> payload, const VolumeDesc& desc, glm::vec2 valueRange);
+
+	// Queues a task per slab of blocks on pool.
+	void Start(ThreadPool& pool);
+	void Cancel() { cancelled_ = true; }
+	bool Finished() const { return countedSlabs_ == slabCount_; }
+	// Counts so far, value bins fastest, if another slab has been counted
+	// since the last call.
+	bool TakeCounts(std::vector<uint64_t>& counts);
+
+private:
+	void CountSlab(int slab);
+
+	std::shared_ptr<const uint8_t> payload_;
+	VolumeDesc desc_;
+	glm::vec2 valueRange_;
+	int slabCount_;
+
+	std::mutex mutex_;
+	std::vector<uint64_t> counts_;
+	bool changed_ = false;
+	std::atomic<int> countedSlabs_ = 0;
+	std::atomic<bool> cancelled_ = false;
+};
@@ -0,0 +1,582 @@
+#include "imagestack.h"
+
+#include "log.h"
+#include "mappedfile.h"
+#include "tiff.h"
+
+#include <cstring>
+
+namespace {
+
+// Matches the uploader's slab size, so a decoded slab goes up in one copy.
+const size_t TargetSlabBytes = 16 * 1024 * 1024;
+// Decoded bytes per task when a single file is split across workers.
+const size_t TargetChunkRangeBytes = 1024 * 1024;
+// Wait before reading a watched slice again after one of its files could not
+// be read, most likely as it was still being written.
+const std::chrono::milliseconds WatchRetryDelay(500);
+// Wait before decoding a watched slice without its missing files, once a
+// later slice has turned up.
+const std::chrono::seconds WatchGapDelay(5);
+// A watched slice number further than this past the last one is taken for a
+// stray file rather than the far side of a gap.
+const int WatchMaxGap = 1024;
+// Most slices and channels an index will size itself for. Numbers in file
+// names past these are reported rather than allocated for.
+const int MaxIndexedSlices = 1 << 16;
+const int MaxIndexedChannels = 16;
+
+// Splits "<prefix>slice<N>_channel<C>.tif[f]" into its parts without
+// allocating; returns false for anything else.
+bool ParseSliceFileName(const std::string& name, size_t& prefixLength, int& slice, int& channel)
+{
+	static const char sliceTag[] = "slice";
+	static const char channelTag[] = "_channel";
+
+	auto sliceAt = name.rfind(sliceTag);
+	if (sliceAt == std::string::npos) {
+		return false;
+	}
+	auto pos = sliceAt + sizeof(sliceTag) - 1;
+	auto parseNumber = [&name, &pos](int& value) {
+		auto start = pos;
+		value = 0;
+		while (pos < name.size() && name[pos] >= '0' && name[pos] <= '9') {
+			value = value * 10 + (name[pos++] - '0');
+		}
+		return pos > start && pos - start < 10;
+	};
+	if (!parseNumber(slice) || name.compare(pos, sizeof(channelTag) - 1, channelTag) != 0) {
+		return false;
+	}
+	pos += sizeof(channelTag) - 1;
+	if (!parseNumber(channel)) {
+		return false;
+	}
+	auto extension = name.c_str() + pos;
+	if (_stricmp(extension, ".tiff") != 0 && _stricmp(extension, ".tif") != 0) {
+		return false;
+	}
+	prefixLength = sliceAt;
+	return true;
+}
+
+template<typename T>
+void FillAlpha(uint8_t* slice, size_t pixelCount, uint64_t* histogram)
+{
+	auto pixels = (T*)slice;
+	for (size_t i = 0; i < pixelCount; ++i, pixels += 4) {
+		auto alpha = glm::max(pixels[0], glm::max(pixels[1], pixels[2]));
+		pixels[3] = alpha;
+		histogram[alpha >> (8 * (sizeof(T) - 1))]++;
+	}
+}
+
+}
+
+ImageStackLoad::ImageStackLoad(const std::vector<SliceChannels>& slices, const VolumeDesc& desc, const VolumeRegion& region, ThreadPool& pool)
+	: slices_(slices.begin() + region.origin.z, slices.begin() + region.origin.z + region.dims.z)
+	, desc_(desc)
+	, region_(region)
+	, pool_(pool)
+{
+	desc_.dims.z = region_.dims.z;
+	sliceBytes_ = (size_t)desc_.dims.x * desc_.dims.y * desc_.VoxelBytes();
+	slabSlices_ = (int)glm::clamp(TargetSlabBytes / sliceBytes_, (size_t)1, (size_t)desc_.dims.z);
+	// Enough slices in flight to keep every worker busy decoding.
+	maxSlabsInFlight_ = glm::max(2, (int)(2 * pool_.ThreadCount() + slabSlices_ - 1) / slabSlices_);
+
+	auto slabCount = (desc_.dims.z + slabSlices_ - 1) / slabSlices_;
+	for (int i = 0; i < slabCount; ++i) {
+		slabs_.push_back(std::make_unique<Slab>());
+	}
+	pendingChannels_.reset(new std::atomic<int>[desc_.dims.z]);
+	for (auto& bin : histogram_) {
+		bin = 0;
+	}
+}
+
+void ImageStackLoad::Pump()
+{
+	while (queuedSlabs_ < (int)slabs_.size() && queuedSlabs_ - releasedSlabs_ < maxSlabsInFlight_) {
+		auto& slab = *slabs_[queuedSlabs_];
+		auto firstSlice = queuedSlabs_ * slabSlices_;
+		auto sliceCount = glm::min(slabSlices_, desc_.dims.z - firstSlice);
+		slab.data.assign(sliceCount * sliceBytes_, 0);
+		slab.pendingSlices = sliceCount;
+		slab.queued = true;
+
+		auto self = shared_from_this();
+		for (int slice = firstSlice; slice < firstSlice + sliceCount; ++slice) {
+			pendingChannels_[slice] = 3;
+			for (int channel = 0; channel < 3; ++channel) {
+				pool_.Submit([self, slice, channel] { self->DecodeChannel(slice, channel); });
+			}
+		}
+		++queuedSlabs_;
+	}
+}
+
+int ImageStackLoad::AvailableSlices()
+{
+	while (decodedSlabs_ < queuedSlabs_ && slabs_[decodedSlabs_]->pendingSlices == 0) {
+		++decodedSlabs_;
+	}
+	return glm::min(decodedSlabs_ * slabSlices_, desc_.dims.z);
+}
+
+void ImageStackLoad::CopySlices(int firstSlice, int sliceCount, uint8_t* dst)
+{
+	// Slabs hold full slices; region_ picks the rows and columns out of each.
+	auto sliceRegion = region_;
+	sliceRegion.origin.z = 0;
+	for (int slice = firstSlice; slice < firstSlice + sliceCount; ++slice) {
+		auto& slab = *slabs_[slice / slabSlices_];
+		auto sliceInSlab = slice % slabSlices_;
+		CopyRegionSlices(slab.data.data() + sliceInSlab * sliceBytes_, desc_, sliceRegion, 0, 1, dst);
+		dst += (size_t)region_.dims.x * region_.dims.y * desc_.VoxelBytes();
+
+		auto lastSliceOfSlab = sliceInSlab == slabSlices_ - 1 || slice == desc_.dims.z - 1;
+		if (lastSliceOfSlab) {
+			std::vector<uint8_t>().swap(slab.data);
+			++releasedSlabs_;
+		}
+	}
+}
+
+void ImageStackLoad::GetStats(VolumeStats& stats) const
+{
+	stats.valueRange = glm::vec2(0.0f, VoxelTypeRange(desc_.voxelType).y);
+	stats.histogram.resize(HistogramBins);
+	for (int i = 0; i < HistogramBins; ++i) {
+		stats.histogram[i] = histogram_[i];
+	}
+}
+
+struct ImageStackLoad::ChannelDecode
+{
+	int slice;
+	std::experimental::filesystem::path path;
+	MappedFile file;
+	TiffInfo info;
+	TiffDestination dst;
+	std::atomic<int> pendingRanges;
+};
+
+void ImageStackLoad::DecodeChannel(int slice, int channel)
+{
+	auto& path = slices_[slice][channel];
+	if (cancelled_ || path.empty()) {
+		FinishChannel(slice);
+		return;
+	}
+
+	// The mapping is shared by every chunk range of this file and closed by
+	// whichever finishes last.
+	auto decode = std::make_shared<ChannelDecode>();
+	decode->slice = slice;
+	decode->path = path;
+	std::string error;
+	if (!decode->file.Open(path)) {
+		Log("Failed to open %s\n", path.string().c_str());
+		FinishChannel(slice);
+		return;
+	}
+	auto& info = decode->info;
+	if (!ReadTiffInfo(decode->file.Data(), decode->file.Size(), info, error)) {
+		Log("Failed to read %s: %s\n", path.string().c_str(), error.c_str());
+		FinishChannel(slice);
+		return;
+	}
+	if (info.width != (uint32_t)desc_.dims.x || info.height != (uint32_t)desc_.dims.y || info.bitsPerSample != 8 * VoxelSize(desc_.voxelType)) {
+		Log("Skipping %s, it does not match the first slice of the stack\n", path.string().c_str());
+		FinishChannel(slice);
+		return;
+	}
+
+	auto& slab = *slabs_[slice / slabSlices_];
+	auto sampleBytes = VoxelSize(desc_.voxelType);
+	decode->dst.data = slab.data.data() + (slice % slabSlices_) * sliceBytes_ + channel * sampleBytes;
+	decode->dst.pixelStride = desc_.VoxelBytes();
+	decode->dst.rowStride = desc_.dims.x * decode->dst.pixelStride;
+
+	auto chunkCount = info.ChunkCount();
+	auto decodedBytes = (size_t)info.width * info.height * sampleBytes;
+	auto rangeCount = glm::clamp(decodedBytes / TargetChunkRangeBytes, (size_t)1, glm::min(chunkCount, (size_t)pool_.ThreadCount()));
+	auto rangeChunks = (chunkCount + rangeCount - 1) / rangeCount;
+	rangeCount = (chunkCount + rangeChunks - 1) / rangeChunks;
+	decode->pendingRanges = (int)rangeCount;
+
+	auto self = shared_from_this();
+	for (size_t range = 1; range < rangeCount; ++range) {
+		pool_.Submit([self, decode, range, rangeChunks] { self->DecodeChunks(decode, range * rangeChunks, rangeChunks); });
+	}
+	DecodeChunks(decode, 0, rangeChunks);
+}
+
+void ImageStackLoad::DecodeChunks(std::shared_ptr<ChannelDecode> decode, size_t firstChunk, size_t chunkCount)
+{
+	std::string error;
+	if (!cancelled_ && !DecodeTiffChunks(decode->file.Data(), decode->file.Size(), decode->info, decode->dst, firstChunk, chunkCount, error)) {
+		Log("Failed to decode %s: %s\n", decode->path.string().c_str(), error.c_str());
+	}
+	if (--decode->pendingRanges == 0) {
+		FinishChannel(decode->slice);
+	}
+}
+
+void ImageStackLoad::FinishChannel(int slice)
+{
+	if (--pendingChannels_[slice] == 0) {
+		FinishSlice(slice);
+	}
+}
+
+void ImageStackLoad::FinishSlice(int slice)
+{
+	auto& slab = *slabs_[slice / slabSlices_];
+	if (!cancelled_) {
+		uint64_t histogram[HistogramBins] = {};
+		auto sliceData = slab.data.data() + (slice % slabSlices_) * sliceBytes_;
+		auto rowBytes = (size_t)desc_.dims.x * desc_.VoxelBytes();
+		for (int y = region_.origin.y; y < region_.origin.y + region_.dims.y; ++y) {
+			auto data = sliceData + y * rowBytes + region_.origin.x * desc_.VoxelBytes();
+			if (VoxelSize(desc_.voxelType) == 1) {
+				FillAlpha<uint8_t>(data, region_.dims.x, histogram);
+			} else {
+				FillAlpha<uint16_t>(data, region_.dims.x, histogram);
+			}
+		}
+		for (int i = 0; i < HistogramBins; ++i) {
+			histogram_[i] += histogram[i];
+		}
+	}
+	--slab.pendingSlices;
+}
+
+ImageStackWatch::ImageStackWatch(const std::experimental::filesystem::path& anyFile, const std::vector<SliceChannels>& slices, const VolumeDesc& desc, ThreadPool& pool, int maxSlices)
+	: desc_(desc)
+	, pool_(pool)
+	, maxSlices_(maxSlices)
+{
+	size_t prefixLength;
+	int slice;
+	int channel;
+	auto anyName = anyFile.filename().string();
+	ParseSliceFileName(anyName, prefixLength, slice, channel);
+	prefix_ = anyName.substr(0, prefixLength);
+	// The first slice of a stack always has a file, which has its number.
+	for (auto& channelPath : slices.front()) {
+		if (!channelPath.empty()) {
+			ParseSliceFileName(channelPath.filename().string(), prefixLength, firstSlice_, channel);
+		}
+	}
+	for (int i = 0; i < 3; ++i) {
+		requiredChannels_[i] = !slices.front()[i].empty();
+	}
+
+	sliceBytes_ = (size_t)desc_.dims.x * desc_.dims.y * desc_.VoxelBytes();
+	maxSlicesInFlight_ = glm::max(4, 2 * (int)pool_.ThreadCount());
+	for (auto& channels : slices) {
+		slices_.push_back(std::make_unique<WatchedSlice>());
+		slices_.back()->channels = channels;
+	}
+	for (auto& bin : histogram_) {
+		bin = 0;
+	}
+}
+
+void ImageStackWatch::FileChanged(const std::experimental::filesystem::path& filepath)
+{
+	size_t prefixLength;
+	int slice;
+	int channel;
+	auto name = filepath.filename().string();
+	if (!ParseSliceFileName(name, prefixLength, slice, channel) || prefixLength != prefix_.size() ||
+		name.compare(0, prefixLength, prefix_) != 0 || slice < firstSlice_) {
+		return;
+	}
+	// Red, green and blue are channels 3, 2 and 0, as in DescribeImageStack.
+	int position = channel == 3 ? 0 : channel == 2 ? 1 : channel == 0 ? 2 : -1;
+	if (position < 0) {
+		return;
+	}
+
+	auto index = slice - firstSlice_;
+	if (index >= maxSlices_ || index >= (int)slices_.size() + WatchMaxGap) {
+		Log("Ignoring %s, slice %d is too far past the last one\n", name.c_str(), slice);
+		return;
+	}
+	while ((int)slices_.size() <= index) {
+		slices_.push_back(std::make_unique<WatchedSlice>());
+	}
+	auto& watched = *slices_[index];
+	auto state = watched.state.load();
+	if (state != SliceWaiting && state != SliceUnreadable) {
+		return;
+	}
+	watched.channels[position] = filepath;
+	// Written some more since it failed, so worth another try straight away.
+	if (state == SliceUnreadable) {
+		watched.state = SliceWaiting;
+	}
+}
+
+void ImageStackWatch::Pump()
+{
+	auto now = std::chrono::steady_clock::now();
+	auto end = glm::min((int)slices_.size(), releasedSlices_ + maxSlicesInFlight_);
+	for (int i = releasedSlices_; i < end; ++i) {
+		auto& watched = *slices_[i];
+		if (watched.state == SliceUnreadable) {
+			if (watched.retryTime == std::chrono::steady_clock::time_point()) {
+				watched.retryTime = now + WatchRetryDelay;
+			} else if (now >= watched.retryTime) {
+				watched.state = SliceWaiting;
+			}
+		}
+		if (watched.state != SliceWaiting) {
+			continue;
+		}
+		if (!IsComplete(watched)) {
+			// Nothing after it would ever be shown if it never completes.
+			if (i + 1 == (int)slices_.size()) {
+				continue;
+			}
+			if (watched.gapTime == std::chrono::steady_clock::time_point()) {
+				watched.gapTime = now + WatchGapDelay;
+				continue;
+			}
+			if (now < watched.gapTime) {
+				continue;
+			}
+			Log("Slice %d is still missing some channels, leaving them black\n", firstSlice_ + i);
+		}
+		watched.state = SliceDecoding;
+		watched.retryTime = std::chrono::steady_clock::time_point();
+		auto self = shared_from_this();
+		auto slice = &watched;
+		pool_.Submit([self, slice] { self->DecodeSlice(*slice); });
+	}
+}
+
+int ImageStackWatch::AvailableSlices()
+{
+	while (availableSlices_ < (int)slices_.size() && slices_[availableSlices_]->state == SliceDecoded) {
+		++availableSlices_;
+	}
+	return availableSlices_;
+}
+
+void ImageStackWatch::CopySlices(int firstSlice, int sliceCount, uint8_t* dst)
+{
+	for (int slice = firstSlice; slice < firstSlice + sliceCount; ++slice) {
+		auto& watched = *slices_[slice];
+		memcpy(dst, watched.data.data(), sliceBytes_);
+		dst += sliceBytes_;
+		std::vector<uint8_t>().swap(watched.data);
+		watched.state = SliceReleased;
+		releasedSlices_ = slice + 1;
+	}
+}
+
+void ImageStackWatch::GetStats(VolumeStats& stats) const
+{
+	stats.valueRange = glm::vec2(0.0f, VoxelTypeRange(desc_.voxelType).y);
+	stats.histogram.resize(HistogramBins);
+	for (int i = 0; i < HistogramBins; ++i) {
+		stats.histogram[i] = histogram_[i];
+	}
+}
+
+bool ImageStackWatch::IsComplete(const WatchedSlice& slice) const
+{
+	for (int i = 0; i < 3; ++i) {
+		if (requiredChannels_[i] && slice.channels[i].empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Slices come one at a time, so each is a single task rather than being
+// split into chunk ranges like a whole stack.
+void ImageStackWatch::DecodeSlice(WatchedSlice& slice)
+{
+	if (cancelled_) {
+		return;
+	}
+	slice.data.assign(sliceBytes_, 0);
+	auto sampleBytes = VoxelSize(desc_.voxelType);
+	for (int channel = 0; channel < 3; ++channel) {
+		auto& path = slice.channels[channel];
+		if (path.empty()) {
+			continue;
+		}
+		// Still open for writing, or not all there yet.
+		MappedFile file;
+		TiffInfo info;
+		std::string error;
+		if (!file.Open(path) || !ReadTiffInfo(file.Data(), file.Size(), info, error)) {
+			slice.state = SliceUnreadable;
+			return;
+		}
+		if (info.width != (uint32_t)desc_.dims.x || info.height != (uint32_t)desc_.dims.y || info.bitsPerSample != 8 * sampleBytes) {
+			Log("Skipping %s, it does not match the first slice of the stack\n", path.string().c_str());
+			continue;
+		}
+		TiffDestination dst;
+		dst.data = slice.data.data() + channel * sampleBytes;
+		dst.pixelStride = desc_.VoxelBytes();
+		dst.rowStride = desc_.dims.x * dst.pixelStride;
+		if (!DecodeTiffChunks(file.Data(), file.Size(), info, dst, 0, info.ChunkCount(), error)) {
+			slice.state = SliceUnreadable;
+			return;
+		}
+	}
+
+	uint64_t histogram[HistogramBins] = {};
+	auto pixelCount = (size_t)desc_.dims.x * desc_.dims.y;
+	if (sampleBytes == 1) {
+		FillAlpha<uint8_t>(slice.data.data(), pixelCount, histogram);
+	} else {
+		FillAlpha<uint16_t>(slice.data.data(), pixelCount, histogram);
+	}
+	for (int i = 0; i < HistogramBins; ++i) {
+		histogram_[i] += histogram[i];
+	}
+	slice.state = SliceDecoded;
+}
+
+std::experimental::filesystem::path ImageStackIndex::ChannelPath(size_t sliceIdx, int channel) const
+{
+	auto& channels = slices[sliceIdx];
+	return channel < (int)channels.size() ? channels[channel] : std::experimental::filesystem::path();
+}
+
+bool IndexImageStack(const std::experimental::filesystem::path& anyFile, ImageStackIndex& index, std::string& error)
+{
+	using namespace std::experimental::filesystem;
+
+	index = ImageStackIndex();
+	size_t prefixLength;
+	int slice;
+	int channel;
+	auto anyName = anyFile.filename().string();
+	if (!ParseSliceFileName(anyName, prefixLength, slice, channel)) {
+		error = anyName + " is not named like <prefix>slice<N>_channel<C>.tiff";
+		return false;
+	}
+	auto prefix = anyName.substr(0, prefixLength);
+
+	struct Entry
+	{
+		int slice;
+		int channel;
+		path filepath;
+	};
+	std::vector<Entry> entries;
+	std::error_code ec;
+	for (directory_iterator it(anyFile.parent_path(), ec), end; !ec && it != end; it.increment(ec)) {
+		auto name = it->path().filename().string();
+		if (ParseSliceFileName(name, prefixLength, slice, channel) && prefixLength == prefix.size() && name.compare(0, prefixLength, prefix) == 0) {
+			if (channel >= MaxIndexedChannels) {
+				error = name + " has channel " + std::to_string(channel) + ", stacks have at most " + std::to_string(MaxIndexedChannels);
+				return false;
+			}
+			entries.push_back({ slice, channel, it->path() });
+		}
+	}
+	if (ec) {
+		error = "Failed to list " + anyFile.parent_path().string() + ": " + ec.message();
+		return false;
+	}
+	if (entries.empty()) {
+		error = "No slices found next to " + anyFile.string();
+		return false;
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.slice != b.slice ? a.slice < b.slice : a.channel < b.channel;
+	});
+	if (entries.back().slice - entries.front().slice >= MaxIndexedSlices) {
+		error = "Slices next to " + anyFile.string() + " run from " + std::to_string(entries.front().slice) + " to " +
+			std::to_string(entries.back().slice) + ", more than " + std::to_string(MaxIndexedSlices) + " apart; " +
+			entries.back().filepath.filename().string() + " may not belong to the stack";
+		return false;
+	}
+	index.firstSlice = entries.front().slice;
+	index.slices.resize(entries.back().slice - index.firstSlice + 1);
+	for (auto& entry : entries) {
+		auto& channels = index.slices[entry.slice - index.firstSlice];
+		if (entry.channel >= (int)channels.size()) {
+			channels.resize(entry.channel + 1);
+		}
+		channels[entry.channel] = std::move(entry.filepath);
+	}
+
+	for (size_t i = 0; i < index.slices.size(); ++i) {
+		if (!index.slices[i].empty()) {
+			continue;
+		}
+		auto sliceNumber = index.firstSlice + (int)i;
+		if (!index.missingSlices.empty() && index.missingSlices.back().second == sliceNumber - 1) {
+			index.missingSlices.back().second = sliceNumber;
+		} else {
+			index.missingSlices.push_back({ sliceNumber, sliceNumber });
+		}
+	}
+	return true;
+}
+
+bool DescribeImageStack(const std::experimental::filesystem::path& anyFile, std::vector<SliceChannels>& slices, VolumeDesc& desc, std::string& error)
+{
+	ImageStackIndex index;
+	if (!IndexImageStack(anyFile, index, error)) {
+		return false;
+	}
+	auto sliceCount = (int)index.slices.size();
+	for (auto& gap : index.missingSlices) {
+		Log("Slices %d to %d are missing, leaving them black\n", gap.first, gap.second);
+	}
+
+	slices.assign(sliceCount, SliceChannels());
+	std::experimental::filesystem::path firstPath;
+	for (int sliceIdx = 0; sliceIdx < sliceCount; sliceIdx++) {
+		slices[sliceIdx] = { index.ChannelPath(sliceIdx, 3), index.ChannelPath(sliceIdx, 2), index.ChannelPath(sliceIdx, 0) };
+		for (auto& channelPath : slices[sliceIdx]) {
+			if (firstPath.empty()) {
+				firstPath = channelPath;
+			}
+		}
+		if (!index.slices[sliceIdx].empty() && (slices[sliceIdx][0].empty() || slices[sliceIdx][1].empty() || slices[sliceIdx][2].empty())) {
+			Log("Slice %d is missing some channels, leaving them black\n", index.firstSlice + sliceIdx);
+		}
+	}
+	if (firstPath.empty()) {
+		error = "No red, green or blue channels found next to " + anyFile.string();
+		return false;
+	}
+
+	MappedFile firstFile;
+	TiffInfo info;
+	if (!firstFile.Open(firstPath)) {
+		error = "Failed to open " + firstPath.string();
+		return false;
+	}
+	if (!ReadTiffInfo(firstFile.Data(), firstFile.Size(), info, error)) {
+		error = "Failed to read " + firstPath.string() + ": " + error;
+		return false;
+	}
+	if (info.bitsPerSample != 8 && info.bitsPerSample != 16) {
+		error = "Unsupported " + std::to_string(info.bitsPerSample) + " bit image stack";
+		return false;
+	}
+
+	desc = VolumeDesc();
+	desc.dataFile = firstPath;
+	desc.dims = glm::ivec3(info.width, info.height, sliceCount);
+	desc.voxelType = info.bitsPerSample == 8 ? VoxelType::UInt8 : VoxelType::UInt16;
+	desc.channels = 4;
+	return true;
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "threadpool.h"
+#include "volumeformat.h"
+#include "volumestats.h"
+
+#include <array>
+#include <chrono>
+#include <memory>
+
+// Red, green and blue channel files of one slice; an empty path leaves that
+// channel black.
+using SliceChannels = std::array<std::experimental::filesystem::path, 3>;
+
+// Every "<prefix>slice<N>_channel<C>.tif[f]" file sharing a prefix, by slice
+// then channel. Slices run from firstSlice without holes; a slice with no
+// files at all has an empty channel list and is listed in missingSlices.
+struct ImageStackIndex
+{
+	int firstSlice = 0;
+	std::vector<std::vector<std::experimental::filesystem::path>> slices;
+	// Inclusive [first, last] runs of slice numbers with no files.
+	std::vector<std::pair<int, int>> missingSlices;
+
+	// Path of one channel of the slice at position sliceIdx, empty if absent.
+	std::experimental::filesystem::path ChannelPath(size_t sliceIdx, int channel) const;
+};
+
+// Builds the index for the stack that anyFile belongs to from a single
+// enumeration of its directory, rather than probing for each slice.
+bool IndexImageStack(const std::experimental::filesystem::path& anyFile, ImageStackIndex& index, std::string& error);
+
+// Indexes the stack and describes it as an RGBA volume. Red, green and blue
+// come from channels 3, 2 and 0, alpha is filled in while decoding. The first
+// file found decides the size and depth of the whole stack; gaps are logged
+// and left black.
+bool DescribeImageStack(const std::experimental::filesystem::path& anyFile, std::vector<SliceChannels>& slices, VolumeDesc& desc, std::string& error);
+
+// Decodes a stack of single channel TIFFs into an interleaved RGBA volume,
+// slab by slab, on a thread pool. Large files are split further into ranges
+// of strips or tiles that decode side by side. Only a bounded window of slabs is decoded
+// ahead of the uploader and each slab is freed once it has been copied out,
+// so host memory stays flat however many slices the stack has. Alpha is the
+// brightest of the three channels.
+//
+// Only the slices of region are decoded. Whole slices are still decoded for
+// those, as strips and tiles span the full width, but only the rows and
+// columns of region are given alpha and copied out.
+class ImageStackLoad : public std::enable_shared_from_this<ImageStackLoad>
+{
+public:
+	ImageStackLoad(const std::vector<SliceChannels>& slices, const VolumeDesc& desc, const VolumeRegion& region, ThreadPool& pool);
+
+	// Render thread. Queues decodes for every slab inside the window.
+	void Pump();
+	// Render thread. Slices below this are fully decoded.
+	int AvailableSlices();
+	// Render thread, used as the uploader's SlabSource. Slices are region
+	// sized and numbered from its first.
+	void CopySlices(int firstSlice, int sliceCount, uint8_t* dst);
+	void Cancel() { cancelled_ = true; }
+	bool Finished() const { return releasedSlabs_ == (int)slabs_.size(); }
+	// Histogram of the alpha channel over the region decoded so far.
+	void GetStats(VolumeStats& stats) const;
+
+private:
+	struct Slab
+	{
+		std::vector<uint8_t> data;
+		std::atomic<int> pendingSlices;
+		bool queued = false;
+	};
+
+	// One channel file being decoded as several chunk ranges at once.
+	struct ChannelDecode;
+
+	void DecodeChannel(int slice, int channel);
+	void DecodeChunks(std::shared_ptr<ChannelDecode> decode, size_t firstChunk, size_t chunkCount);
+	void FinishChannel(int slice);
+	void FinishSlice(int slice);
+
+	std::vector<SliceChannels> slices_;
+	// Full slices, but only as many as region has.
+	VolumeDesc desc_;
+	VolumeRegion region_;
+	ThreadPool& pool_;
+	size_t sliceBytes_;
+	int slabSlices_;
+	int maxSlabsInFlight_;
+
+	std::vector<std::unique_ptr<Slab>> slabs_;
+	std::unique_ptr<std::atomic<int>[]> pendingChannels_;
+	int queuedSlabs_ = 0;
+	int decodedSlabs_ = 0;
+	int releasedSlabs_ = 0;
+	std::atomic<bool> cancelled_ = false;
+	std::array<std::atomic<uint64_t>, HistogramBins> histogram_;
+};
+
+// Follows a stack that is still being written, an instrument dropping slice
+// files into a folder as it acquires them. Files reported by a FolderWatch
+// are matched against the stack's naming, and each slice is decoded on the
+// pool in one task once all its channels are there. Slices already decoded
+// are never read again, and the directory is never listed again. A file that
+// cannot be read yet, because it is still being written, is retried a little
+// later. A slice still incomplete a while after a later one has turned up is
+// taken to be a gap, and decoded with whatever channels it has.
+class ImageStackWatch : public std::enable_shared_from_this<ImageStackWatch>
+{
+public:
+	// slices and desc as DescribeImageStack gave them for anyFile. The stack
+	// is never followed past maxSlices.
+	ImageStackWatch(const std::experimental::filesystem::path& anyFile, const std::vector<SliceChannels>& slices, const VolumeDesc& desc, ThreadPool& pool, int maxSlices);
+
+	// Render thread. Files that are not slices of this stack are ignored, as
+	// are slices past maxSlices or too far past the last one to be a gap.
+	void FileChanged(const std::experimental::filesystem::path& filepath);
+	// Render thread. Queues decodes of complete slices a window ahead of the
+	// uploader.
+	void Pump();
+	// Render thread. Slices below this are decoded.
+	int AvailableSlices();
+	// Slices seen so far, decoded or not.
+	int SliceCount() const { return (int)slices_.size(); }
+	// Render thread, used as the uploader's SlabSource.
+	void CopySlices(int firstSlice, int sliceCount, uint8_t* dst);
+	void Cancel() { cancelled_ = true; }
+	// Histogram of the alpha channel of the slices decoded so far.
+	void GetStats(VolumeStats& stats) const;
+
+private:
+	enum SliceState
+	{
+		SliceWaiting,
+		SliceDecoding,
+		SliceDecoded,
+		// Some file could not be read yet; tried again after a while.
+		SliceUnreadable,
+		SliceReleased,
+	};
+
+	struct WatchedSlice
+	{
+		SliceChannels channels;
+		std::vector<uint8_t> data;
+		std::atomic<int> state = SliceWaiting;
+		// Unset while the slice is not waiting to be retried.
+		std::chrono::steady_clock::time_point retryTime;
+		// When an incomplete slice is given up on as a gap; unset until a
+		// later slice has turned up.
+		std::chrono::steady_clock::time_point gapTime;
+	};
+
+	bool IsComplete(const WatchedSlice& slice) const;
+	void DecodeSlice(WatchedSlice& slice);
+
+	std::string prefix_;
+	// Number in the file names of slices_[0].
+	int firstSlice_ = 0;
+	// Channels the first slice had, which every slice has to have.
+	std::array<bool, 3> requiredChannels_;
+	VolumeDesc desc_;
+	ThreadPool& pool_;
+	size_t sliceBytes_;
+	int maxSlicesInFlight_;
+	int maxSlices_;
+
+	std::vector<std::unique_ptr<WatchedSlice>> slices_;
+	int availableSlices_ = 0;
+	int releasedSlices_ = 0;
+	std::atomic<bool> cancelled_ = false;
+	std::array<std::atomic<uint64_t>, HistogramBins> histogram_;
+};
@@ -0,0 +1,426 @@
+#include "inflate.h"
+
+#include <cstring>
+
+namespace {
+
+const int MaxCodeBits = 15;
+// Codes up to this long are decoded with a single table lookup.
+const int FastBits = 9;
+
+const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+const uint8_t CodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Deflate packs bits least significant first. Reads past the end of the input
+// return zeros; Overrun() tells whether any of them were consumed.
+class BitReader
+{
+public:
+	BitReader(const uint8_t* src, size_t size) : src_(src), end_(src + size) {}
+
+	uint32_t Peek(int count)
+	{
+		if (count_ < count) {
+			Refill();
+		}
+		return (uint32_t)(bits_ & ((1ull << count) - 1));
+	}
+
+	void Consume(int count)
+	{
+		bits_ >>= count;
+		count_ -= count;
+	}
+
+	uint32_t Read(int count)
+	{
+		auto value = Peek(count);
+		Consume(count);
+		return value;
+	}
+
+	void AlignToByte() { Consume(count_ & 7); }
+
+	bool Overrun() const { return padding_ * 8 > count_; }
+
+	// Stored blocks are copied straight from the input once aligned.
+	const uint8_t* TakeBytes(size_t count)
+	{
+		// Hand back whole bytes still sitting in the bit buffer.
+		if (Overrun()) {
+			return nullptr;
+		}
+		auto buffered = (size_t)count_ / 8 - padding_;
+		src_ -= buffered;
+		bits_ = 0;
+		count_ = 0;
+		padding_ = 0;
+		if (count > (size_t)(end_ - src_)) {
+			return nullptr;
+		}
+		auto bytes = src_;
+		src_ += count;
+		return bytes;
+	}
+
+private:
+	void Refill()
+	{
+		while (count_ <= 56) {
+			uint64_t byte = 0;
+			if (src_ < end_) {
+				byte = *src_++;
+			} else {
+				++padding_;
+			}
+			bits_ |= byte << count_;
+			count_ += 8;
+		}
+	}
+
+	const uint8_t* src_;
+	const uint8_t* end_;
+	uint64_t bits_ = 0;
+	int count_ = 0;
+	size_t padding_ = 0;
+};
+
+class Huffman
+{
+public:
+	bool Build(const uint8_t* lengths, int symbolCount)
+	{
+		memset(counts_, 0, sizeof(counts_));
+		for (int i = 0; i < symbolCount; ++i) {
+			counts_[lengths[i]]++;
+		}
+		counts_[0] = 0;
+
+		// Reject over-subscribed codes; incomplete ones are allowed.
+		int left = 1;
+		for (int len = 1; len <= MaxCodeBits; ++len) {
+			left = (left << 1) - counts_[len];
+			if (left < 0) {
+				return false;
+			}
+		}
+
+		uint16_t offsets[MaxCodeBits + 1];
+		uint16_t nextCode[MaxCodeBits + 1];
+		offsets[1] = 0;
+		nextCode[1] = 0;
+		for (int len = 1; len < MaxCodeBits; ++len) {
+			offsets[len + 1] = offsets[len] + counts_[len];
+			nextCode[len + 1] = (uint16_t)((nextCode[len] + counts_[len]) << 1);
+		}
+
+		memset(fast_, 0, sizeof(fast_));
+		for (int symbol = 0; symbol < symbolCount; ++symbol) {
+			int len = lengths[symbol];
+			if (len == 0) {
+				continue;
+			}
+			symbols_[offsets[len]++] = (uint16_t)symbol;
+			auto code = nextCode[len]++;
+			if (len <= FastBits) {
+				// Codes are stored most significant bit first in the stream.
+				uint32_t reversed = 0;
+				for (int i = 0; i < len; ++i) {
+					reversed |= ((code >> i) & 1) << (len - 1 - i);
+				}
+				for (uint32_t fill = reversed; fill < (1u << FastBits); fill += 1u << len) {
+					fast_[fill] = (uint16_t)(symbol << 4 | len);
+				}
+			}
+		}
+		return true;
+	}
+
+	// Returns -1 for a code that is not in the table.
+	int Decode(BitReader& bits) const
+	{
+		auto entry = fast_[bits.Peek(FastBits)];
+		if (entry != 0) {
+			bits.Consume(entry & 15);
+			return entry >> 4;
+		}
+
+		// Longer codes, a bit at a time in canonical order.
+		auto peeked = bits.Peek(MaxCodeBits);
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for (int len = 1; len <= MaxCodeBits; ++len) {
+			code |= (peeked >> (len - 1)) & 1;
+			int count = counts_[len];
+			if (code - first < count) {
+				bits.Consume(len);
+				return symbols_[index + code - first];
+			}
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+private:
+	uint16_t counts_[MaxCodeBits + 1];
+	uint16_t symbols_[288];
+	uint16_t fast_[1 << FastBits];
+};
+
+class Inflater
+{
+public:
+	Inflater(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize) : bits_(src, srcSize), dst_(dst), dstSize_(dstSize) {}
+
+	bool Run(std::string& error)
+	{
+		bool lastBlock = false;
+		while (!lastBlock && written_ < dstSize_) {
+			lastBlock = bits_.Read(1) != 0;
+			auto type = bits_.Read(2);
+			bool ok;
+			switch (type) {
+			case 0: ok = Stored(error); break;
+			case 1: ok = BuildFixed() && Codes(error); break;
+			case 2: ok = BuildDynamic(error) && Codes(error); break;
+			default: error = "Bad deflate block type"; return false;
+			}
+			if (!ok) {
+				return false;
+			}
+			if (bits_.Overrun()) {
+				error = "Truncated deflate stream";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t Written() const { return written_; }
+
+private:
+	bool Stored(std::string& error)
+	{
+		bits_.AlignToByte();
+		auto header = bits_.TakeBytes(4);
+		if (!header) {
+			error = "Truncated deflate stream";
+			return false;
+		}
+		auto length = (size_t)(header[0] | header[1] << 8);
+		if ((length ^ 0xFFFF) != (size_t)(header[2] | header[3] << 8)) {
+			error = "Bad stored block length";
+			return false;
+		}
+		auto data = bits_.TakeBytes(length);
+		if (!data) {
+			error = "Truncated deflate stream";
+			return false;
+		}
+		auto copy = glm::min(length, dstSize_ - written_);
+		memcpy(dst_ + written_, data, copy);
+		written_ += copy;
+		return true;
+	}
+
+	bool BuildFixed()
+	{
+		uint8_t lengths[288];
+		memset(lengths, 8, 144);
+		memset(lengths + 144, 9, 112);
+		memset(lengths + 256, 7, 24);
+		memset(lengths + 280, 8, 8);
+		literals_.Build(lengths, 288);
+		memset(lengths, 5, 30);
+		distances_.Build(lengths, 30);
+		return true;
+	}
+
+	bool BuildDynamic(std::string& error)
+	{
+		auto literalCount = (int)bits_.Read(5) + 257;
+		auto distanceCount = (int)bits_.Read(5) + 1;
+		auto codeLengthCount = (int)bits_.Read(4) + 4;
+		if (literalCount > 286 || distanceCount > 30) {
+			error = "Bad deflate code counts";
+			return false;
+		}
+
+		uint8_t lengths[288 + 32] = {};
+		for (int i = 0; i < codeLengthCount; ++i) {
+			lengths[CodeLengthOrder[i]] = (uint8_t)bits_.Read(3);
+		}
+		Huffman codeLengths;
+		if (!codeLengths.Build(lengths, 19)) {
+			error = "Bad deflate code length code";
+			return false;
+		}
+
+		memset(lengths, 0, sizeof(lengths));
+		int index = 0;
+		while (index < literalCount + distanceCount) {
+			auto symbol = codeLengths.Decode(bits_);
+			if (symbol < 0) {
+				error = "Bad deflate code length";
+				return false;
+			}
+			if (symbol < 16) {
+				lengths[index++] = (uint8_t)symbol;
+				continue;
+			}
+			uint8_t repeated = 0;
+			int repeat;
+			if (symbol == 16) {
+				if (index == 0) {
+					error = "Deflate length repeat with no previous length";
+					return false;
+				}
+				repeated = lengths[index - 1];
+				repeat = 3 + (int)bits_.Read(2);
+			} else if (symbol == 17) {
+				repeat = 3 + (int)bits_.Read(3);
+			} else {
+				repeat = 11 + (int)bits_.Read(7);
+			}
+			if (index + repeat > literalCount + distanceCount) {
+				error = "Deflate code lengths overflow";
+				return false;
+			}
+			memset(lengths + index, repeated, repeat);
+			index += repeat;
+		}
+
+		if (lengths[256] == 0 || !literals_.Build(lengths, literalCount) || !distances_.Build(lengths + literalCount, distanceCount)) {
+			error = "Bad deflate literal or distance code";
+			return false;
+		}
+		return true;
+	}
+
+	bool Codes(std::string& error)
+	{
+		while (true) {
+			auto symbol = literals_.Decode(bits_);
+			if (symbol < 256) {
+				if (symbol < 0) {
+					error = "Bad deflate literal code";
+					return false;
+				}
+				if (written_ == dstSize_) {
+					return true;
+				}
+				dst_[written_++] = (uint8_t)symbol;
+				continue;
+			}
+			if (symbol == 256) {
+				return true;
+			}
+
+			symbol -= 257;
+			if (symbol >= 29) {
+				error = "Bad deflate length code";
+				return false;
+			}
+			size_t length = LengthBase[symbol] + bits_.Read(LengthExtra[symbol]);
+			auto distanceSymbol = distances_.Decode(bits_);
+			if (distanceSymbol < 0 || distanceSymbol >= 30) {
+				error = "Bad deflate distance code";
+				return false;
+			}
+			size_t distance = DistanceBase[distanceSymbol] + bits_.Read(DistanceExtra[distanceSymbol]);
+			if (distance > written_) {
+				error = "Deflate distance reaches before the start of the output";
+				return false;
+			}
+			if (bits_.Overrun()) {
+				error = "Truncated deflate stream";
+				return false;
+			}
+
+			length = glm::min(length, dstSize_ - written_);
+			auto out = dst_ + written_;
+			auto from = out - distance;
+			if (distance >= length) {
+				memcpy(out, from, length);
+			} else {
+				// Overlapping copies repeat the last distance bytes.
+				for (size_t i = 0; i < length; ++i) {
+					out[i] = from[i];
+				}
+			}
+			written_ += length;
+			if (written_ == dstSize_) {
+				return true;
+			}
+		}
+	}
+
+	BitReader bits_;
+	uint8_t* dst_;
+	size_t dstSize_;
+	size_t written_ = 0;
+	Huffman literals_;
+	Huffman distances_;
+};
+
+}
+
+bool InflateZlib(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error)
+{
+	written = 0;
+	if (srcSize < 2 || (src[0] & 0x0F) != 8 || (src[0] << 8 | src[1]) % 31 != 0) {
+		error = "Bad zlib header";
+		return false;
+	}
+	if (src[1] & 0x20) {
+		error = "zlib preset dictionaries are not supported";
+		return false;
+	}
+
+	Inflater inflater(src + 2, srcSize - 2, dst, dstSize);
+	auto ok = inflater.Run(error);
+	written = inflater.Written();
+	return ok;
+}
+
+bool InflateGzip(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error)
+{
+	written = 0;
+	if (srcSize < 18 || src[0] != 0x1F || src[1] != 0x8B || src[2] != 8) {
+		error = "Bad gzip header";
+		return false;
+	}
+	enum { FlagCrc = 2, FlagExtra = 4, FlagName = 8, FlagComment = 16 };
+	auto flags = src[3];
+	size_t pos = 10;
+	if (flags & FlagExtra) {
+		pos += 2 + (src[pos] | src[pos + 1] << 8);
+	}
+	// Zero terminated strings.
+	for (auto flag : { FlagName, FlagComment }) {
+		if (flags & flag) {
+			while (pos < srcSize && src[pos] != 0) {
+				++pos;
+			}
+			++pos;
+		}
+	}
+	if (flags & FlagCrc) {
+		pos += 2;
+	}
+	if (pos >= srcSize) {
+		error = "Truncated gzip header";
+		return false;
+	}
+
+	Inflater inflater(src + pos, srcSize - pos, dst, dstSize);
+	auto ok = inflater.Run(error);
+	written = inflater.Written();
+	return ok;
+}
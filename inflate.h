@@ -0,0 +1,10 @@
+#pragma once
+
+// Decompresses a zlib stream (RFC 1950 wrapping RFC 1951 deflate) into dst.
+// Decoding stops at the end of the stream or when dst is full, whichever is
+// first; written is how much of dst was filled. The Adler-32 trailer is not
+// checked.
+bool InflateZlib(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error);
+
+// Same for a gzip member (RFC 1952). The CRC-32 trailer is not checked.
+bool InflateGzip(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error);
@@ -0,0 +1,230 @@
+#include "ingest.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+namespace {
+
+// Rows are taken this many bytes at a time, small enough that a chunk read
+// for the stats is still in L2 when it is copied out.
+const size_t IngestChunkBytes = 256 * 1024;
+
+const uint64_t HashMultiplier = 0x9E3779B97F4A7C15ull;
+
+uint64_t HashStep(uint64_t hash, uint64_t value)
+{
+	hash = (hash ^ value) * HashMultiplier;
+	return hash ^ hash >> 29;
+}
+
+// Same multiply-xorshift as the derived data keys, but run as four
+// independent lanes over each 32 bytes so the multiplies overlap.
+uint64_t HashChunk(const uint8_t* data, size_t size, uint64_t hash)
+{
+	uint64_t lanes[4] = { hash, hash + 1, hash + 2, hash + 3 };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		uint64_t values[4];
+		memcpy(values, data + i, 32);
+		lanes[0] = HashStep(lanes[0], values[0]);
+		lanes[1] = HashStep(lanes[1], values[1]);
+		lanes[2] = HashStep(lanes[2], values[2]);
+		lanes[3] = HashStep(lanes[3], values[3]);
+	}
+	hash = HashStep(HashStep(HashStep(HashStep(size, lanes[0]), lanes[1]), lanes[2]), lanes[3]);
+	for (; i < size; ++i) {
+		hash = HashStep(hash, data[i]);
+	}
+	return hash;
+}
+
+// Running min and max of each sample position over the rows of one band of
+// bricks, reduced to the bricks once the band is done. Going a row at a time
+// keeps the inner loops long and free of brick edges, so they vectorize.
+template<typename T, bool Swap>
+void AddBrickRows(const uint8_t* rows, int firstRow, int rowCount, glm::ivec3 dims, int channels, glm::vec2* layer, std::vector<uint8_t>& columns)
+{
+	auto samples = (size_t)dims.x * channels;
+	columns.resize(2 * samples * sizeof(T));
+	auto low = (T*)columns.data();
+	auto high = low + samples;
+	for (int row = 0; row < rowCount; ++row) {
+		auto y = firstRow + row;
+		if (y % IngestBrickSize == 0) {
+			std::fill(low, low + samples, std::numeric_limits<T>::max());
+			std::fill(high, high + samples, std::numeric_limits<T>::lowest());
+		}
+		auto src = rows + row * samples * sizeof(T);
+		for (size_t i = 0; i < samples; ++i) {
+			auto value = LoadVoxel<T, Swap>(src + i * sizeof(T));
+			if (std::is_floating_point<T>::value && !std::isfinite((double)value)) {
+				continue;
+			}
+			low[i] = value < low[i] ? value : low[i];
+			high[i] = value > high[i] ? value : high[i];
+		}
+		if (y % IngestBrickSize != IngestBrickSize - 1 && y != dims.y - 1) {
+			continue;
+		}
+		auto ranges = layer + y / IngestBrickSize * ((dims.x + IngestBrickSize - 1) / IngestBrickSize);
+		for (int x = 0, brick = 0; x < dims.x; x += IngestBrickSize, ++brick) {
+			auto brickLow = std::numeric_limits<T>::max();
+			auto brickHigh = std::numeric_limits<T>::lowest();
+			auto end = glm::min(x + IngestBrickSize, dims.x) * channels;
+			for (int i = x * channels; i < end; ++i) {
+				brickLow = glm::min(brickLow, low[i]);
+				brickHigh = glm::max(brickHigh, high[i]);
+			}
+			if (brickLow <= brickHigh) {
+				ranges[brick].x = glm::min(ranges[brick].x, (float)brickLow);
+				ranges[brick].y = glm::max(ranges[brick].y, (float)brickHigh);
+			}
+		}
+	}
+}
+
+template<bool Swap>
+void AddBrickRows(VoxelType type, const uint8_t* rows, int firstRow, int rowCount, glm::ivec3 dims, int channels, glm::vec2* layer, std::vector<uint8_t>& columns)
+{
+	switch (type) {
+	case VoxelType::UInt8: AddBrickRows<uint8_t, false>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::Int8: AddBrickRows<int8_t, false>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::UInt16: AddBrickRows<uint16_t, Swap>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::Int16: AddBrickRows<int16_t, Swap>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::UInt32: AddBrickRows<uint32_t, Swap>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::Int32: AddBrickRows<int32_t, Swap>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::Float32: AddBrickRows<float, Swap>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	case VoxelType::Float64: AddBrickRows<double, Swap>(rows, firstRow, rowCount, dims, channels, layer, columns); break;
+	}
+}
+
+const glm::vec2 EmptyRange(std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest());
+
+}
+
+IngestSweep::IngestSweep(const VolumeDesc& desc)
+	: desc_(desc)
+	, swapBytes_(desc.bigEndian && VoxelSize(desc.voxelType) > 1)
+	, rowBytes_((size_t)desc.dims.x * desc.VoxelBytes())
+	, sliceBytes_(rowBytes_ * desc.dims.y)
+	, brickGrid_((desc.dims + IngestBrickSize - 1) / IngestBrickSize)
+{
+	brickRanges_.assign((size_t)brickGrid_.x * brickGrid_.y * brickGrid_.z, EmptyRange);
+	if (!HasHistogram()) {
+		sketch_ = std::make_unique<QuantileSketch>();
+	}
+	sliceHashes_.assign(desc.dims.z, 0);
+}
+
+void IngestSweep::CopySlices(const uint8_t* src, int firstSlice, int sliceCount, uint8_t* dst)
+{
+	// Everything is gathered locally and merged once at the end, so slabs on
+	// other threads only meet on the mutex once each.
+	std::unique_ptr<ValueCounter> counter;
+	std::unique_ptr<QuantileSketch> sketch;
+	if (HasHistogram()) {
+		counter = std::make_unique<ValueCounter>(desc_.voxelType, swapBytes_);
+	} else {
+		sketch = std::make_unique<QuantileSketch>();
+	}
+	auto layerBricks = (size_t)brickGrid_.x * brickGrid_.y;
+	auto firstLayer = firstSlice / IngestBrickSize;
+	auto layerCount = (firstSlice + sliceCount - 1) / IngestBrickSize - firstLayer + 1;
+	std::vector<glm::vec2> ranges(layerCount * layerBricks, EmptyRange);
+	std::vector<uint64_t> hashes(sliceCount);
+
+	auto chunkRows = (int)glm::clamp(IngestChunkBytes / rowBytes_, (size_t)1, (size_t)desc_.dims.y);
+	auto sampleSize = VoxelSize(desc_.voxelType);
+	auto addBrickRows = swapBytes_ ? AddBrickRows<true> : AddBrickRows<false>;
+	std::vector<uint8_t> columns;
+	for (int slice = 0; slice < sliceCount; ++slice) {
+		auto z = firstSlice + slice;
+		auto layer = ranges.data() + (z / IngestBrickSize - firstLayer) * layerBricks;
+		uint64_t hash = z;
+		for (int y = 0; y < desc_.dims.y; y += chunkRows) {
+			auto rows = glm::min(chunkRows, desc_.dims.y - y);
+			auto offset = slice * sliceBytes_ + y * rowBytes_;
+			auto chunk = src + offset;
+			auto bytes = rows * rowBytes_;
+			if (counter) {
+				counter->Add(chunk, bytes / sampleSize);
+			} else {
+				sketch->Add(chunk, bytes / sampleSize, desc_.voxelType, swapBytes_);
+			}
+			addBrickRows(desc_.voxelType, chunk, y, rows, desc_.dims, desc_.channels, layer, columns);
+			hash = HashChunk(chunk, bytes, hash);
+			memcpy(dst + offset, chunk, bytes);
+		}
+		hashes[slice] = hash;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (counter) {
+			counter->AddTo(valueCounts_);
+		} else {
+			sketch_->Merge(*sketch);
+		}
+		auto merged = brickRanges_.data() + firstLayer * layerBricks;
+		for (size_t brick = 0; brick < ranges.size(); ++brick) {
+			merged[brick].x = glm::min(merged[brick].x, ranges[brick].x);
+			merged[brick].y = glm::max(merged[brick].y, ranges[brick].y);
+		}
+		std::copy(hashes.begin(), hashes.end(), sliceHashes_.begin() + firstSlice);
+	}
+	sweptSlices_ += sliceCount;
+}
+
+void IngestSweep::GetStats(VolumeStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	StatsFromValueCounts(valueCounts_, desc_.voxelType, stats);
+}
+
+float IngestSweep::Quantile(double q) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return sketch_ ? sketch_->Quantile(q) : ValueCountsQuantile(valueCounts_, desc_.voxelType, q);
+}
+
+std::vector<glm::vec2> IngestSweep::BrickRanges() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return brickRanges_;
+}
+
+uint64_t IngestSweep::Checksum() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return HashChunk((const uint8_t*)sliceHashes_.data(), sliceHashes_.size() * sizeof(uint64_t), sliceBytes_);
+}
+
+std::vector<glm::vec2> DilateBrickRanges(const std::vector<glm::vec2>& ranges, glm::ivec3 grid)
+{
+	// One axis at a time, each pass reading what the last one wrote.
+	auto dilated = ranges;
+	auto stride = glm::ivec3(1, grid.x, grid.x * grid.y);
+	for (int axis = 0; axis < 3; ++axis) {
+		auto source = dilated;
+		for (int z = 0; z < grid.z; ++z) {
+			for (int y = 0; y < grid.y; ++y) {
+				for (int x = 0; x < grid.x; ++x) {
+					auto brick = glm::ivec3(x, y, z);
+					auto index = (size_t)z * stride.z + y * stride.y + x;
+					auto& range = dilated[index];
+					if (brick[axis] > 0) {
+						range.x = glm::min(range.x, source[index - stride[axis]].x);
+						range.y = glm::max(range.y, source[index - stride[axis]].y);
+					}
+					if (brick[axis] < grid[axis] - 1) {
+						range.x = glm::min(range.x, source[index + stride[axis]].x);
+						range.y = glm::max(range.y, source[index + stride[axis]].y);
+					}
+				}
+			}
+		}
+	}
+	return dilated;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "volumeformat.h"
+#include "volumestats.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+// Edge length in voxels of the bricks the sweep keeps a value range for.
+const int IngestBrickSize = 16;
+
+// Everything a load derives from the voxels, worked out in the same pass that
+// copies them into the uploader's staging buffers. Each slice is taken a few
+// hundred KB of rows at a time; a chunk is read for the histogram, the range
+// of every brick it crosses and the checksum, then copied out while it is
+// still in cache, so the payload is only ever read from memory once.
+//
+// Histograms are only kept for 8 and 16 bit integer data, which counts every
+// value and so needs no range up front. Wider types still take their own
+// CalculateVolumeStats pass, but get a QuantileSketch here instead.
+class IngestSweep
+{
+public:
+	explicit IngestSweep(const VolumeDesc& desc);
+
+	// Any thread, and several slabs at once. Copies slices [firstSlice,
+	// firstSlice + sliceCount) from src, which holds just those slices tightly
+	// packed, to dst. dst is only written, as it is usually write combined.
+	void CopySlices(const uint8_t* src, int firstSlice, int sliceCount, uint8_t* dst);
+	// Every slice has been copied once.
+	bool Finished() const { return sweptSlices_ == desc_.dims.z; }
+
+	bool HasHistogram() const { return VoxelSize(desc_.voxelType) <= 2; }
+	void GetStats(VolumeStats& stats) const;
+	// Value below which a fraction q of the samples fall; exact for 8 and 16
+	// bit data, from the sketch for the rest.
+	float Quantile(double q) const;
+	glm::ivec3 BrickGrid() const { return brickGrid_; }
+	// Smallest and largest finite sample of each brick, all channels, x
+	// fastest. Bricks with none have x > y.
+	std::vector<glm::vec2> BrickRanges() const;
+	// Hash of the payload, the same whatever order the slabs came in.
+	uint64_t Checksum() const;
+
+private:
+	VolumeDesc desc_;
+	bool swapBytes_;
+	size_t rowBytes_;
+	size_t sliceBytes_;
+	glm::ivec3 brickGrid_;
+
+	mutable std::mutex mutex_;
+	std::vector<uint64_t> valueCounts_;
+	std::unique_ptr<QuantileSketch> sketch_;
+	std::vector<glm::vec2> brickRanges_;
+	std::vector<uint64_t> sliceHashes_;
+	std::atomic<int> sweptSlices_ = 0;
+};
+
+// Widens the range of each brick of grid to take in those of the bricks
+// around it, so it covers every voxel that filtering can blend into a sample
+// inside the brick.
+std::vector<glm::vec2> DilateBrickRanges(const std::vector<glm::vec2>& ranges, glm::ivec3 grid);
@@ -0,0 +1,445 @@
+#include "liveingest.h"
+
+#include "log.h"
+#include "mappedfile.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace {
+
+const char LiveVolumeMagic[8] = { 'V', 'R', 'L', 'I', 'V', 'E', 'V', 'L' };
+const char LiveSliceMagic[4] = { 'S', 'L', 'I', 'C' };
+const uint32_t LiveVolumeVersion = 1;
+// Pipe buffer size, also the most read or written in one call.
+const DWORD PipeBufferBytes = 1 << 20;
+// Staging ring budget, which buys between 2 and 16 slices.
+const size_t StagingBytes = 32 << 20;
+// Largest live volume taken, past what most GPUs could hold anyway.
+const uint64_t MaxLiveVolumeBytes = 4ull << 30;
+
+// Waits for an overlapped operation started with overlapped.hEvent, giving up
+// and cancelling it if stopEvent is set first.
+bool WaitForIo(HANDLE handle, OVERLAPPED& overlapped, HANDLE stopEvent, DWORD& transferred)
+{
+	HANDLE events[] = { overlapped.hEvent, stopEvent };
+	if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+		CancelIoEx(handle, &overlapped);
+		GetOverlappedResult(handle, &overlapped, &transferred, TRUE);
+		return false;
+	}
+	return GetOverlappedResult(handle, &overlapped, &transferred, FALSE) != FALSE;
+}
+
+bool WriteAll(HANDLE pipe, const void* data, size_t size)
+{
+	auto bytes = (const uint8_t*)data;
+	while (size) {
+		DWORD written = 0;
+		if (!WriteFile(pipe, bytes, (DWORD)glm::min(size, (size_t)PipeBufferBytes), &written, nullptr)) {
+			return false;
+		}
+		bytes += written;
+		size -= written;
+	}
+	return true;
+}
+
+}
+
+LiveIngest::LiveIngest(const std::string& pipeName)
+	: pipeName_(pipeName)
+{
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTextureSize_);
+	stopEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	ioEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	reader_ = std::thread([this] { ReaderMain(); });
+}
+
+LiveIngest::~LiveIngest()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	stagingFree_.notify_all();
+	SetEvent(stopEvent_);
+	reader_.join();
+	CloseHandle(stopEvent_);
+	CloseHandle(ioEvent_);
+
+	for (auto& staging : staging_) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		if (staging.mapped) {
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (staging.fence) {
+			glDeleteSync(staging.fence);
+		}
+		glDeleteBuffers(1, &staging.pbo);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (texture_) {
+		glDeleteTextures(1, &texture_);
+	}
+}
+
+size_t LiveIngest::Update(size_t byteBudget)
+{
+	bool streamPending;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		streamPending = streamPending_;
+		if (streamPending) {
+			streamPending_ = false;
+			desc_ = pendingDesc_;
+		}
+	}
+	if (streamPending) {
+		BeginStream();
+	}
+	if (!texture_) {
+		return 0;
+	}
+
+	glBindTexture(GL_TEXTURE_3D, texture_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, desc_.bigEndian && VoxelSize(desc_.voxelType) > 1 ? GL_TRUE : GL_FALSE);
+	size_t uploaded = 0;
+	while (uploaded < byteBudget) {
+		ReceivedSlice slice;
+		{
+			// Slices queued after a new volume started belong to it; they wait
+			// for the next frame, once BeginStream() has set up for them.
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (streamPending_ || received_.empty()) {
+				break;
+			}
+			slice = received_.front();
+			received_.pop_front();
+		}
+		auto& staging = staging_[slice.staging];
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		staging.mapped = nullptr;
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, slice.slice, desc_.dims.x, desc_.dims.y, 1, format_.pixelFormat, format_.type, nullptr);
+		staging.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		uploaded += sliceBytes_;
+
+		if (!sliceReceived_[slice.slice]) {
+			sliceReceived_[slice.slice] = true;
+			++receivedSlices_;
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+
+	while (contiguousSlices_ < desc_.dims.z && sliceReceived_[contiguousSlices_]) {
+		++contiguousSlices_;
+	}
+	RecycleStaging();
+	return uploaded;
+}
+
+bool LiveIngest::TakeStats(VolumeStats& stats)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!statsChanged_) {
+		return false;
+	}
+	stats = stats_;
+	statsChanged_ = false;
+	return true;
+}
+
+void LiveIngest::ReaderMain()
+{
+	while (WaitForSingleObject(stopEvent_, 0) != WAIT_OBJECT_0) {
+		auto pipe = CreateNamedPipeA(pipeName_.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 0, PipeBufferBytes, 0, nullptr);
+		if (pipe == INVALID_HANDLE_VALUE) {
+			Log("Failed to create pipe %s\n", pipeName_.c_str());
+			return;
+		}
+
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = ioEvent_;
+		auto connected = ConnectNamedPipe(pipe, &overlapped) != FALSE;
+		if (!connected) {
+			auto lastError = GetLastError();
+			DWORD unused;
+			connected = lastError == ERROR_PIPE_CONNECTED ||
+				(lastError == ERROR_IO_PENDING && WaitForIo(pipe, overlapped, stopEvent_, unused));
+		}
+		if (connected) {
+			connected_ = true;
+			std::string error;
+			if (!ReadStream(pipe, error)) {
+				Log("Live ingest: %s\n", error.c_str());
+			}
+			connected_ = false;
+			DisconnectNamedPipe(pipe);
+		}
+		CloseHandle(pipe);
+	}
+}
+
+bool LiveIngest::ReadStream(HANDLE pipe, std::string& error)
+{
+	LiveVolumeHeader header;
+	if (!ReadExact(pipe, &header, sizeof(header))) {
+		return true;
+	}
+	if (memcmp(header.magic, LiveVolumeMagic, sizeof(header.magic)) != 0 || header.version != LiveVolumeVersion) {
+		error = "not a live volume stream";
+		return false;
+	}
+	VolumeDesc desc;
+	desc.dataFile = pipeName_;
+	desc.dims = glm::ivec3(header.dims[0], header.dims[1], header.dims[2]);
+	desc.spacing = glm::vec3(header.spacing[0], header.spacing[1], header.spacing[2]);
+	desc.voxelType = (VoxelType)header.voxelType;
+	desc.channels = (int)header.channels;
+	desc.bigEndian = header.bigEndian != 0;
+	TextureFormat format;
+	if (header.voxelType > (uint32_t)VoxelType::Float64 || glm::any(glm::lessThan(desc.dims, glm::ivec3(1))) ||
+		!GetTextureFormat(desc.voxelType, desc.channels, false, format)) {
+		error = "unsupported live volume layout";
+		return false;
+	}
+	// The dims come off the pipe, so they are checked before anything is
+	// sized from them.
+	if (glm::any(glm::greaterThan(desc.dims, glm::ivec3(maxTextureSize_))) ||
+		(uint64_t)desc.dims.x * desc.dims.y * desc.dims.z * desc.VoxelBytes() > MaxLiveVolumeBytes) {
+		error = "live volume is " + std::to_string(desc.dims.x) + "x" + std::to_string(desc.dims.y) + "x" +
+			std::to_string(desc.dims.z) + ", too large to show";
+		return false;
+	}
+
+	auto sliceBytes = (size_t)desc.dims.x * desc.dims.y * desc.VoxelBytes();
+	auto sampleSize = VoxelSize(desc.voxelType);
+	// Whole samples, so each piece can be counted on its own.
+	std::vector<uint8_t> piece(PipeBufferBytes);
+	IncrementalStats stats(desc, glm::vec2(header.valueRange[0], header.valueRange[1]));
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		streamPending_ = true;
+		pendingDesc_ = desc;
+		freeStaging_.clear();
+		received_.clear();
+		stats_ = VolumeStats();
+		statsChanged_ = false;
+	}
+	Log("Receiving live %dx%dx%d %s volume on %s\n", desc.dims.x, desc.dims.y, desc.dims.z,
+		VoxelTypeName(desc.voxelType), pipeName_.c_str());
+
+	while (true) {
+		LiveSliceHeader sliceHeader;
+		if (!ReadExact(pipe, &sliceHeader, sizeof(sliceHeader))) {
+			return true;
+		}
+		auto z = sliceHeader.slice;
+		if (memcmp(sliceHeader.magic, LiveSliceMagic, sizeof(sliceHeader.magic)) != 0 || z < 0 || z >= desc.dims.z ||
+			sliceHeader.size != sliceBytes) {
+			error = "bad slice header";
+			return false;
+		}
+
+		MappedStaging staging;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			stagingFree_.wait(lock, [this] { return stopping_ || !freeStaging_.empty(); });
+			if (stopping_) {
+				return true;
+			}
+			staging = freeStaging_.front();
+			freeStaging_.pop_front();
+		}
+
+		// Each piece is still in cache when it is counted and copied on. The
+		// staging buffer is write combined, so it is only ever written.
+		stats.BeginSlice(z);
+		for (size_t offset = 0; offset < sliceBytes; offset += piece.size()) {
+			auto bytes = glm::min(piece.size(), sliceBytes - offset);
+			if (!ReadExact(pipe, piece.data(), bytes)) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				freeStaging_.push_front(staging);
+				error = "connection closed in the middle of a slice";
+				return false;
+			}
+			stats.AddToSlice(piece.data(), bytes / sampleSize);
+			memcpy(staging.mapped + offset, piece.data(), bytes);
+		}
+		stats.EndSlice();
+		VolumeStats snapshot;
+		stats.Get(snapshot);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stats_ = std::move(snapshot);
+			statsChanged_ = true;
+			received_.push_back({ staging.staging, z });
+		}
+	}
+}
+
+bool LiveIngest::ReadExact(HANDLE pipe, void* dst, size_t size)
+{
+	auto bytes = (uint8_t*)dst;
+	while (size) {
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = ioEvent_;
+		DWORD read = 0;
+		if (!ReadFile(pipe, bytes, (DWORD)glm::min(size, (size_t)PipeBufferBytes), &read, &overlapped)) {
+			if (GetLastError() != ERROR_IO_PENDING || !WaitForIo(pipe, overlapped, stopEvent_, read)) {
+				return false;
+			}
+		}
+		if (!read) {
+			return false;
+		}
+		bytes += read;
+		size -= read;
+	}
+	return true;
+}
+
+// Render thread. A new volume gets a new texture, and the staging ring is
+// resized for its slices.
+void LiveIngest::BeginStream()
+{
+	GetTextureFormat(desc_.voxelType, desc_.channels, false, format_);
+	if (texture_) {
+		glDeleteTextures(1, &texture_);
+	}
+	glGenTextures(1, &texture_);
+	glBindTexture(GL_TEXTURE_3D, texture_);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	if (GLEW_ARB_texture_storage) {
+		glTexStorage3D(GL_TEXTURE_3D, 1, format_.internalFormat, desc_.dims.x, desc_.dims.y, desc_.dims.z);
+	} else {
+		glTexImage3D(GL_TEXTURE_3D, 0, format_.internalFormat, desc_.dims.x, desc_.dims.y, desc_.dims.z, 0, format_.pixelFormat, format_.type, nullptr);
+	}
+
+	// Buffers the reader was handed for the last volume may still be mapped.
+	for (auto& staging : staging_) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		if (staging.mapped) {
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (staging.fence) {
+			glDeleteSync(staging.fence);
+		}
+		glDeleteBuffers(1, &staging.pbo);
+	}
+	sliceBytes_ = (size_t)desc_.dims.x * desc_.dims.y * desc_.VoxelBytes();
+	staging_.assign(glm::clamp(StagingBytes / sliceBytes_, (size_t)2, (size_t)16), StagingBuffer());
+	for (auto& staging : staging_) {
+		glGenBuffers(1, &staging.pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, sliceBytes_, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	sliceReceived_.assign(desc_.dims.z, false);
+	receivedSlices_ = 0;
+	contiguousSlices_ = 0;
+	++stream_;
+}
+
+// Render thread. Maps the staging buffers the GPU is done with and hands
+// them to the reader.
+void LiveIngest::RecycleStaging()
+{
+	std::vector<MappedStaging> mapped;
+	for (int i = 0; i < (int)staging_.size(); ++i) {
+		auto& staging = staging_[i];
+		if (staging.mapped) {
+			continue;
+		}
+		if (staging.fence) {
+			if (glClientWaitSync(staging.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+				continue;
+			}
+			glDeleteSync(staging.fence);
+			staging.fence = nullptr;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		staging.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sliceBytes_, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (staging.mapped) {
+			mapped.push_back({ i, staging.mapped });
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (mapped.empty()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Left mapped; BeginStream() unmaps them for the next volume.
+		if (streamPending_) {
+			return;
+		}
+		freeStaging_.insert(freeStaging_.end(), mapped.begin(), mapped.end());
+	}
+	stagingFree_.notify_one();
+}
+
+bool SendLiveVolume(const std::string& pipeName, const std::experimental::filesystem::path& path, float slicesPerSecond, std::string& error)
+{
+	VolumeDesc desc;
+	if (!ReadVolumeHeader(path, desc, error)) {
+		return false;
+	}
+	MappedFile file;
+	if (!file.Open(desc.dataFile) || file.Size() < desc.dataOffset + desc.PayloadSize()) {
+		error = "failed to open volume data " + desc.dataFile.string();
+		return false;
+	}
+
+	HANDLE pipe;
+	while ((pipe = CreateFileA(pipeName.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr)) == INVALID_HANDLE_VALUE) {
+		if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(pipeName.c_str(), 5000)) {
+			error = "nothing is listening on " + pipeName;
+			return false;
+		}
+	}
+
+	LiveVolumeHeader header = {};
+	memcpy(header.magic, LiveVolumeMagic, sizeof(header.magic));
+	header.version = LiveVolumeVersion;
+	header.voxelType = (uint32_t)desc.voxelType;
+	for (int i = 0; i < 3; ++i) {
+		header.dims[i] = desc.dims[i];
+		header.spacing[i] = desc.spacing[i];
+	}
+	header.channels = desc.channels;
+	header.bigEndian = desc.bigEndian;
+	auto ok = WriteAll(pipe, &header, sizeof(header));
+
+	auto sliceBytes = (size_t)desc.dims.x * desc.dims.y * desc.VoxelBytes();
+	auto startTime = std::chrono::steady_clock::now();
+	for (int z = 0; ok && z < desc.dims.z; ++z) {
+		if (slicesPerSecond > 0.0f) {
+			std::this_thread::sleep_until(startTime + std::chrono::duration<double>(z / slicesPerSecond));
+		}
+		LiveSliceHeader sliceHeader;
+		memcpy(sliceHeader.magic, LiveSliceMagic, sizeof(sliceHeader.magic));
+		sliceHeader.slice = z;
+		sliceHeader.size = sliceBytes;
+		ok = WriteAll(pipe, &sliceHeader, sizeof(sliceHeader)) &&
+			WriteAll(pipe, file.Data() + desc.dataOffset + z * sliceBytes, sliceBytes);
+	}
+	CloseHandle(pipe);
+	if (!ok) {
+		error = "the viewer closed " + pipeName;
+		return false;
+	}
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	Log("Sent %d slices (%.1f MB) in %.3f s\n", desc.dims.z, desc.PayloadSize() / 1.0e6, seconds);
+	return true;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "volumeformat.h"
+#include "volumestats.h"
+#include "volumeupload.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Live acquisition ingest. A producer, typically a microscope writing slices
+// as it scans, connects to a named pipe and streams a volume into the viewer
+// a slice at a time. Stream layout, all little endian:
+//   LiveVolumeHeader
+//   then any number of: LiveSliceHeader, one slice of voxels
+// Slices may come in any order, and a slice sent again replaces the old one,
+// so a rescan updates the volume in place. A new connection starts a new
+// volume.
+
+const char DefaultLivePipe[] = "\\\\.\\pipe\\volumerenderer-live";
+
+struct LiveVolumeHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t voxelType;
+	int32_t dims[3];
+	uint32_t channels;
+	float spacing[3];
+	uint32_t bigEndian;
+	// Histogram range for 32 bit and float data; [0, 0] to take the first
+	// slice's.
+	float valueRange[2];
+};
+static_assert(sizeof(LiveVolumeHeader) == 56, "LiveVolumeHeader is sent as is");
+
+struct LiveSliceHeader
+{
+	char magic[4];
+	int32_t slice;
+	uint64_t size;
+};
+static_assert(sizeof(LiveSliceHeader) == 16, "LiveSliceHeader is sent as is");
+
+// Listens on a named pipe and uploads the slices it receives. The pipe is
+// read on a thread of its own, a cache sized piece at a time, and each piece
+// is counted into the histogram and copied on into a ring of mapped pixel
+// buffers the render thread hands out. The histogram is updated per slice
+// rather than recomputed over the volume, and no copy of the volume is kept
+// on the host.
+class LiveIngest
+{
+public:
+	explicit LiveIngest(const std::string& pipeName);
+	~LiveIngest();
+	LiveIngest(const LiveIngest&) = delete;
+	LiveIngest& operator=(const LiveIngest&) = delete;
+
+	// Render thread, once per frame. Uploads received slices up to
+	// byteBudget and returns the bytes copied.
+	size_t Update(size_t byteBudget);
+
+	// Bumped each time a producer starts a new volume, which gets a texture
+	// of its own.
+	int Stream() const { return stream_; }
+	const VolumeDesc& Desc() const { return desc_; }
+	const TextureFormat& Format() const { return format_; }
+	GLuint Texture() const { return texture_; }
+	// Slices received, and how many from the bottom up without a gap.
+	int ReceivedSlices() const { return receivedSlices_; }
+	int ContiguousSlices() const { return contiguousSlices_; }
+	bool IsConnected() const { return connected_; }
+	// True if the stats changed since the last call.
+	bool TakeStats(VolumeStats& stats);
+
+private:
+	struct StagingBuffer
+	{
+		GLuint pbo = 0;
+		uint8_t* mapped = nullptr;
+		GLsync fence = nullptr;
+	};
+
+	struct MappedStaging
+	{
+		int staging;
+		uint8_t* mapped;
+	};
+
+	struct ReceivedSlice
+	{
+		int staging;
+		int slice;
+	};
+
+	void ReaderMain();
+	// Reader thread. Handles one connection, false if it ended in error.
+	bool ReadStream(HANDLE pipe, std::string& error);
+	bool ReadExact(HANDLE pipe, void* dst, size_t size);
+	// Render thread.
+	void BeginStream();
+	void RecycleStaging();
+
+	std::string pipeName_;
+	// GL_MAX_3D_TEXTURE_SIZE, the largest volume a stream may announce.
+	GLint maxTextureSize_ = 0;
+	HANDLE stopEvent_ = nullptr;
+	HANDLE ioEvent_ = nullptr;
+	std::atomic<bool> connected_ = false;
+
+	// Shared between the reader and the render thread.
+	std::mutex mutex_;
+	std::condition_variable stagingFree_;
+	bool stopping_ = false;
+	// Set by the reader when a new volume starts; taken by Update().
+	bool streamPending_ = false;
+	VolumeDesc pendingDesc_;
+	// Mapped and waiting for the reader, then filled and waiting for upload.
+	std::deque<MappedStaging> freeStaging_;
+	std::deque<ReceivedSlice> received_;
+	VolumeStats stats_;
+	bool statsChanged_ = false;
+
+	// Render thread only.
+	int stream_ = 0;
+	VolumeDesc desc_;
+	TextureFormat format_ = {};
+	GLuint texture_ = 0;
+	size_t sliceBytes_ = 0;
+	std::vector<StagingBuffer> staging_;
+	std::vector<bool> sliceReceived_;
+	int receivedSlices_ = 0;
+	int contiguousSlices_ = 0;
+
+	std::thread reader_;
+};
+
+// Producer for testing: streams the volume at path into a pipe slice by
+// slice, slicesPerSecond of them, or as fast as the pipe takes them if 0.
+bool SendLiveVolume(const std::string& pipeName, const std::experimental::filesystem::path& path, float slicesPerSecond, std::string& error);
@@ -0,0 +1,15 @@
+#include "log.h"
+
+#include <stdarg.h>
+
+void Log(const char* format, ...)
+{
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	fputs(buffer, stdout);
+	OutputDebugStringA(buffer);
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// printf-style message to both the console and the debugger output window.
+void Log(const char* format, ...);
@@ -0,0 +1,100 @@
+#include "mappedfile.h"
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+{
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other)
+{
+	if (this != &other) {
+		Close();
+		std::swap(file_, other.file_);
+		std::swap(mapping_, other.mapping_);
+		std::swap(data_, other.data_);
+		std::swap(size_, other.size_);
+	}
+	return *this;
+}
+
+bool MappedFile::Open(const std::experimental::filesystem::path& filepath)
+{
+	Close();
+
+	// The sequential scan flag lets the cache manager use aggressive read-ahead
+	// for the faults that the mapped view generates.
+	file_ = CreateFileW(filepath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file_ == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file_, &fileSize) || fileSize.QuadPart == 0 || (uint64_t)fileSize.QuadPart > SIZE_MAX) {
+		Close();
+		return false;
+	}
+	size_ = (size_t)fileSize.QuadPart;
+
+	mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping_) {
+		Close();
+		return false;
+	}
+
+	data_ = (const uint8_t*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+	if (!data_) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data_) {
+		UnmapViewOfFile(data_);
+		data_ = nullptr;
+	}
+	if (mapping_) {
+		CloseHandle(mapping_);
+		mapping_ = nullptr;
+	}
+	if (file_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+	}
+	size_ = 0;
+}
+
+void MappedFile::AdviseSequential(size_t offset, size_t size) const
+{
+	if (!data_ || offset >= size_) {
+		return;
+	}
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = (PVOID)(data_ + offset);
+	range.NumberOfBytes = glm::min(size, size_ - offset);
+	// Only a hint; failure (e.g. pre Windows 8) just means demand paging.
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+void MappedFile::Touch(size_t offset, size_t size) const
+{
+	const size_t pageSize = 4096;
+	auto end = glm::min(offset + size, size_);
+	uint8_t sum = 0;
+	for (auto pos = offset; pos < end; pos += pageSize) {
+		sum += data_[pos];
+	}
+	if (end > offset) {
+		sum += data_[end - 1];
+	}
+	// Keeps the reads from being optimised away.
+	volatile uint8_t sink = sum;
+}
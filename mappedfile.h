@@ -0,0 +1,34 @@
+#pragma once
+
+// Read-only memory mapping of a whole file. The mapped bytes live in the OS
+// page cache, so handing Data() straight to the histogram and to glTexImage3D
+// avoids the heap copy that SDL_RWread needed.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other);
+	MappedFile& operator=(MappedFile&& other);
+
+	bool Open(const std::experimental::filesystem::path& filepath);
+	void Close();
+
+	// Equivalent of madvise(MADV_SEQUENTIAL | MADV_WILLNEED): ask the kernel to
+	// start paging in [offset, offset + size) ahead of the reader.
+	void AdviseSequential(size_t offset, size_t size) const;
+	// Faults [offset, offset + size) in, so later readers of it don't block on I/O.
+	void Touch(size_t offset, size_t size) const;
+
+	bool IsOpen() const { return data_ != nullptr; }
+	const uint8_t* Data() const { return data_; }
+	size_t Size() const { return size_; }
+
+private:
+	HANDLE file_ = INVALID_HANDLE_VALUE;
+	HANDLE mapping_ = nullptr;
+	const uint8_t* data_ = nullptr;
+	size_t size_ = 0;
+};
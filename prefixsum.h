@@ -0,0 +1,26 @@
+#pragma once
+
+#include <emmintrin.h>
+
+// Running sum of count bytes in place, wrapping, which undoes byte wise delta
+// coding. Each block of 16 is summed in four shifted adds, then offset by the
+// last sum of the block before.
+inline void PrefixSumBytes(uint8_t* bytes, size_t count)
+{
+	size_t i = 0;
+	auto carry = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		auto v = _mm_loadu_si128((const __m128i*)(bytes + i));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi8(v, carry);
+		_mm_storeu_si128((__m128i*)(bytes + i), v);
+		// Broadcast byte 15 for the next block.
+		carry = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_unpackhi_epi8(v, v), 0xFF), 0xFF);
+	}
+	for (i = glm::max(i, (size_t)1); i < count; ++i) {
+		bytes[i] += bytes[i - 1];
+	}
+}
@@ -9,6 +9,7 @@
 #include "targetver.h"
 
 #include <array>
+#include <atomic>
 #include <assert.h>
 #include <filesystem>
 #include <stdio.h>
@@ -0,0 +1,66 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+	threadCount = glm::max(threadCount, 1u);
+	for (unsigned i = 0; i < threadCount; ++i) {
+		threads_.emplace_back(&ThreadPool::WorkerMain, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+		tasks_.clear();
+	}
+	wake_.notify_all();
+	for (auto& thread : threads_) {
+		thread.join();
+	}
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		tasks_.push_back(std::move(task));
+	}
+	wake_.notify_one();
+}
+
+void ThreadPool::WorkerMain()
+{
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+			if (stopping_) {
+				return;
+			}
+			task = std::move(tasks_.front());
+			tasks_.pop_front();
+		}
+		task();
+	}
+}
+
+void MainThreadQueue::Post(std::function<void()> task)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	tasks_.push_back(std::move(task));
+}
+
+void MainThreadQueue::Drain()
+{
+	std::vector<std::function<void()>> tasks;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		tasks.swap(tasks_);
+	}
+	for (auto& task : tasks) {
+		task();
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Fixed set of worker threads pulling tasks off a shared FIFO. Tasks still
+// queued when it is destroyed are dropped without running.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned threadCount = std::thread::hardware_concurrency());
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void Submit(std::function<void()> task);
+	unsigned ThreadCount() const { return (unsigned)threads_.size(); }
+
+private:
+	void WorkerMain();
+
+	std::vector<std::thread> threads_;
+	std::deque<std::function<void()>> tasks_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	bool stopping_ = false;
+};
+
+// Work that has to happen on the thread owning the GL context. Workers Post(),
+// the render loop calls Drain() once per frame.
+class MainThreadQueue
+{
+public:
+	void Post(std::function<void()> task);
+	void Drain();
+
+private:
+	std::vector<std::function<void()>> tasks_;
+	std::mutex mutex_;
+};
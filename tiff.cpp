@@ -0,0 +1,500 @@
+#include "tiff.h"
+
+#include "inflate.h"
+#include "prefixsum.h"
+
+#include <cstring>
+#include <emmintrin.h>
+
+namespace {
+
+enum TiffTag : uint16_t
+{
+	TagImageWidth = 256,
+	TagImageLength = 257,
+	TagBitsPerSample = 258,
+	TagCompression = 259,
+	TagStripOffsets = 273,
+	TagSamplesPerPixel = 277,
+	TagRowsPerStrip = 278,
+	TagStripByteCounts = 279,
+	TagPredictor = 317,
+	TagTileWidth = 322,
+	TagTileLength = 323,
+	TagTileOffsets = 324,
+	TagTileByteCounts = 325,
+	TagSampleFormat = 339,
+};
+
+enum TiffCompression : uint16_t
+{
+	CompressionNone = 1,
+	CompressionLzw = 5,
+	CompressionDeflate = 8,
+	CompressionPackBits = 32773,
+	CompressionAdobeDeflate = 32946,
+};
+
+enum TiffFieldType : uint16_t
+{
+	FieldByte = 1,
+	FieldShort = 3,
+	FieldLong = 4,
+};
+
+class TiffReader
+{
+public:
+	TiffReader(const uint8_t* file, size_t size, bool bigEndian) : file_(file), size_(size), bigEndian_(bigEndian) {}
+
+	bool InRange(uint64_t offset, uint64_t bytes) const { return offset <= size_ && bytes <= size_ - offset; }
+
+	uint16_t U16(uint64_t offset) const
+	{
+		auto p = file_ + offset;
+		return bigEndian_ ? (uint16_t)(p[0] << 8 | p[1]) : (uint16_t)(p[1] << 8 | p[0]);
+	}
+
+	uint32_t U32(uint64_t offset) const
+	{
+		auto p = file_ + offset;
+		return bigEndian_
+			? (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]
+			: (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+	}
+
+	// Reads all values of an IFD entry, wherever they are stored.
+	bool Values(uint64_t entry, std::vector<uint64_t>& values) const
+	{
+		auto type = U16(entry + 2);
+		auto count = U32(entry + 4);
+		size_t typeSize;
+		switch (type) {
+		case FieldByte: typeSize = 1; break;
+		case FieldShort: typeSize = 2; break;
+		case FieldLong: typeSize = 4; break;
+		default: return false;
+		}
+		uint64_t offset = entry + 8;
+		if ((uint64_t)count * typeSize > 4) {
+			offset = U32(entry + 8);
+		}
+		if (!InRange(offset, (uint64_t)count * typeSize)) {
+			return false;
+		}
+		values.resize(count);
+		for (uint32_t i = 0; i < count; ++i) {
+			auto at = offset + i * typeSize;
+			values[i] = type == FieldByte ? file_[at] : type == FieldShort ? U16(at) : U32(at);
+		}
+		return true;
+	}
+
+private:
+	const uint8_t* file_;
+	size_t size_;
+	bool bigEndian_;
+};
+
+// TIFF LZW: codes are read most significant bit first, start at 9 bits and
+// widen one code earlier than plain LZW would. Every string in the table is
+// a run of earlier output, so entries are just an offset and a length into
+// dst and expanding a code is a single copy.
+bool DecodeLzw(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error)
+{
+	const uint32_t ClearCode = 256;
+	const uint32_t EndCode = 257;
+	const uint32_t MaxCodes = 4096;
+
+	struct Entry
+	{
+		size_t offset;
+		uint32_t length;
+	};
+	Entry table[MaxCodes];
+	uint32_t nextCode = 258;
+	int codeBits = 9;
+	bool previousValid = false;
+	Entry previous = {};
+
+	uint64_t bits = 0;
+	int bitCount = 0;
+	size_t srcPos = 0;
+	written = 0;
+	while (written < dstSize) {
+		while (bitCount < codeBits) {
+			if (srcPos == srcSize) {
+				// Some writers leave out the end code.
+				return true;
+			}
+			bits = bits << 8 | src[srcPos++];
+			bitCount += 8;
+		}
+		auto code = (uint32_t)(bits >> (bitCount - codeBits)) & ((1u << codeBits) - 1);
+		bitCount -= codeBits;
+
+		if (code == ClearCode) {
+			nextCode = 258;
+			codeBits = 9;
+			previousValid = false;
+			continue;
+		}
+		if (code == EndCode) {
+			return true;
+		}
+
+		Entry current;
+		if (code < 256) {
+			current = { written, 1 };
+			dst[written] = (uint8_t)code;
+		} else if (code < nextCode && previousValid) {
+			current = table[code];
+			auto length = (uint32_t)glm::min((size_t)current.length, dstSize - written);
+			memmove(dst + written, dst + current.offset, length);
+			current.offset = written;
+		} else if (code == nextCode && previousValid) {
+			// The string being defined: the previous one plus its own first byte.
+			current = { written, previous.length + 1 };
+			auto length = glm::min((size_t)current.length, dstSize - written);
+			for (size_t i = 0; i < length; ++i) {
+				dst[written + i] = dst[previous.offset + i];
+			}
+		} else {
+			error = "Bad LZW code " + std::to_string(code);
+			return false;
+		}
+
+		if (previousValid && nextCode < MaxCodes) {
+			table[nextCode++] = { previous.offset, previous.length + 1 };
+			if (nextCode + 1 == (1u << codeBits) && codeBits < 12) {
+				++codeBits;
+			}
+		}
+		previous = current;
+		previousValid = true;
+		written = glm::min(written + current.length, dstSize);
+	}
+	return true;
+}
+
+bool DecodePackBits(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize, size_t& written, std::string& error)
+{
+	size_t srcPos = 0;
+	written = 0;
+	while (written < dstSize && srcPos < srcSize) {
+		auto control = (int8_t)src[srcPos++];
+		if (control >= 0) {
+			size_t count = control + 1;
+			if (count > srcSize - srcPos) {
+				error = "Truncated PackBits run";
+				return false;
+			}
+			count = glm::min(count, dstSize - written);
+			memcpy(dst + written, src + srcPos, count);
+			srcPos += control + 1;
+			written += count;
+		} else if (control != -128) {
+			if (srcPos == srcSize) {
+				error = "Truncated PackBits run";
+				return false;
+			}
+			auto count = glm::min((size_t)(1 - control), dstSize - written);
+			memset(dst + written, src[srcPos++], count);
+			written += count;
+		}
+	}
+	return true;
+}
+
+// Horizontal differencing stores each sample as the difference from its left
+// neighbour, so undoing it is a running sum along the row; PrefixSumBytes
+// does 8 bit rows. 16 bit ones are summed 8 samples at a time in three
+// shifted adds, then offset by the last sum of the block before.
+void UndoPredictor16(uint16_t* row, size_t count)
+{
+	size_t x = 0;
+	auto carry = _mm_setzero_si128();
+	for (; x + 8 <= count; x += 8) {
+		auto v = _mm_loadu_si128((const __m128i*)(row + x));
+		v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+		v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi16(v, carry);
+		_mm_storeu_si128((__m128i*)(row + x), v);
+		carry = _mm_shuffle_epi32(_mm_shufflehi_epi16(v, 0xFF), 0xFF);
+	}
+	for (x = glm::max(x, (size_t)1); x < count; ++x) {
+		row[x] += row[x - 1];
+	}
+}
+
+void SwapBytes16(uint8_t* data, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		auto v = _mm_loadu_si128((const __m128i*)(data + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i*)(data + 2 * i), v);
+	}
+	for (; i < count; ++i) {
+		std::swap(data[2 * i], data[2 * i + 1]);
+	}
+}
+
+// Decodes one strip or tile. Compressed chunks are expanded straight into the
+// destination when it is a plain, tightly packed image and the chunk spans
+// whole rows of it; otherwise into a per-thread scratch buffer the size of
+// one chunk, which is then scattered into place.
+class ChunkDecoder
+{
+public:
+	ChunkDecoder(const uint8_t* file, size_t size, const TiffInfo& info, const TiffDestination& dst)
+		: file_(file), size_(size), info_(info), dst_(dst)
+	{
+		sampleBytes_ = info.bitsPerSample / 8u;
+		chunkWidth_ = info.IsTiled() ? info.tileWidth : info.width;
+		chunkHeight_ = info.IsTiled() ? info.tileHeight : info.rowsPerStrip;
+		chunksAcross_ = (info.width + chunkWidth_ - 1) / chunkWidth_;
+		swapBytes_ = info.bigEndian && sampleBytes_ == 2;
+	}
+
+	bool Decode(size_t chunk, std::string& error)
+	{
+		auto x0 = (uint32_t)(chunk % chunksAcross_) * chunkWidth_;
+		auto y0 = (uint32_t)(chunk / chunksAcross_) * chunkHeight_;
+		if (y0 >= info_.height) {
+			return true;
+		}
+		auto visibleWidth = glm::min(chunkWidth_, info_.width - x0);
+		auto visibleRows = glm::min(chunkHeight_, info_.height - y0);
+		// Tiles are always stored whole; the last strip only has the rows left.
+		auto storedRows = info_.IsTiled() ? chunkHeight_ : visibleRows;
+		auto storedRowBytes = (size_t)chunkWidth_ * sampleBytes_;
+		auto storedBytes = storedRows * storedRowBytes;
+
+		auto offset = info_.chunkOffsets[chunk];
+		auto byteCount = info_.chunkByteCounts[chunk];
+		if (offset > size_ || byteCount > size_ - offset) {
+			error = "truncated";
+			return false;
+		}
+		auto src = file_ + offset;
+
+		if (info_.compression == CompressionNone && info_.predictor == 1) {
+			if (byteCount < storedBytes) {
+				error = "truncated";
+				return false;
+			}
+			Scatter(src, storedRowBytes, x0, y0, visibleWidth, visibleRows, swapBytes_);
+			return true;
+		}
+
+		auto direct = !info_.IsTiled() && dst_.pixelStride == sampleBytes_ && dst_.rowStride == storedRowBytes;
+		uint8_t* target;
+		if (direct) {
+			target = dst_.data + y0 * dst_.rowStride;
+		} else {
+			thread_local std::vector<uint8_t> scratch;
+			scratch.resize(storedBytes);
+			target = scratch.data();
+		}
+
+		size_t written = 0;
+		bool ok;
+		switch (info_.compression) {
+		case CompressionLzw: ok = DecodeLzw(src, byteCount, target, storedBytes, written, error); break;
+		case CompressionDeflate:
+		case CompressionAdobeDeflate: ok = InflateZlib(src, byteCount, target, storedBytes, written, error); break;
+		case CompressionPackBits: ok = DecodePackBits(src, byteCount, target, storedBytes, written, error); break;
+		default:
+			written = glm::min(byteCount, (uint64_t)storedBytes);
+			memcpy(target, src, written);
+			ok = true;
+			break;
+		}
+		if (!ok) {
+			return false;
+		}
+		if (written < storedBytes) {
+			error = "decoded " + std::to_string(written) + " of " + std::to_string(storedBytes) + " bytes";
+			return false;
+		}
+
+		for (uint32_t row = 0; row < visibleRows; ++row) {
+			auto rowData = target + row * storedRowBytes;
+			if (swapBytes_) {
+				SwapBytes16(rowData, chunkWidth_);
+			}
+			if (info_.predictor == 2) {
+				if (sampleBytes_ == 1) {
+					PrefixSumBytes(rowData, chunkWidth_);
+				} else {
+					UndoPredictor16((uint16_t*)rowData, chunkWidth_);
+				}
+			}
+		}
+		if (!direct) {
+			Scatter(target, storedRowBytes, x0, y0, visibleWidth, visibleRows, false);
+		}
+		return true;
+	}
+
+private:
+	void Scatter(const uint8_t* src, size_t srcRowBytes, uint32_t x0, uint32_t y0, uint32_t width, uint32_t rows, bool swapBytes)
+	{
+		for (uint32_t row = 0; row < rows; ++row, src += srcRowBytes) {
+			auto out = dst_.data + (y0 + row) * dst_.rowStride + x0 * dst_.pixelStride;
+			if (dst_.pixelStride == sampleBytes_ && !swapBytes) {
+				memcpy(out, src, (size_t)width * sampleBytes_);
+			} else if (sampleBytes_ == 1) {
+				for (uint32_t x = 0; x < width; ++x) {
+					out[x * dst_.pixelStride] = src[x];
+				}
+			} else {
+				for (uint32_t x = 0; x < width; ++x) {
+					auto value = swapBytes ? (uint16_t)(src[2 * x] << 8 | src[2 * x + 1]) : (uint16_t)(src[2 * x + 1] << 8 | src[2 * x]);
+					memcpy(out + x * dst_.pixelStride, &value, 2);
+				}
+			}
+		}
+	}
+
+	const uint8_t* file_;
+	size_t size_;
+	const TiffInfo& info_;
+	TiffDestination dst_;
+	uint32_t sampleBytes_;
+	uint32_t chunkWidth_;
+	uint32_t chunkHeight_;
+	size_t chunksAcross_;
+	bool swapBytes_;
+};
+
+}
+
+bool ReadTiffInfo(const uint8_t* file, size_t size, TiffInfo& info, std::string& error)
+{
+	info = TiffInfo();
+	if (size < 8 || !((file[0] == 'I' && file[1] == 'I') || (file[0] == 'M' && file[1] == 'M'))) {
+		error = "Not a TIFF file";
+		return false;
+	}
+	info.bigEndian = file[0] == 'M';
+	TiffReader reader(file, size, info.bigEndian);
+	if (reader.U16(2) != 42) {
+		error = "Unsupported TIFF version";
+		return false;
+	}
+
+	uint64_t ifd = reader.U32(4);
+	if (!reader.InRange(ifd, 2)) {
+		error = "Bad TIFF directory offset";
+		return false;
+	}
+	auto entryCount = reader.U16(ifd);
+	if (!reader.InRange(ifd + 2, entryCount * 12ull)) {
+		error = "Truncated TIFF directory";
+		return false;
+	}
+
+	std::vector<uint64_t> values;
+	for (uint16_t i = 0; i < entryCount; ++i) {
+		auto entry = ifd + 2 + i * 12ull;
+		auto tag = reader.U16(entry);
+		switch (tag) {
+		case TagImageWidth:
+		case TagImageLength:
+		case TagBitsPerSample:
+		case TagCompression:
+		case TagStripOffsets:
+		case TagSamplesPerPixel:
+		case TagRowsPerStrip:
+		case TagStripByteCounts:
+		case TagPredictor:
+		case TagTileWidth:
+		case TagTileLength:
+		case TagTileOffsets:
+		case TagTileByteCounts:
+		case TagSampleFormat:
+			break;
+		default:
+			continue;
+		}
+		if (!reader.Values(entry, values) || values.empty()) {
+			error = "Bad TIFF tag " + std::to_string(tag);
+			return false;
+		}
+		switch (tag) {
+		case TagImageWidth: info.width = (uint32_t)values[0]; break;
+		case TagImageLength: info.height = (uint32_t)values[0]; break;
+		case TagBitsPerSample: info.bitsPerSample = (uint16_t)values[0]; break;
+		case TagCompression: info.compression = (uint16_t)values[0]; break;
+		case TagStripOffsets: info.chunkOffsets = values; break;
+		case TagSamplesPerPixel: info.samplesPerPixel = (uint16_t)values[0]; break;
+		case TagRowsPerStrip: info.rowsPerStrip = (uint32_t)values[0]; break;
+		case TagStripByteCounts: info.chunkByteCounts = values; break;
+		case TagPredictor: info.predictor = (uint16_t)values[0]; break;
+		case TagTileWidth: info.tileWidth = (uint32_t)values[0]; break;
+		case TagTileLength: info.tileHeight = (uint32_t)values[0]; break;
+		case TagTileOffsets: info.chunkOffsets = values; break;
+		case TagTileByteCounts: info.chunkByteCounts = values; break;
+		case TagSampleFormat: info.sampleFormat = (uint16_t)values[0]; break;
+		}
+	}
+
+	if (info.width == 0 || info.height == 0 || info.chunkOffsets.empty() || info.chunkOffsets.size() != info.chunkByteCounts.size()) {
+		error = "TIFF is missing its size or strips";
+		return false;
+	}
+	info.rowsPerStrip = glm::min(info.rowsPerStrip, info.height);
+	if (info.IsTiled() != (info.tileHeight != 0) || info.rowsPerStrip == 0) {
+		error = "Bad TIFF strip or tile size";
+		return false;
+	}
+	size_t expectedChunks = info.IsTiled()
+		? (size_t)((info.width + info.tileWidth - 1) / info.tileWidth) * ((info.height + info.tileHeight - 1) / info.tileHeight)
+		: (info.height + info.rowsPerStrip - 1) / info.rowsPerStrip;
+	if (info.ChunkCount() < expectedChunks) {
+		error = "TIFF has too few strips or tiles for its size";
+		return false;
+	}
+	return true;
+}
+
+bool DecodeTiff(const uint8_t* file, size_t size, const TiffInfo& info, const TiffDestination& dst, std::string& error)
+{
+	return DecodeTiffChunks(file, size, info, dst, 0, info.ChunkCount(), error);
+}
+
+bool DecodeTiffChunks(const uint8_t* file, size_t size, const TiffInfo& info, const TiffDestination& dst, size_t firstChunk, size_t chunkCount, std::string& error)
+{
+	if (info.samplesPerPixel != 1 || (info.bitsPerSample != 8 && info.bitsPerSample != 16)) {
+		error = "Only single channel 8 or 16 bit TIFFs are supported";
+		return false;
+	}
+	switch (info.compression) {
+	case CompressionNone:
+	case CompressionLzw:
+	case CompressionDeflate:
+	case CompressionAdobeDeflate:
+	case CompressionPackBits:
+		break;
+	default:
+		error = "Unsupported TIFF compression " + std::to_string(info.compression);
+		return false;
+	}
+	if (info.predictor != 1 && info.predictor != 2) {
+		error = "Unsupported TIFF predictor " + std::to_string(info.predictor);
+		return false;
+	}
+
+	ChunkDecoder decoder(file, size, info, dst);
+	auto lastChunk = glm::min(firstChunk + chunkCount, info.ChunkCount());
+	for (auto chunk = firstChunk; chunk < lastChunk; ++chunk) {
+		if (!decoder.Decode(chunk, error)) {
+			error = "TIFF " + std::string(info.IsTiled() ? "tile " : "strip ") + std::to_string(chunk) + ": " + error;
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// Layout of the first image in a TIFF file, as far as decoding it needs.
+// The image is stored as independent chunks, either full width strips of
+// rowsPerStrip rows or tileWidth x tileHeight tiles, each compressed on its
+// own so they can be decoded in any order and on any thread.
+struct TiffInfo
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint16_t bitsPerSample = 1;
+	uint16_t samplesPerPixel = 1;
+	uint16_t compression = 1;
+	uint16_t predictor = 1;
+	uint16_t sampleFormat = 1;
+	bool bigEndian = false;
+	uint32_t rowsPerStrip = 0xFFFFFFFF;
+	// Zero for stripped images.
+	uint32_t tileWidth = 0;
+	uint32_t tileHeight = 0;
+	// Strip or tile offsets and sizes, in file order: strips top to bottom,
+	// tiles left to right then top to bottom.
+	std::vector<uint64_t> chunkOffsets;
+	std::vector<uint64_t> chunkByteCounts;
+
+	bool IsTiled() const { return tileWidth != 0; }
+	size_t ChunkCount() const { return chunkOffsets.size(); }
+};
+
+bool ReadTiffInfo(const uint8_t* file, size_t size, TiffInfo& info, std::string& error);
+
+// Where decoded samples go: the sample at (x, y) is written to
+// data + y * rowStride + x * pixelStride, in native byte order. This lets a
+// single channel file be written straight into an interleaved volume.
+struct TiffDestination
+{
+	uint8_t* data;
+	size_t pixelStride;
+	size_t rowStride;
+};
+
+// Decodes a single sample per pixel, 8 or 16 bit image, uncompressed or
+// LZW, Deflate or PackBits compressed, with or without horizontal
+// differencing.
+bool DecodeTiff(const uint8_t* file, size_t size, const TiffInfo& info, const TiffDestination& dst, std::string& error);
+// Decodes chunks [firstChunk, firstChunk + chunkCount) only. Chunks cover
+// disjoint parts of the image, so separate ranges may be decoded at the same
+// time into the same destination.
+bool DecodeTiffChunks(const uint8_t* file, size_t size, const TiffInfo& info, const TiffDestination& dst, size_t firstChunk, size_t chunkCount, std::string& error);
@@ -0,0 +1,440 @@
+#include "timeseries.h"
+
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+struct TimeSeriesPlayer::Fills
+{
+	std::shared_ptr<MappedFile> file;
+	// SlotState of each slot; only a fill task moves one out of SlotFilling.
+	std::unique_ptr<std::atomic<int>[]> states;
+	std::atomic<bool> cancelled = false;
+};
+
+namespace {
+
+// Edge of the bricks that are compared between timesteps.
+const int DeltaBrickSize = 32;
+// Past this share of bricks changed, one whole upload beats many small ones.
+const float FullUploadFraction = 0.5f;
+
+// Hash of the voxels of one brick, fed a row at a time. Each 16 byte block
+// is keyed and its halves multiplied together as in XXH3, and the key moves
+// on every block so the same rows in another order hash differently.
+class BrickHash
+{
+public:
+	void Add(const uint8_t* data, size_t size)
+	{
+		for (; size >= 16; data += 16, size -= 16) {
+			Mix(_mm_loadu_si128((const __m128i*)data));
+		}
+		if (size) {
+			alignas(16) uint8_t tail[16] = {};
+			memcpy(tail, data, size);
+			Mix(_mm_load_si128((const __m128i*)tail));
+		}
+	}
+
+	uint64_t Finish() const
+	{
+		alignas(16) uint64_t lanes[2];
+		_mm_store_si128((__m128i*)lanes, acc_);
+		auto hash = lanes[0] ^ (lanes[1] * 0x9E3779B185EBCA87ull);
+		hash ^= hash >> 37;
+		hash *= 0x165667919E3779F9ull;
+		return hash ^ (hash >> 32);
+	}
+
+private:
+	void Mix(__m128i block)
+	{
+		auto keyed = _mm_xor_si128(block, key_);
+		auto product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(2, 3, 0, 1)));
+		acc_ = _mm_add_epi64(acc_, _mm_shuffle_epi32(block, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc_ = _mm_add_epi64(acc_, product);
+		key_ = _mm_add_epi64(key_, _mm_set_epi64x(0x27D4EB2F165667C5ll, 0x61C8864E7A143579ll));
+	}
+
+	__m128i acc_ = _mm_set_epi64x(0x3C6EF372FE94F82Bll, 0x510E527FADE682D1ll);
+	__m128i key_ = _mm_set_epi64x(0x9B05688C2B3E6C1Fll, 0x1F83D9ABFB41BD6Bll);
+};
+
+// CopyRegionSlices of a whole region, hashing every brick of it on the way.
+// The hashes read the source rows just copied, still in cache, rather than
+// the write-combined staging memory.
+void CopyAndHashRegion(const uint8_t* payload, const VolumeDesc& desc, const VolumeRegion& region, glm::ivec3 bricks,
+	uint8_t* dst, uint64_t* hashes)
+{
+	auto voxelBytes = desc.VoxelBytes();
+	auto rowBytes = (size_t)desc.dims.x * voxelBytes;
+	auto sliceBytes = rowBytes * desc.dims.y;
+	auto regionRowBytes = (size_t)region.dims.x * voxelBytes;
+	auto brickRowBytes = (size_t)DeltaBrickSize * voxelBytes;
+	std::vector<BrickHash> brickHashes((size_t)bricks.x * bricks.y * bricks.z);
+	for (int z = 0; z < region.dims.z; ++z) {
+		auto slice = payload + (size_t)(region.origin.z + z) * sliceBytes + region.origin.y * rowBytes + region.origin.x * voxelBytes;
+		for (int y = 0; y < region.dims.y; ++y) {
+			auto row = slice + y * rowBytes;
+			memcpy(dst, row, regionRowBytes);
+			dst += regionRowBytes;
+			auto brickRow = &brickHashes[((size_t)(z / DeltaBrickSize) * bricks.y + y / DeltaBrickSize) * bricks.x];
+			for (int x = 0; x < bricks.x; ++x) {
+				auto offset = x * brickRowBytes;
+				brickRow[x].Add(row + offset, glm::min(brickRowBytes, regionRowBytes - offset));
+			}
+		}
+	}
+	for (size_t i = 0; i < brickHashes.size(); ++i) {
+		hashes[i] = brickHashes[i].Finish();
+	}
+}
+
+GLuint CreateTimestepTexture(glm::ivec3 dims, const TextureFormat& format)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_3D, texture);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	if (GLEW_ARB_texture_storage) {
+		glTexStorage3D(GL_TEXTURE_3D, 1, format.internalFormat, dims.x, dims.y, dims.z);
+	} else {
+		glTexImage3D(GL_TEXTURE_3D, 0, format.internalFormat, dims.x, dims.y, dims.z, 0, format.pixelFormat, format.type, nullptr);
+	}
+	return texture;
+}
+
+}
+
+TimeSeriesPlayer::TimeSeriesPlayer(std::shared_ptr<MappedFile> file, const VolumeDesc& desc, const VolumeRegion& region,
+	const TextureFormat& format, ThreadPool& pool, int prefetchDepth)
+	: file_(std::move(file))
+	, desc_(desc)
+	, region_(region)
+	, format_(format)
+	, pool_(pool)
+	, fills_(std::make_shared<Fills>())
+{
+	timestepBytes_ = (size_t)region_.dims.x * region_.dims.y * region_.dims.z * desc_.VoxelBytes();
+	swapBytes_ = desc_.bigEndian && VoxelSize(desc_.voxelType) > 1;
+	bricks_ = (region_.dims + DeltaBrickSize - 1) / DeltaBrickSize;
+
+	// A slot per timestep of the window ahead of the playhead, handed out to
+	// whichever timestep of the window needs one as they free up.
+	auto depth = glm::clamp(prefetchDepth, 1, desc_.timesteps);
+	slots_.resize(depth);
+	fills_->file = file_;
+	fills_->states.reset(new std::atomic<int>[depth]);
+	for (int i = 0; i < depth; ++i) {
+		fills_->states[i] = SlotIdle;
+		slots_[i].hashes.resize(BrickCount());
+		glGenBuffers(1, &slots_[i].pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slots_[i].pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, timestepBytes_, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	for (auto& texture : textures_) {
+		texture = CreateTimestepTexture(region_.dims, format_);
+	}
+	lastUpdateTime_ = SDL_GetPerformanceCounter();
+}
+
+TimeSeriesPlayer::~TimeSeriesPlayer()
+{
+	// Fills write into mapped buffers, which have to outlive them.
+	fills_->cancelled = true;
+	for (size_t i = 0; i < slots_.size(); ++i) {
+		while (fills_->states[i] == SlotFilling) {
+			std::this_thread::yield();
+		}
+	}
+	for (auto& slot : slots_) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+		if (slot.mapped) {
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glDeleteBuffers(1, &slot.pbo);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (uploadFence_) {
+		glDeleteSync(uploadFence_);
+	}
+	glDeleteTextures(2, textures_);
+}
+
+size_t TimeSeriesPlayer::Update(float timestepsPerSecond, bool loop)
+{
+	auto now = SDL_GetPerformanceCounter();
+	auto seconds = (double)(now - lastUpdateTime_) / SDL_GetPerformanceFrequency();
+	lastUpdateTime_ = now;
+	if (playing_) {
+		playhead_ += seconds * timestepsPerSecond;
+		if (playhead_ >= desc_.timesteps) {
+			if (loop) {
+				playhead_ = std::fmod(playhead_, (double)desc_.timesteps);
+			} else {
+				playhead_ = desc_.timesteps - 1;
+				playing_ = false;
+			}
+		}
+	}
+
+	FinishUpload();
+	if (backTimestep_ != NoTimestep && IsDue(backTimestep_)) {
+		if (playing_ && !seeked_ && displayed_ != NoTimestep) {
+			dropped_ += Distance(displayed_, backTimestep_) - 1;
+		}
+		front_ = 1 - front_;
+		displayed_ = backTimestep_;
+		backTimestep_ = NoTimestep;
+		seeked_ = false;
+	}
+	if (playing_ && displayed_ != TargetTimestep()) {
+		++lateFrames_;
+	}
+
+	auto uploaded = ChooseUpload(loop);
+	Prefetch(loop);
+	return uploaded;
+}
+
+void TimeSeriesPlayer::SetPlaying(bool playing)
+{
+	// Playing again from the last timestep starts over.
+	if (playing && !playing_ && TargetTimestep() == desc_.timesteps - 1) {
+		Seek(0);
+	}
+	playing_ = playing;
+}
+
+void TimeSeriesPlayer::Seek(int timestep)
+{
+	playhead_ = glm::clamp(timestep, 0, desc_.timesteps - 1);
+	seeked_ = TargetTimestep() != displayed_;
+}
+
+int TimeSeriesPlayer::ReadyTimesteps() const
+{
+	int ready = 0;
+	for (size_t i = 0; i < slots_.size(); ++i) {
+		ready += fills_->states[i] == SlotReady;
+	}
+	return ready;
+}
+
+int TimeSeriesPlayer::Distance(int from, int to) const
+{
+	return (to - from + desc_.timesteps) % desc_.timesteps;
+}
+
+bool TimeSeriesPlayer::IsDue(int timestep) const
+{
+	if (timestep == displayed_) {
+		return false;
+	}
+	// After a seek nothing between the old and new position is wanted.
+	if (displayed_ == NoTimestep || seeked_) {
+		return timestep == TargetTimestep();
+	}
+	return Distance(displayed_, timestep) <= Distance(displayed_, TargetTimestep());
+}
+
+bool TimeSeriesPlayer::InWindow(int timestep, bool loop) const
+{
+	if (timestep == NoTimestep || (!loop && timestep < TargetTimestep())) {
+		return false;
+	}
+	return Distance(TargetTimestep(), timestep) < (int)slots_.size();
+}
+
+int TimeSeriesPlayer::FindSlot(int timestep) const
+{
+	for (int i = 0; i < (int)slots_.size(); ++i) {
+		if (slots_[i].timestep == timestep && (fills_->states[i] != SlotIdle || i == uploadingSlot_)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int TimeSeriesPlayer::NextTimestep(bool loop) const
+{
+	auto next = TargetTimestep() + 1;
+	if (next < desc_.timesteps) {
+		return next;
+	}
+	return loop ? 0 : NoTimestep;
+}
+
+void TimeSeriesPlayer::FinishUpload()
+{
+	if (uploadingSlot_ < 0 || glClientWaitSync(uploadFence_, 0, 0) == GL_TIMEOUT_EXPIRED) {
+		return;
+	}
+	glDeleteSync(uploadFence_);
+	uploadFence_ = nullptr;
+	backTimestep_ = slots_[uploadingSlot_].timestep;
+	uploadingSlot_ = -1;
+}
+
+size_t TimeSeriesPlayer::StartUpload(int slotIndex)
+{
+	auto& slot = slots_[slotIndex];
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	slot.mapped = nullptr;
+	fills_->states[slotIndex] = SlotIdle;
+
+	// Only bricks that differ from what the back texture holds are copied.
+	auto& backHashes = textureHashes_[1 - front_];
+	std::vector<int> dirty;
+	for (int i = 0; i < BrickCount(); ++i) {
+		if (backHashes.empty() || backHashes[i] != slot.hashes[i]) {
+			dirty.push_back(i);
+		}
+	}
+	dirtyBricks_ = (int)dirty.size();
+	backHashes = slot.hashes;
+
+	glBindTexture(GL_TEXTURE_3D, textures_[1 - front_]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, swapBytes_ ? GL_TRUE : GL_FALSE);
+	size_t uploaded = 0;
+	if (dirty.size() > (size_t)(BrickCount() * FullUploadFraction)) {
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, region_.dims.x, region_.dims.y, region_.dims.z, format_.pixelFormat, format_.type, nullptr);
+		uploaded = timestepBytes_;
+	} else if (!dirty.empty()) {
+		// Each brick is picked out of the staged region in place.
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, region_.dims.x);
+		glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, region_.dims.y);
+		for (auto index : dirty) {
+			auto brick = glm::ivec3(index % bricks_.x, index / bricks_.x % bricks_.y, index / (bricks_.x * bricks_.y));
+			auto origin = brick * DeltaBrickSize;
+			auto size = glm::min(region_.dims - origin, glm::ivec3(DeltaBrickSize));
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, origin.x);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, origin.y);
+			glPixelStorei(GL_UNPACK_SKIP_IMAGES, origin.z);
+			glTexSubImage3D(GL_TEXTURE_3D, 0, origin.x, origin.y, origin.z, size.x, size.y, size.z, format_.pixelFormat, format_.type, nullptr);
+			uploaded += (size_t)size.x * size.y * size.z * desc_.VoxelBytes();
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+		glPixelStorei(GL_UNPACK_SKIP_IMAGES, 0);
+	}
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	uploadFence_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	uploadingSlot_ = slotIndex;
+	backTimestep_ = NoTimestep;
+	return uploaded;
+}
+
+// The back texture gets whichever staged timestep is due and closest to the
+// playhead, skipping any that were not ready in time. With nothing due it is
+// filled ahead with the next timestep, so that one swaps in the moment the
+// playhead reaches it.
+size_t TimeSeriesPlayer::ChooseUpload(bool loop)
+{
+	if (uploadingSlot_ >= 0) {
+		return 0;
+	}
+
+	int best = -1;
+	int bestDistance = -1;
+	for (int i = 0; i < (int)slots_.size(); ++i) {
+		auto timestep = slots_[i].timestep;
+		if (fills_->states[i] != SlotReady || !IsDue(timestep)) {
+			continue;
+		}
+		auto distance = displayed_ == NoTimestep ? 0 : Distance(displayed_, timestep);
+		if (distance > bestDistance) {
+			best = i;
+			bestDistance = distance;
+		}
+	}
+	if (best >= 0) {
+		return StartUpload(best);
+	}
+
+	auto next = NextTimestep(loop);
+	if (next == NoTimestep || backTimestep_ == next || displayed_ != TargetTimestep()) {
+		return 0;
+	}
+	auto slot = FindSlot(next);
+	if (slot >= 0 && fills_->states[slot] == SlotReady) {
+		return StartUpload(slot);
+	}
+	return 0;
+}
+
+// Slots are not tied to timesteps, as t % depth would be: a looping series
+// whose length is not a multiple of the depth would have the first timesteps
+// fight the last ones for a slot. Instead a timestep of the window that is
+// neither staged nor in a texture takes any slot that is not busy and holds
+// nothing the window still needs.
+void TimeSeriesPlayer::Prefetch(bool loop)
+{
+	auto depth = (int)slots_.size();
+	for (int i = 0; i < depth; ++i) {
+		auto timestep = TargetTimestep() + i;
+		if (timestep >= desc_.timesteps) {
+			if (!loop) {
+				break;
+			}
+			timestep -= desc_.timesteps;
+		}
+		// Already in one of the textures, or on its way there.
+		if (timestep == backTimestep_ || timestep == displayed_ || FindSlot(timestep) >= 0) {
+			continue;
+		}
+		int index = -1;
+		for (int j = 0; j < depth && index < 0; ++j) {
+			auto state = fills_->states[j].load();
+			if (j == uploadingSlot_ || state == SlotFilling) {
+				continue;
+			}
+			auto held = slots_[j].timestep;
+			if (state == SlotIdle || !InWindow(held, loop) || held == displayed_) {
+				index = j;
+			}
+		}
+		if (index < 0) {
+			break;
+		}
+		auto& slot = slots_[index];
+
+		if (!slot.mapped) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+			slot.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, timestepBytes_, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (!slot.mapped) {
+				continue;
+			}
+		}
+		slot.timestep = timestep;
+		fills_->states[index] = SlotFilling;
+
+		auto fills = fills_;
+		auto source = file_->Data() + desc_.dataOffset + (size_t)timestep * desc_.PayloadSize();
+		auto desc = desc_;
+		auto region = region_;
+		auto bricks = bricks_;
+		auto dst = slot.mapped;
+		auto hashes = slot.hashes.data();
+		pool_.Submit([fills, source, desc, region, bricks, dst, hashes, index] {
+			if (!fills->cancelled) {
+				CopyAndHashRegion(source, desc, region, bricks, dst, hashes);
+			}
+			fills->states[index] = SlotReady;
+		});
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "mappedfile.h"
+#include "threadpool.h"
+#include "volumeformat.h"
+#include "volumeupload.h"
+
+#include <memory>
+
+// Plays back a time series, a mapped payload of several volumes stored back
+// to back. Pool workers copy the timesteps just ahead of the playhead out of
+// the mapping into a ring of mapped pixel buffers, so page faults never land
+// on the render thread. The render thread uploads the newest timestep that is
+// due into the back one of two textures and only swaps it to the front once
+// the GPU has finished the copy, so the texture being drawn is never written
+// and playback never waits on I/O. Timesteps that are not ready in time are
+// skipped rather than waited for.
+//
+// Consecutive timesteps of a simulation often differ in only part of the
+// volume, so the fills also hash each DeltaBrickSize brick of a timestep, and
+// an upload copies only the bricks whose hash differs from what the back
+// texture already holds.
+class TimeSeriesPlayer
+{
+public:
+	// region of every timestep is played; prefetchDepth is the number of
+	// timesteps staged ahead of the playhead.
+	TimeSeriesPlayer(std::shared_ptr<MappedFile> file, const VolumeDesc& desc, const VolumeRegion& region,
+		const TextureFormat& format, ThreadPool& pool, int prefetchDepth);
+	~TimeSeriesPlayer();
+	TimeSeriesPlayer(const TimeSeriesPlayer&) = delete;
+	TimeSeriesPlayer& operator=(const TimeSeriesPlayer&) = delete;
+
+	// Render thread, once per frame. Advances the playhead by the time since
+	// the last call. Returns the bytes copied into the textures.
+	size_t Update(float timestepsPerSecond, bool loop);
+
+	void SetPlaying(bool playing);
+	bool IsPlaying() const { return playing_; }
+	void Seek(int timestep);
+
+	// Holds DisplayedTimestep(), or nothing yet if that is -1.
+	GLuint Texture() const { return textures_[front_]; }
+	int DisplayedTimestep() const { return displayed_; }
+	// Timestep under the playhead.
+	int TargetTimestep() const { return (int)playhead_; }
+	int Timesteps() const { return desc_.timesteps; }
+	// Timesteps the playhead moved past before they were ready.
+	int DroppedTimesteps() const { return dropped_; }
+	// Frames drawn while playing with an older timestep than the one due.
+	int LateFrames() const { return lateFrames_; }
+	// Staged and ready to upload.
+	int ReadyTimesteps() const;
+	// Bricks the last upload copied, out of BrickCount().
+	int DirtyBricks() const { return dirtyBricks_; }
+	int BrickCount() const { return bricks_.x * bricks_.y * bricks_.z; }
+
+private:
+	static const int NoTimestep = -1;
+
+	enum SlotState
+	{
+		SlotIdle,
+		SlotFilling,
+		SlotReady,
+	};
+
+	struct Slot
+	{
+		GLuint pbo = 0;
+		uint8_t* mapped = nullptr;
+		int timestep = NoTimestep;
+		// Of each brick of the staged timestep, written by its fill.
+		std::vector<uint64_t> hashes;
+	};
+
+	// Shared with the fill tasks, so one finishing after the player has gone
+	// still has somewhere to report to.
+	struct Fills;
+
+	// Forward distance from one timestep to another in play order.
+	int Distance(int from, int to) const;
+	// Past the displayed timestep but not past the playhead.
+	bool IsDue(int timestep) const;
+	// Among the prefetchDepth timesteps from the playhead on.
+	bool InWindow(int timestep, bool loop) const;
+	// Slot filling, holding or uploading timestep, or -1.
+	int FindSlot(int timestep) const;
+	int NextTimestep(bool loop) const;
+	void FinishUpload();
+	size_t StartUpload(int slot);
+	size_t ChooseUpload(bool loop);
+	void Prefetch(bool loop);
+
+	std::shared_ptr<MappedFile> file_;
+	VolumeDesc desc_;
+	VolumeRegion region_;
+	TextureFormat format_;
+	ThreadPool& pool_;
+	std::shared_ptr<Fills> fills_;
+	size_t timestepBytes_;
+	bool swapBytes_;
+	glm::ivec3 bricks_;
+
+	std::vector<Slot> slots_;
+	GLuint textures_[2] = {};
+	// Brick hashes of what each texture holds; empty if that is unknown.
+	std::vector<uint64_t> textureHashes_[2];
+	int front_ = 0;
+	// Slot being copied into the back texture, or -1, and the fence for it.
+	int uploadingSlot_ = -1;
+	GLsync uploadFence_ = nullptr;
+	// Complete in the back texture, waiting to be swapped in when due.
+	int backTimestep_ = NoTimestep;
+
+	bool playing_ = false;
+	double playhead_ = 0.0;
+	uint64_t lastUpdateTime_ = 0;
+	int displayed_ = NoTimestep;
+	// The next swap follows a seek, not playback, so skips are not drops.
+	bool seeked_ = true;
+	int dropped_ = 0;
+	int lateFrames_ = 0;
+	int dirtyBricks_ = 0;
+};
@@ -0,0 +1,578 @@
+// transcode.cpp : Headless converter from raw volumes and TIFF stacks to
+// multi-resolution, compressed brick files.
+//
+//   volumetranscode <input> <output.bricks> [--brick-size N] [--levels N] [--threads N] [--no-compress]
+//   volumetranscode --bench-stats <input> [--threads N]
+//
+// The conversion is a pipeline of stages joined by bounded queues:
+//   read -> brick and downsample -> compress (one worker per core) -> write
+// Only a couple of Z slabs of brickSize slices, one slab per extra level and
+// a few bricks per worker are in memory at once, however big the input.
+#include "brickcodec.h"
+#include "brickfile.h"
+#include "imagestack.h"
+#include "log.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+#include "volumeformat.h"
+#include "volumestats.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+template<typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+	// Blocks while the queue is full.
+	void Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		notFull_.wait(lock, [this] { return items_.size() < capacity_; });
+		items_.push_back(std::move(item));
+		notEmpty_.notify_one();
+	}
+
+	// Blocks while the queue is empty; false once it is closed and drained.
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		notEmpty_.wait(lock, [this] { return !items_.empty() || closed_; });
+		if (items_.empty()) {
+			return false;
+		}
+		item = std::move(items_.front());
+		items_.pop_front();
+		notFull_.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		notEmpty_.notify_all();
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable notFull_;
+	std::condition_variable notEmpty_;
+	std::deque<T> items_;
+	size_t capacity_;
+	bool closed_ = false;
+};
+
+// Bytes through a stage and the time its threads spent working on them,
+// waits on the queues excluded.
+struct StageCounter
+{
+	const char* name;
+	std::atomic<uint64_t> bytes = 0;
+	std::atomic<uint64_t> busyMicroseconds = 0;
+};
+
+class StageTimer
+{
+public:
+	StageTimer(StageCounter& counter, uint64_t bytes) : counter_(counter), bytes_(bytes), start_(Clock::now()) {}
+	~StageTimer()
+	{
+		counter_.busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start_).count();
+		counter_.bytes += bytes_;
+	}
+
+private:
+	StageCounter& counter_;
+	uint64_t bytes_;
+	Clock::time_point start_;
+};
+
+struct Slab
+{
+	int level = 0;
+	int firstSlice = 0;
+	int sliceCount = 0;
+	std::vector<uint8_t> data;
+};
+
+struct RawBrick
+{
+	uint32_t index;
+	glm::ivec3 validSize;
+	std::vector<uint8_t> data;
+};
+
+struct EncodedBrick
+{
+	uint32_t index;
+	BrickEncoding encoding;
+	BrickStats stats;
+	std::vector<uint8_t> data;
+};
+
+// A volume to convert: its layout, a way to read level 0 slices in order into
+// a tightly packed, native byte order slab, and its stats once all are read.
+struct Input
+{
+	VolumeDesc desc;
+	std::function<void(int firstSlice, int sliceCount, uint8_t* dst)> read;
+	std::function<void(VolumeStats& stats)> stats;
+};
+
+// Maps the payload desc points at, checking it is all there.
+bool OpenMappedPayload(const VolumeDesc& desc, MappedFile& file, std::string& error)
+{
+	if (!file.Open(desc.dataFile)) {
+		error = "Failed to open volume data " + desc.dataFile.string();
+		return false;
+	}
+	if (file.Size() < desc.dataOffset + desc.PayloadSize()) {
+		error = "Volume data " + desc.dataFile.string() + " is truncated";
+		return false;
+	}
+	return true;
+}
+
+bool OpenRawInput(const std::experimental::filesystem::path& path, Input& input, std::string& error)
+{
+	auto& desc = input.desc;
+	if (!ReadVolumeHeader(path, desc, error)) {
+		return false;
+	}
+	if (desc.timesteps > 1) {
+		error = "Brick files hold a single volume, " + path.string() + " has " + std::to_string(desc.timesteps) + " timesteps";
+		return false;
+	}
+	auto file = std::make_shared<MappedFile>();
+	if (!OpenMappedPayload(desc, *file, error)) {
+		return false;
+	}
+
+	auto offset = desc.dataOffset;
+	auto sliceBytes = (size_t)desc.dims.x * desc.dims.y * desc.VoxelBytes();
+	auto sampleBytes = VoxelSize(desc.voxelType);
+	auto swapBytes = desc.bigEndian && sampleBytes > 1;
+	input.read = [file, offset, sliceBytes, sampleBytes, swapBytes](int firstSlice, int sliceCount, uint8_t* dst) {
+		auto sliceOffset = offset + firstSlice * sliceBytes;
+		file->AdviseSequential(sliceOffset + sliceCount * sliceBytes, sliceCount * sliceBytes);
+		memcpy(dst, file->Data() + sliceOffset, sliceCount * sliceBytes);
+		if (swapBytes) {
+			for (auto sample = dst; sample < dst + sliceCount * sliceBytes; sample += sampleBytes) {
+				std::reverse(sample, sample + sampleBytes);
+			}
+		}
+	};
+	// A second pass over the mapping, which the read stage has just left in
+	// the page cache.
+	auto statsDesc = desc;
+	input.stats = [file, statsDesc](VolumeStats& stats) {
+		CalculateVolumeStats(file->Data() + statsDesc.dataOffset, statsDesc, stats);
+	};
+	desc.bigEndian = false;
+	return true;
+}
+
+// Decodes through the same ImageStackLoad the viewer uses, on its own pool so
+// decode tasks never queue behind the compressors.
+bool OpenImageStackInput(const std::experimental::filesystem::path& path, ThreadPool& pool, Input& input, std::string& error)
+{
+	std::vector<SliceChannels> slices;
+	if (!DescribeImageStack(path, slices, input.desc, error)) {
+		return false;
+	}
+	VolumeRegion wholeStack;
+	wholeStack.dims = input.desc.dims;
+	auto load = std::make_shared<ImageStackLoad>(slices, input.desc, wholeStack, pool);
+	auto sliceBytes = (size_t)input.desc.dims.x * input.desc.dims.y * input.desc.VoxelBytes();
+	input.read = [load, sliceBytes](int firstSlice, int sliceCount, uint8_t* dst) {
+		// Copied out as slices become available, like the uploader does, since
+		// the load only decodes a bounded window ahead of the last copy.
+		auto nextSlice = firstSlice;
+		while (nextSlice < firstSlice + sliceCount) {
+			load->Pump();
+			auto available = glm::min(load->AvailableSlices(), firstSlice + sliceCount);
+			if (available > nextSlice) {
+				load->CopySlices(nextSlice, available - nextSlice, dst + (nextSlice - firstSlice) * sliceBytes);
+				nextSlice = available;
+			} else {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	};
+	input.stats = [load](VolumeStats& stats) {
+		load->GetStats(stats);
+	};
+	return true;
+}
+
+// 2x2x2 box filter. Odd sizes repeat the last voxel along that axis.
+template<typename T>
+void DownsampleForType(const uint8_t* src, glm::ivec3 srcDims, int channels, uint8_t* dst, glm::ivec3 dstDims)
+{
+	using Sum = typename std::conditional<std::is_integral<T>::value, int64_t, double>::type;
+	auto in = (const T*)src;
+	auto out = (T*)dst;
+	for (int z = 0; z < dstDims.z; ++z) {
+		int zs[2] = { 2 * z, glm::min(2 * z + 1, srcDims.z - 1) };
+		for (int y = 0; y < dstDims.y; ++y) {
+			int ys[2] = { 2 * y, glm::min(2 * y + 1, srcDims.y - 1) };
+			for (int x = 0; x < dstDims.x; ++x) {
+				int xs[2] = { 2 * x, glm::min(2 * x + 1, srcDims.x - 1) };
+				for (int c = 0; c < channels; ++c) {
+					Sum sum = 0;
+					for (int i = 0; i < 8; ++i) {
+						sum += in[(((size_t)zs[i >> 2] * srcDims.y + ys[(i >> 1) & 1]) * srcDims.x + xs[i & 1]) * channels + c];
+					}
+					*out++ = std::is_integral<T>::value ? (T)((sum + 4) / 8) : (T)(sum / 8);
+				}
+			}
+		}
+	}
+}
+
+void Downsample(const uint8_t* src, glm::ivec3 srcDims, VoxelType voxelType, int channels, uint8_t* dst, glm::ivec3 dstDims)
+{
+	switch (voxelType) {
+	case VoxelType::UInt8: DownsampleForType<uint8_t>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::Int8: DownsampleForType<int8_t>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::UInt16: DownsampleForType<uint16_t>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::Int16: DownsampleForType<int16_t>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::UInt32: DownsampleForType<uint32_t>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::Int32: DownsampleForType<int32_t>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::Float32: DownsampleForType<float>(src, srcDims, channels, dst, dstDims); break;
+	case VoxelType::Float64: DownsampleForType<double>(src, srcDims, channels, dst, dstDims); break;
+	}
+}
+
+// Cuts each slab into bricks and folds it into the next level down. Slabs of
+// a level arrive in Z order and are brickSize slices deep, so two of them
+// make one slab of the level below.
+class Bricker
+{
+public:
+	Bricker(const BrickFileDesc& desc, BoundedQueue<RawBrick>& bricks, StageCounter& brickStage, StageCounter& downsampleStage)
+		: desc_(desc)
+		, levels_(BrickLevels(desc))
+		, pending_(desc.levelCount)
+		, bricks_(bricks)
+		, brickStage_(brickStage)
+		, downsampleStage_(downsampleStage)
+	{
+	}
+
+	void Consume(Slab slab)
+	{
+		auto& level = levels_[slab.level];
+		auto brickSize = desc_.brickSize;
+		auto voxelBytes = desc_.volume.VoxelBytes();
+		auto slabDims = glm::ivec3(level.dims.x, level.dims.y, slab.sliceCount);
+
+		auto bz = slab.firstSlice / brickSize;
+		for (int by = 0; by < level.bricks.y; ++by) {
+			for (int bx = 0; bx < level.bricks.x; ++bx) {
+				RawBrick brick;
+				{
+					StageTimer timer(brickStage_, desc_.BrickBytes());
+					auto origin = glm::ivec3(bx, by, 0) * brickSize;
+					brick.index = level.firstBrick + ((uint32_t)bz * level.bricks.y + by) * level.bricks.x + bx;
+					brick.validSize = glm::min(slabDims - origin, glm::ivec3(brickSize));
+					brick.data.resize(desc_.BrickBytes());
+					ExtractBrick(slab.data.data(), slabDims, voxelBytes, origin, brickSize, brick.data.data());
+				}
+				bricks_.Push(std::move(brick));
+			}
+		}
+
+		if (slab.level + 1 == desc_.levelCount) {
+			return;
+		}
+		auto nextLevel = slab.level + 1;
+		auto& next = levels_[nextLevel];
+		auto& pending = pending_[nextLevel];
+		auto firstSlice = slab.firstSlice / 2;
+		auto sliceCount = (slab.sliceCount + 1) / 2;
+		if (pending.data.empty()) {
+			pending.level = nextLevel;
+			pending.firstSlice = firstSlice;
+			pending.sliceCount = glm::min(brickSize, next.dims.z - firstSlice);
+			pending.data.resize((size_t)next.dims.x * next.dims.y * pending.sliceCount * voxelBytes);
+		}
+		{
+			auto sliceBytes = (size_t)next.dims.x * next.dims.y * voxelBytes;
+			StageTimer timer(downsampleStage_, slab.data.size());
+			Downsample(slab.data.data(), slabDims, desc_.volume.voxelType, desc_.volume.channels,
+				pending.data.data() + (firstSlice - pending.firstSlice) * sliceBytes, glm::ivec3(next.dims.x, next.dims.y, sliceCount));
+		}
+		slab = Slab();
+		if (firstSlice + sliceCount == pending.firstSlice + pending.sliceCount) {
+			Consume(std::move(pending));
+			pending = Slab();
+		}
+	}
+
+private:
+	const BrickFileDesc& desc_;
+	std::vector<BrickLevel> levels_;
+	// Partly filled slab of each level above 0.
+	std::vector<Slab> pending_;
+	BoundedQueue<RawBrick>& bricks_;
+	StageCounter& brickStage_;
+	StageCounter& downsampleStage_;
+};
+
+void PrintStage(const StageCounter& stage, double wallSeconds)
+{
+	auto megabytes = stage.bytes / 1.0e6;
+	auto busySeconds = stage.busyMicroseconds / 1.0e6;
+	Log("  %-10s %10.1f MB  %8.2f s busy  %8.1f MB/s per thread  %8.1f MB/s overall\n", stage.name, megabytes, busySeconds,
+		busySeconds >= 0.001 ? megabytes / busySeconds : 0.0, wallSeconds > 0.0 ? megabytes / wallSeconds : 0.0);
+}
+
+void PrintUsage()
+{
+	Log("Usage: volumetranscode <input> <output.bricks> [--brick-size N] [--levels N] [--threads N] [--no-compress]\n"
+		"       volumetranscode --bench-stats <input> [--threads N]\n"
+		"  input is a raw/NRRD/MetaImage/NumPy volume or any slice of a TIFF stack.\n"
+		"  --brick-size  Brick edge in voxels, a power of two from %d to %d (default %d).\n"
+		"  --levels      Resolution levels to write (default: until one brick covers the volume).\n"
+		"  --threads     Compression workers (default: one per core).\n"
+		"  --no-compress Store bricks raw.\n"
+		"  --bench-stats Time the histogram pass over a raw volume on one thread and on --threads.\n", MinBrickSize, MaxBrickSize, DefaultBrickSize);
+}
+
+// The payload is faulted in first, so this measures the histogram and not
+// the disk. Best of a few runs for each thread count.
+int BenchmarkStats(const std::experimental::filesystem::path& inputPath, unsigned threadCount)
+{
+	const int Runs = 5;
+	VolumeDesc desc;
+	std::string error;
+	MappedFile file;
+	if (!ReadVolumeHeader(inputPath, desc, error) || !OpenMappedPayload(desc, file, error)) {
+		Log("Failed to open %s: %s\n", inputPath.string().c_str(), error.c_str());
+		return 1;
+	}
+	auto bytes = desc.PayloadSize();
+	file.Touch(desc.dataOffset, bytes);
+	Log("Histogram of %s (%dx%dx%d %s, %.1f MB)\n", inputPath.string().c_str(),
+		desc.dims.x, desc.dims.y, desc.dims.z, VoxelTypeName(desc.voxelType), bytes / 1.0e6);
+
+	VolumeStats reference;
+	for (auto threads : { 1u, threadCount }) {
+		auto bestSeconds = std::numeric_limits<double>::max();
+		for (int run = 0; run < Runs; ++run) {
+			VolumeStats stats;
+			auto start = Clock::now();
+			CalculateVolumeStats(file.Data() + desc.dataOffset, desc, stats, threads);
+			bestSeconds = glm::min(bestSeconds, std::chrono::duration<double>(Clock::now() - start).count());
+			if (reference.histogram.empty()) {
+				reference = stats;
+			} else if (stats.histogram != reference.histogram || stats.valueRange != reference.valueRange) {
+				Log("Histogram on %u threads differs from the one on 1\n", threads);
+				return 1;
+			}
+		}
+		Log("  %3u threads: %8.3f s  %6.2f GB/s\n", threads, bestSeconds, bytes / 1.0e9 / bestSeconds);
+	}
+	return 0;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		PrintUsage();
+		return 1;
+	}
+	if (std::string(argv[1]) == "--bench-stats") {
+		auto threadCount = std::thread::hardware_concurrency();
+		if (argc == 5 && std::string(argv[3]) == "--threads") {
+			threadCount = (unsigned)glm::max(1, atoi(argv[4]));
+		} else if (argc != 3) {
+			PrintUsage();
+			return 1;
+		}
+		return BenchmarkStats(argv[2], threadCount);
+	}
+	std::experimental::filesystem::path inputPath(argv[1]);
+	std::experimental::filesystem::path outputPath(argv[2]);
+	auto brickSize = DefaultBrickSize;
+	auto levelCount = 0;
+	auto threadCount = (int)std::thread::hardware_concurrency();
+	auto compress = true;
+	for (int i = 3; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto hasValue = i + 1 < argc;
+		if (arg == "--brick-size" && hasValue) {
+			brickSize = atoi(argv[++i]);
+		} else if (arg == "--levels" && hasValue) {
+			levelCount = atoi(argv[++i]);
+		} else if (arg == "--threads" && hasValue) {
+			threadCount = atoi(argv[++i]);
+		} else if (arg == "--no-compress") {
+			compress = false;
+		} else {
+			PrintUsage();
+			return 1;
+		}
+	}
+	if (brickSize < MinBrickSize || brickSize > MaxBrickSize || (brickSize & (brickSize - 1)) != 0 || threadCount < 1) {
+		PrintUsage();
+		return 1;
+	}
+
+	auto startTime = Clock::now();
+	ThreadPool decodePool;
+	Input input;
+	std::string error;
+	auto extension = inputPath.extension().string();
+	auto opened = extension == ".tiff" || extension == ".tif"
+		? OpenImageStackInput(inputPath, decodePool, input, error)
+		: OpenRawInput(inputPath, input, error);
+	if (!opened) {
+		Log("Failed to open %s: %s\n", inputPath.string().c_str(), error.c_str());
+		return 1;
+	}
+
+	BrickFileDesc desc;
+	desc.volume = input.desc;
+	desc.volume.dataFile = outputPath;
+	desc.brickSize = brickSize;
+	auto maxDim = glm::max(desc.volume.dims.x, glm::max(desc.volume.dims.y, desc.volume.dims.z));
+	auto fullLevelCount = 1;
+	while ((maxDim + (1 << (fullLevelCount - 1)) - 1) >> (fullLevelCount - 1) > brickSize) {
+		++fullLevelCount;
+	}
+	desc.levelCount = levelCount > 0 ? glm::min(levelCount, fullLevelCount) : fullLevelCount;
+
+	BrickFileWriter writer;
+	if (!writer.Open(outputPath, desc, error)) {
+		Log("%s\n", error.c_str());
+		return 1;
+	}
+	auto& level0 = writer.Levels()[0];
+	Log("Transcoding %s (%dx%dx%d %s x%d) into %d levels of %d^3 bricks on %d threads\n", inputPath.string().c_str(),
+		desc.volume.dims.x, desc.volume.dims.y, desc.volume.dims.z, VoxelTypeName(desc.volume.voxelType), desc.volume.channels,
+		desc.levelCount, brickSize, threadCount);
+
+	StageCounter readStage = { "read" };
+	StageCounter brickStage = { "brick" };
+	StageCounter downsampleStage = { "downsample" };
+	StageCounter compressStage = { "compress" };
+	StageCounter writeStage = { "write" };
+	StageCounter statsStage = { "stats" };
+
+	BoundedQueue<Slab> slabs(2);
+	BoundedQueue<RawBrick> rawBricks(4 * threadCount);
+	BoundedQueue<EncodedBrick> encodedBricks(4 * threadCount);
+
+	std::thread reader([&] {
+		auto sliceBytes = (size_t)level0.dims.x * level0.dims.y * desc.volume.VoxelBytes();
+		for (int firstSlice = 0; firstSlice < level0.dims.z; firstSlice += brickSize) {
+			Slab slab;
+			slab.firstSlice = firstSlice;
+			slab.sliceCount = glm::min(brickSize, level0.dims.z - firstSlice);
+			{
+				StageTimer timer(readStage, slab.sliceCount * sliceBytes);
+				slab.data.resize(slab.sliceCount * sliceBytes);
+				input.read(slab.firstSlice, slab.sliceCount, slab.data.data());
+			}
+			slabs.Push(std::move(slab));
+		}
+		slabs.Close();
+	});
+
+	std::thread bricker([&] {
+		Bricker bricks(desc, rawBricks, brickStage, downsampleStage);
+		Slab slab;
+		while (slabs.Pop(slab)) {
+			bricks.Consume(std::move(slab));
+		}
+		rawBricks.Close();
+	});
+
+	std::vector<std::thread> compressors;
+	std::atomic<int> runningCompressors = threadCount;
+	for (int i = 0; i < threadCount; ++i) {
+		compressors.emplace_back([&] {
+			RawBrick raw;
+			while (rawBricks.Pop(raw)) {
+				EncodedBrick encoded;
+				{
+					StageTimer timer(compressStage, raw.data.size());
+					encoded.index = raw.index;
+					CalculateBrickStats(raw.data.data(), desc.volume.voxelType, desc.volume.channels, brickSize, raw.validSize, encoded.stats);
+					if (compress && EncodeBrick(raw.data.data(), raw.data.size(), desc.volume.VoxelBytes(), encoded.data)) {
+						encoded.encoding = BrickEncoding::DeltaLz;
+					} else {
+						encoded.encoding = BrickEncoding::Raw;
+						encoded.data = std::move(raw.data);
+					}
+				}
+				encodedBricks.Push(std::move(encoded));
+			}
+			if (--runningCompressors == 0) {
+				encodedBricks.Close();
+			}
+		});
+	}
+
+	// The writer runs here. On failure it keeps draining so the other stages
+	// can finish and be joined.
+	auto failed = false;
+	EncodedBrick encoded;
+	while (encodedBricks.Pop(encoded)) {
+		if (failed) {
+			continue;
+		}
+		StageTimer timer(writeStage, encoded.data.size());
+		if (!writer.WriteBrick(encoded.index, encoded.data.data(), encoded.data.size(), encoded.encoding, encoded.stats, error)) {
+			Log("%s\n", error.c_str());
+			failed = true;
+		}
+	}
+	reader.join();
+	bricker.join();
+	for (auto& compressor : compressors) {
+		compressor.join();
+	}
+	if (failed) {
+		return 1;
+	}
+
+	VolumeStats stats;
+	{
+		StageTimer timer(statsStage, desc.volume.PayloadSize());
+		input.stats(stats);
+	}
+	writer.SetStats(stats);
+	if (!writer.Finish(error)) {
+		Log("%s\n", error.c_str());
+		return 1;
+	}
+
+	auto wallSeconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+	auto inputBytes = desc.volume.PayloadSize();
+	Log("Wrote %s: %.1f MB in, %.1f MB out (%.2fx) in %.2f s, %.1f MB/s\n", outputPath.string().c_str(),
+		inputBytes / 1.0e6, writer.BytesWritten() / 1.0e6, (double)inputBytes / writer.BytesWritten(),
+		wallSeconds, inputBytes / 1.0e6 / wallSeconds);
+	for (auto stage : { &readStage, &brickStage, &downsampleStage, &compressStage, &writeStage, &statsStage }) {
+		PrintStage(*stage, wallSeconds);
+	}
+	return 0;
+}
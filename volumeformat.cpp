@@ -0,0 +1,591 @@
+#include "volumeformat.h"
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <regex>
+#include <sstream>
+
+using namespace std::experimental::filesystem;
+
+size_t VoxelSize(VoxelType type)
+{
+	switch (type) {
+	case VoxelType::UInt8:
+	case VoxelType::Int8:
+		return 1;
+	case VoxelType::UInt16:
+	case VoxelType::Int16:
+		return 2;
+	case VoxelType::UInt32:
+	case VoxelType::Int32:
+	case VoxelType::Float32:
+		return 4;
+	case VoxelType::Float64:
+		return 8;
+	}
+	return 1;
+}
+
+const char* VoxelTypeName(VoxelType type)
+{
+	switch (type) {
+	case VoxelType::UInt8: return "uint8";
+	case VoxelType::Int8: return "int8";
+	case VoxelType::UInt16: return "uint16";
+	case VoxelType::Int16: return "int16";
+	case VoxelType::UInt32: return "uint32";
+	case VoxelType::Int32: return "int32";
+	case VoxelType::Float32: return "float32";
+	case VoxelType::Float64: return "float64";
+	}
+	return "unknown";
+}
+
+glm::vec2 VoxelTypeRange(VoxelType type)
+{
+	switch (type) {
+	case VoxelType::UInt8: return glm::vec2(0.0f, 255.0f);
+	case VoxelType::Int8: return glm::vec2(-128.0f, 127.0f);
+	case VoxelType::UInt16: return glm::vec2(0.0f, 65535.0f);
+	case VoxelType::Int16: return glm::vec2(-32768.0f, 32767.0f);
+	case VoxelType::UInt32: return glm::vec2(0.0f, 4294967295.0f);
+	case VoxelType::Int32: return glm::vec2(-2147483648.0f, 2147483647.0f);
+	default: return glm::vec2(0.0f, 1.0f);
+	}
+}
+
+namespace {
+
+// Headers are small, anything past this is payload we don't want to touch.
+const size_t MaxHeaderSize = 64 * 1024;
+
+std::string ReadHeaderBytes(const path& filepath)
+{
+	std::ifstream stream(filepath, std::ios::binary);
+	std::string bytes(MaxHeaderSize, '\0');
+	stream.read(&bytes[0], bytes.size());
+	bytes.resize((size_t)stream.gcount());
+	return bytes;
+}
+
+std::string Trim(const std::string& str)
+{
+	auto begin = str.find_first_not_of(" \t\r\n");
+	if (begin == std::string::npos) {
+		return std::string();
+	}
+	auto end = str.find_last_not_of(" \t\r\n");
+	return str.substr(begin, end - begin + 1);
+}
+
+std::string ToLower(std::string str)
+{
+	for (auto& c : str) {
+		c = (char)tolower((unsigned char)c);
+	}
+	return str;
+}
+
+std::vector<std::string> SplitWhitespace(const std::string& str)
+{
+	std::vector<std::string> tokens;
+	std::istringstream stream(str);
+	std::string token;
+	while (stream >> token) {
+		tokens.push_back(token);
+	}
+	return tokens;
+}
+
+// Three sizes, or four with the last counting timesteps.
+bool ParseDims(const std::vector<std::string>& tokens, glm::ivec3& dims, int& timesteps)
+{
+	if (tokens.size() != 3 && tokens.size() != 4) {
+		return false;
+	}
+	for (int i = 0; i < 3; ++i) {
+		dims[i] = atoi(tokens[i].c_str());
+		if (dims[i] <= 0) {
+			return false;
+		}
+	}
+	timesteps = tokens.size() == 4 ? atoi(tokens[3].c_str()) : 1;
+	return timesteps > 0;
+}
+
+// Resolves a detached data file name relative to the header that referenced it.
+path ResolveDataFile(const path& headerPath, const std::string& name)
+{
+	path dataPath(name);
+	if (dataPath.is_absolute()) {
+		return dataPath;
+	}
+	return headerPath.parent_path() / dataPath;
+}
+
+// Negative skips mean "the payload is the last SeriesSize() bytes of the file".
+bool ResolveTrailingPayload(VolumeDesc& desc, std::string& error)
+{
+	std::error_code ec;
+	auto fileSize = file_size(desc.dataFile, ec);
+	if (ec || fileSize < desc.SeriesSize()) {
+		error = "Data file " + desc.dataFile.string() + " is smaller than its payload";
+		return false;
+	}
+	desc.dataOffset = fileSize - desc.SeriesSize();
+	return true;
+}
+
+bool ParseNrrdType(const std::string& value, VoxelType& type)
+{
+	static const std::pair<const char*, VoxelType> names[] = {
+		{ "uchar", VoxelType::UInt8 }, { "unsigned char", VoxelType::UInt8 }, { "uint8", VoxelType::UInt8 }, { "uint8_t", VoxelType::UInt8 },
+		{ "signed char", VoxelType::Int8 }, { "int8", VoxelType::Int8 }, { "int8_t", VoxelType::Int8 },
+		{ "ushort", VoxelType::UInt16 }, { "unsigned short", VoxelType::UInt16 }, { "unsigned short int", VoxelType::UInt16 }, { "uint16", VoxelType::UInt16 }, { "uint16_t", VoxelType::UInt16 },
+		{ "short", VoxelType::Int16 }, { "short int", VoxelType::Int16 }, { "signed short", VoxelType::Int16 }, { "signed short int", VoxelType::Int16 }, { "int16", VoxelType::Int16 }, { "int16_t", VoxelType::Int16 },
+		{ "uint", VoxelType::UInt32 }, { "unsigned int", VoxelType::UInt32 }, { "uint32", VoxelType::UInt32 }, { "uint32_t", VoxelType::UInt32 },
+		{ "int", VoxelType::Int32 }, { "signed int", VoxelType::Int32 }, { "int32", VoxelType::Int32 }, { "int32_t", VoxelType::Int32 },
+		{ "float", VoxelType::Float32 },
+		{ "double", VoxelType::Float64 },
+	};
+	for (auto& name : names) {
+		if (value == name.first) {
+			type = name.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ReadNrrdHeader(const path& filepath, const std::string& header, VolumeDesc& desc, std::string& error)
+{
+	std::istringstream stream(header);
+	std::string line;
+	std::getline(stream, line);
+	if (line.compare(0, 4, "NRRD") != 0) {
+		error = "Missing NRRD magic";
+		return false;
+	}
+
+	bool haveType = false;
+	bool haveSizes = false;
+	bool haveDataFile = false;
+	bool headerTerminated = false;
+	int64_t byteSkip = 0;
+	int lineSkip = 0;
+	while (std::getline(stream, line)) {
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (line.empty()) {
+			headerTerminated = true;
+			break;
+		}
+		if (line[0] == '#' || line.find(":=") != std::string::npos) {
+			continue;
+		}
+		auto colon = line.find(": ");
+		if (colon == std::string::npos) {
+			continue;
+		}
+		auto field = ToLower(Trim(line.substr(0, colon)));
+		auto value = Trim(line.substr(colon + 2));
+
+		if (field == "type") {
+			if (!ParseNrrdType(ToLower(value), desc.voxelType)) {
+				error = "Unsupported NRRD type: " + value;
+				return false;
+			}
+			haveType = true;
+		} else if (field == "dimension") {
+			auto dimension = atoi(value.c_str());
+			if (dimension != 3 && dimension != 4) {
+				error = "Only 3 and 4 dimensional NRRD files are supported";
+				return false;
+			}
+		} else if (field == "sizes") {
+			if (!ParseDims(SplitWhitespace(value), desc.dims, desc.timesteps)) {
+				error = "Bad NRRD sizes: " + value;
+				return false;
+			}
+			haveSizes = true;
+		} else if (field == "spacings") {
+			auto tokens = SplitWhitespace(value);
+			for (int i = 0; i < 3 && i < (int)tokens.size(); ++i) {
+				auto spacing = (float)atof(tokens[i].c_str());
+				if (spacing > 0.0f) {
+					desc.spacing[i] = spacing;
+				}
+			}
+		} else if (field == "space directions") {
+			// One "(x,y,z)" vector per axis, the spacing is its length.
+			size_t pos = 0;
+			for (int i = 0; i < 3; ++i) {
+				auto open = value.find('(', pos);
+				auto close = value.find(')', open);
+				if (open == std::string::npos || close == std::string::npos) {
+					break;
+				}
+				glm::vec3 dir;
+				if (sscanf(value.c_str() + open, "(%f,%f,%f)", &dir.x, &dir.y, &dir.z) == 3 && glm::length(dir) > 0.0f) {
+					desc.spacing[i] = glm::length(dir);
+				}
+				pos = close + 1;
+			}
+		} else if (field == "endian") {
+			desc.bigEndian = ToLower(value) == "big";
+		} else if (field == "encoding") {
+			if (ToLower(value) != "raw") {
+				error = "Unsupported NRRD encoding: " + value;
+				return false;
+			}
+		} else if (field == "data file" || field == "datafile") {
+			if (value.compare(0, 4, "LIST") == 0 || value.find('%') != std::string::npos) {
+				error = "Multi-file NRRD data is not supported";
+				return false;
+			}
+			desc.dataFile = ResolveDataFile(filepath, value);
+			haveDataFile = true;
+		} else if (field == "byte skip" || field == "byteskip") {
+			byteSkip = atoll(value.c_str());
+		} else if (field == "line skip" || field == "lineskip") {
+			lineSkip = atoi(value.c_str());
+		}
+	}
+
+	if (!haveType || !haveSizes) {
+		error = "NRRD header is missing type or sizes";
+		return false;
+	}
+
+	if (haveDataFile) {
+		desc.dataOffset = 0;
+		if (lineSkip > 0) {
+			std::ifstream dataStream(desc.dataFile, std::ios::binary);
+			for (int i = 0; i < lineSkip && std::getline(dataStream, line); ++i) {
+			}
+			desc.dataOffset = (uint64_t)dataStream.tellg();
+		}
+	} else {
+		if (!headerTerminated) {
+			error = "NRRD header is not terminated by a blank line";
+			return false;
+		}
+		desc.dataFile = filepath;
+		desc.dataOffset = (uint64_t)stream.tellg();
+	}
+
+	if (byteSkip < 0) {
+		return ResolveTrailingPayload(desc, error);
+	}
+	desc.dataOffset += (uint64_t)byteSkip;
+	return true;
+}
+
+bool ParseMetaType(const std::string& value, VoxelType& type)
+{
+	static const std::pair<const char*, VoxelType> names[] = {
+		{ "MET_UCHAR", VoxelType::UInt8 }, { "MET_CHAR", VoxelType::Int8 },
+		{ "MET_USHORT", VoxelType::UInt16 }, { "MET_SHORT", VoxelType::Int16 },
+		{ "MET_UINT", VoxelType::UInt32 }, { "MET_INT", VoxelType::Int32 },
+		{ "MET_FLOAT", VoxelType::Float32 }, { "MET_DOUBLE", VoxelType::Float64 },
+	};
+	for (auto& name : names) {
+		if (value == name.first) {
+			type = name.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ReadMetaImageHeader(const path& filepath, const std::string& header, VolumeDesc& desc, std::string& error)
+{
+	std::istringstream stream(header);
+	std::string line;
+	bool haveType = false;
+	bool haveSizes = false;
+	bool haveDataFile = false;
+	int64_t headerSize = 0;
+	while (std::getline(stream, line)) {
+		auto equals = line.find('=');
+		if (equals == std::string::npos) {
+			continue;
+		}
+		auto key = Trim(line.substr(0, equals));
+		auto value = Trim(line.substr(equals + 1));
+
+		if (key == "NDims") {
+			auto dimension = atoi(value.c_str());
+			if (dimension != 3 && dimension != 4) {
+				error = "Only 3 and 4 dimensional MetaImage files are supported";
+				return false;
+			}
+		} else if (key == "DimSize") {
+			if (!ParseDims(SplitWhitespace(value), desc.dims, desc.timesteps)) {
+				error = "Bad MetaImage DimSize: " + value;
+				return false;
+			}
+			haveSizes = true;
+		} else if (key == "ElementType") {
+			if (!ParseMetaType(value, desc.voxelType)) {
+				error = "Unsupported MetaImage ElementType: " + value;
+				return false;
+			}
+			haveType = true;
+		} else if (key == "ElementSpacing" || (key == "ElementSize" && desc.spacing == glm::vec3(1.0f))) {
+			auto tokens = SplitWhitespace(value);
+			for (int i = 0; i < 3 && i < (int)tokens.size(); ++i) {
+				auto spacing = (float)atof(tokens[i].c_str());
+				if (spacing > 0.0f) {
+					desc.spacing[i] = spacing;
+				}
+			}
+		} else if (key == "BinaryDataByteOrderMSB" || key == "ElementByteOrderMSB") {
+			desc.bigEndian = ToLower(value) == "true";
+		} else if (key == "CompressedData") {
+			if (ToLower(value) == "true") {
+				error = "Compressed MetaImage data is not supported";
+				return false;
+			}
+		} else if (key == "ElementNumberOfChannels") {
+			if (atoi(value.c_str()) != 1) {
+				error = "Only single channel MetaImage files are supported";
+				return false;
+			}
+		} else if (key == "HeaderSize") {
+			headerSize = atoll(value.c_str());
+		} else if (key == "ElementDataFile") {
+			// Always the last field; for LOCAL the payload starts on the next line.
+			if (value == "LOCAL") {
+				desc.dataFile = filepath;
+				desc.dataOffset = (uint64_t)stream.tellg();
+			} else if (value.compare(0, 4, "LIST") == 0 || value.find('%') != std::string::npos) {
+				error = "Multi-file MetaImage data is not supported";
+				return false;
+			} else {
+				desc.dataFile = ResolveDataFile(filepath, value);
+				desc.dataOffset = 0;
+			}
+			haveDataFile = true;
+			break;
+		}
+	}
+
+	if (!haveType || !haveSizes || !haveDataFile) {
+		error = "MetaImage header is missing DimSize, ElementType or ElementDataFile";
+		return false;
+	}
+	if (headerSize < 0) {
+		return ResolveTrailingPayload(desc, error);
+	}
+	desc.dataOffset += (uint64_t)headerSize;
+	return true;
+}
+
+// Pulls the value of 'key' out of the Python dict literal in an .npy header.
+std::string NpyDictValue(const std::string& dict, const std::string& key)
+{
+	auto keyPos = dict.find("'" + key + "'");
+	if (keyPos == std::string::npos) {
+		return std::string();
+	}
+	auto colon = dict.find(':', keyPos);
+	if (colon == std::string::npos) {
+		return std::string();
+	}
+	auto begin = colon + 1;
+	while (begin < dict.size() && dict[begin] == ' ') {
+		++begin;
+	}
+	size_t end;
+	if (dict[begin] == '(') {
+		end = dict.find(')', begin) + 1;
+	} else if (dict[begin] == '\'') {
+		end = dict.find('\'', begin + 1) + 1;
+	} else {
+		end = dict.find_first_of(",}", begin);
+	}
+	return Trim(dict.substr(begin, end - begin));
+}
+
+bool ReadNpyHeader(const path& filepath, const std::string& header, VolumeDesc& desc, std::string& error)
+{
+	if (header.size() < 10 || header.compare(0, 6, "\x93NUMPY") != 0) {
+		error = "Missing NumPy magic";
+		return false;
+	}
+	auto majorVersion = (uint8_t)header[6];
+	size_t dictLength;
+	size_t dictStart;
+	if (majorVersion == 1) {
+		dictLength = (uint8_t)header[8] | ((uint8_t)header[9] << 8);
+		dictStart = 10;
+	} else {
+		if (header.size() < 12) {
+			error = "Truncated NumPy header";
+			return false;
+		}
+		dictLength = (uint8_t)header[8] | ((uint8_t)header[9] << 8) | ((uint8_t)header[10] << 16) | ((size_t)(uint8_t)header[11] << 24);
+		dictStart = 12;
+	}
+	if (dictStart + dictLength > header.size()) {
+		error = "Truncated NumPy header";
+		return false;
+	}
+	auto dict = header.substr(dictStart, dictLength);
+
+	auto descr = NpyDictValue(dict, "descr");
+	if (descr.size() < 4) {
+		error = "Unsupported NumPy dtype: " + descr;
+		return false;
+	}
+	auto byteOrder = descr[1];
+	auto kind = descr[2];
+	auto size = atoi(descr.c_str() + 3);
+	desc.bigEndian = byteOrder == '>';
+	if (kind == 'u' && size == 1) desc.voxelType = VoxelType::UInt8;
+	else if (kind == 'i' && size == 1) desc.voxelType = VoxelType::Int8;
+	else if (kind == 'u' && size == 2) desc.voxelType = VoxelType::UInt16;
+	else if (kind == 'i' && size == 2) desc.voxelType = VoxelType::Int16;
+	else if (kind == 'u' && size == 4) desc.voxelType = VoxelType::UInt32;
+	else if (kind == 'i' && size == 4) desc.voxelType = VoxelType::Int32;
+	else if (kind == 'f' && size == 4) desc.voxelType = VoxelType::Float32;
+	else if (kind == 'f' && size == 8) desc.voxelType = VoxelType::Float64;
+	else {
+		error = "Unsupported NumPy dtype: " + descr;
+		return false;
+	}
+
+	auto shape = NpyDictValue(dict, "shape");
+	int shapeDims[4];
+	auto shapeCount = sscanf(shape.c_str(), "(%d, %d, %d, %d)", &shapeDims[0], &shapeDims[1], &shapeDims[2], &shapeDims[3]);
+	if (shapeCount != 3 && shapeCount != 4) {
+		error = "Only 3 and 4 dimensional NumPy arrays are supported: " + shape;
+		return false;
+	}
+	// C order arrays are indexed [t][z][y][x], Fortran order ones [x][y][z][t].
+	if (NpyDictValue(dict, "fortran_order") == "True") {
+		desc.dims = glm::ivec3(shapeDims[0], shapeDims[1], shapeDims[2]);
+		desc.timesteps = shapeCount == 4 ? shapeDims[3] : 1;
+	} else if (shapeCount == 4) {
+		desc.dims = glm::ivec3(shapeDims[3], shapeDims[2], shapeDims[1]);
+		desc.timesteps = shapeDims[0];
+	} else {
+		desc.dims = glm::ivec3(shapeDims[2], shapeDims[1], shapeDims[0]);
+	}
+	if (!glm::all(glm::greaterThan(desc.dims, glm::ivec3(0))) || desc.timesteps <= 0) {
+		error = "Bad NumPy shape: " + shape;
+		return false;
+	}
+
+	desc.dataFile = filepath;
+	desc.dataOffset = dictStart + dictLength;
+	return true;
+}
+
+// Headerless 8 bit data with the dimensions in the name, e.g. "head256x256x109".
+bool ReadRawHeader(const path& filepath, VolumeDesc& desc, std::string& error)
+{
+	static const std::regex dimsPattern("(\\d+)x(\\d+)x(\\d+)");
+	auto name = filepath.filename().string();
+	std::smatch match;
+	if (!std::regex_search(name, match, dimsPattern)) {
+		error = "Unrecognised volume format: " + filepath.string();
+		return false;
+	}
+	for (int i = 0; i < 3; ++i) {
+		desc.dims[i] = atoi(match[i + 1].str().c_str());
+	}
+	if (!glm::all(glm::greaterThan(desc.dims, glm::ivec3(0)))) {
+		error = "Bad dimensions in file name: " + name;
+		return false;
+	}
+	desc.dataFile = filepath;
+	desc.dataOffset = 0;
+	desc.voxelType = VoxelType::UInt8;
+	return true;
+}
+
+// Whether SeriesSize() can be worked out without wrapping. No format bounds
+// the product of its sizes, so a bad header could otherwise pass as a small
+// payload.
+bool SeriesSizeFits(const VolumeDesc& desc)
+{
+	size_t factors[] = { (size_t)desc.dims.x, (size_t)desc.dims.y, (size_t)desc.dims.z, desc.VoxelBytes(), (size_t)desc.timesteps };
+	size_t size = 1;
+	for (auto factor : factors) {
+		if (factor != 0 && size > std::numeric_limits<size_t>::max() / factor) {
+			return false;
+		}
+		size *= factor;
+	}
+	return true;
+}
+
+bool ReadFormatHeader(const path& filepath, const std::string& header, VolumeDesc& desc, std::string& error)
+{
+	auto extension = ToLower(filepath.extension().string());
+	if (extension == ".nrrd" || extension == ".nhdr" || header.compare(0, 4, "NRRD") == 0) {
+		return ReadNrrdHeader(filepath, header, desc, error);
+	}
+	if (extension == ".npy" || header.compare(0, 6, "\x93NUMPY") == 0) {
+		return ReadNpyHeader(filepath, header, desc, error);
+	}
+	if (extension == ".mhd" || extension == ".mha" || header.compare(0, 10, "ObjectType") == 0 || header.compare(0, 5, "NDims") == 0) {
+		return ReadMetaImageHeader(filepath, header, desc, error);
+	}
+	return ReadRawHeader(filepath, desc, error);
+}
+
+}
+
+bool ReadVolumeHeader(const path& filepath, VolumeDesc& desc, std::string& error)
+{
+	desc = VolumeDesc();
+	auto header = ReadHeaderBytes(filepath);
+	if (header.empty()) {
+		error = "Could not read " + filepath.string();
+		return false;
+	}
+	if (!ReadFormatHeader(filepath, header, desc, error)) {
+		return false;
+	}
+	if (!SeriesSizeFits(desc)) {
+		error = "Volume in " + filepath.string() + " is too large to address";
+		return false;
+	}
+	return true;
+}
+
+VolumeRegion CropBox::Resolve(glm::ivec3 dims) const
+{
+	VolumeRegion region;
+	region.origin = glm::clamp(begin, glm::ivec3(0), glm::max(dims - 1, glm::ivec3(0)));
+	auto last = glm::ivec3(end.x > 0 ? end.x : dims.x + end.x, end.y > 0 ? end.y : dims.y + end.y, end.z > 0 ? end.z : dims.z + end.z);
+	region.dims = glm::clamp(last, region.origin + 1, glm::max(dims, glm::ivec3(1))) - region.origin;
+	return region;
+}
+
+void CopyRegionSlices(const uint8_t* payload, const VolumeDesc& desc, const VolumeRegion& region, int firstSlice, int sliceCount, uint8_t* dst)
+{
+	auto voxelBytes = desc.VoxelBytes();
+	auto rowBytes = (size_t)desc.dims.x * voxelBytes;
+	auto sliceBytes = rowBytes * desc.dims.y;
+	auto regionRowBytes = (size_t)region.dims.x * voxelBytes;
+	for (int z = firstSlice; z < firstSlice + sliceCount; ++z) {
+		auto slice = payload + (size_t)(region.origin.z + z) * sliceBytes + region.origin.y * rowBytes + region.origin.x * voxelBytes;
+		// Whole rows are one contiguous run.
+		if (regionRowBytes == rowBytes) {
+			memcpy(dst, slice, regionRowBytes * region.dims.y);
+			dst += regionRowBytes * region.dims.y;
+			continue;
+		}
+		for (int y = 0; y < region.dims.y; ++y) {
+			memcpy(dst, slice + y * rowBytes, regionRowBytes);
+			dst += regionRowBytes;
+		}
+	}
+}
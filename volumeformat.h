@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+
+enum class VoxelType
+{
+	UInt8,
+	Int8,
+	UInt16,
+	Int16,
+	UInt32,
+	Int32,
+	Float32,
+	Float64,
+};
+
+size_t VoxelSize(VoxelType type);
+const char* VoxelTypeName(VoxelType type);
+// Representable range of the integer types, [0, 1] for the float ones.
+glm::vec2 VoxelTypeRange(VoxelType type);
+
+// Everything needed to find and interpret the voxel payload of a dataset.
+// Only the header is read to fill this in, the payload is mapped later.
+struct VolumeDesc
+{
+	std::experimental::filesystem::path dataFile;
+	uint64_t dataOffset = 0;
+	glm::ivec3 dims = glm::ivec3(0);
+	glm::vec3 spacing = glm::vec3(1.0f);
+	VoxelType voxelType = VoxelType::UInt8;
+	// Interleaved samples per voxel: 1, or 4 for RGBA image stacks.
+	int channels = 1;
+	bool bigEndian = false;
+	// Volumes of a time series, stored back to back.
+	int timesteps = 1;
+
+	size_t VoxelCount() const { return (size_t)dims.x * dims.y * dims.z; }
+	size_t VoxelBytes() const { return VoxelSize(voxelType) * channels; }
+	// One timestep.
+	size_t PayloadSize() const { return VoxelCount() * VoxelBytes(); }
+	size_t SeriesSize() const { return PayloadSize() * timesteps; }
+};
+
+// Detects the format from the extension or the file magic and parses the header.
+// Supported: NRRD (.nrrd/.nhdr, raw encoding), MetaImage (.mhd/.mha, uncompressed),
+// NumPy (.npy) and headerless raw files named like "head256x256x109" (uint8).
+// The first three take a fourth, slowest varying axis as timesteps.
+bool ReadVolumeHeader(const std::experimental::filesystem::path& filepath, VolumeDesc& desc, std::string& error);
+
+// Box of voxels [origin, origin + dims) inside a volume.
+struct VolumeRegion
+{
+	glm::ivec3 origin = glm::ivec3(0);
+	glm::ivec3 dims = glm::ivec3(0);
+};
+
+// Sub-box to load out of a volume, [begin, end) in voxels. End components of
+// zero or less count back from the far edge, so the default box is the whole
+// volume whatever its size.
+struct CropBox
+{
+	glm::ivec3 begin = glm::ivec3(0);
+	glm::ivec3 end = glm::ivec3(0);
+
+	// The box inside a volume of dims, clamped to it and at least a voxel thick.
+	VolumeRegion Resolve(glm::ivec3 dims) const;
+};
+
+// Copies slices [firstSlice, firstSlice + sliceCount) of region out of a
+// payload laid out as desc describes, tightly packed. Only the rows inside
+// the region are read, so pages of a mapped payload outside it are never
+// touched.
+void CopyRegionSlices(const uint8_t* payload, const VolumeDesc& desc, const VolumeRegion& region, int firstSlice, int sliceCount, uint8_t* dst);
+
+template<typename T>
+T ByteSwap(T value)
+{
+	uint8_t bytes[sizeof(T)];
+	memcpy(bytes, &value, sizeof(T));
+	std::reverse(bytes, bytes + sizeof(T));
+	memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+// One sample of a payload, byte swapped from big endian if Swap.
+template<typename T, bool Swap>
+T LoadVoxel(const uint8_t* ptr)
+{
+	T value;
+	memcpy(&value, ptr, sizeof(T));
+	return Swap ? ByteSwap(value) : value;
+}
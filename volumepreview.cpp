@@ -0,0 +1,73 @@
+#include "volumepreview.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+glm::ivec3 PreviewDims(glm::ivec3 dims, int stride)
+{
+	return (dims + stride - 1) / stride;
+}
+
+}
+
+int PreviewStride(const VolumeDesc& desc, const VolumeRegion& region, size_t maxBytes)
+{
+	auto regionBytes = (double)region.dims.x * region.dims.y * region.dims.z * desc.VoxelBytes();
+	auto stride = glm::max(1, (int)std::cbrt(regionBytes / glm::max(maxBytes, desc.VoxelBytes())));
+	for (;;) {
+		auto dims = PreviewDims(region.dims, stride);
+		auto largest = glm::max(region.dims.x, glm::max(region.dims.y, region.dims.z));
+		if ((size_t)dims.x * dims.y * dims.z * desc.VoxelBytes() <= maxBytes || stride >= largest) {
+			return stride;
+		}
+		++stride;
+	}
+}
+
+void ExtractVolumePreview(const uint8_t* payload, const VolumeDesc& desc, const VolumeRegion& region, int stride, VolumePreview& preview)
+{
+	preview.dims = PreviewDims(region.dims, stride);
+	preview.stride = stride;
+	auto voxelBytes = desc.VoxelBytes();
+	auto rowBytes = (size_t)desc.dims.x * voxelBytes;
+	auto sliceBytes = rowBytes * desc.dims.y;
+	preview.voxels.resize((size_t)preview.dims.x * preview.dims.y * preview.dims.z * voxelBytes);
+
+	// Voxel offsets along x are the same for every row.
+	std::vector<size_t> columns(preview.dims.x);
+	for (int x = 0; x < preview.dims.x; ++x) {
+		columns[x] = (region.origin.x + glm::min(x * stride + stride / 2, region.dims.x - 1)) * voxelBytes;
+	}
+
+	auto dst = preview.voxels.data();
+	for (int z = 0; z < preview.dims.z; ++z) {
+		auto slice = payload + (region.origin.z + glm::min(z * stride + stride / 2, region.dims.z - 1)) * sliceBytes;
+		for (int y = 0; y < preview.dims.y; ++y) {
+			auto row = slice + (region.origin.y + glm::min(y * stride + stride / 2, region.dims.y - 1)) * rowBytes;
+			for (auto column : columns) {
+				memcpy(dst, row + column, voxelBytes);
+				dst += voxelBytes;
+			}
+		}
+	}
+}
+
+GLuint CreatePreviewTexture(const VolumePreview& preview, const TextureFormat& format, bool swapBytes)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_3D, texture);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, swapBytes ? GL_TRUE : GL_FALSE);
+	glTexImage3D(GL_TEXTURE_3D, 0, format.internalFormat, preview.dims.x, preview.dims.y, preview.dims.z, 0,
+		format.pixelFormat, format.type, preview.voxels.data());
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+	return texture;
+}
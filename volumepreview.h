@@ -0,0 +1,27 @@
+#pragma once
+
+#include "volumeformat.h"
+#include "volumeupload.h"
+
+// Upper bound on preview size; a few MB is enough to see what is in a volume.
+const size_t DefaultPreviewBytes = 8 * 1024 * 1024;
+
+// Small stand-in for a volume that is still paging in: one voxel from the
+// middle of every stride^3 block. Reading it only touches one slice in stride
+// and one row in stride of those, so a volume far bigger than the preview
+// still gives one in well under a second.
+struct VolumePreview
+{
+	glm::ivec3 dims = glm::ivec3(0);
+	int stride = 1;
+	// Same voxel type and byte order as the payload.
+	std::vector<uint8_t> voxels;
+};
+
+// Smallest stride that keeps the preview of region within maxBytes; 1 means
+// the whole region already fits.
+int PreviewStride(const VolumeDesc& desc, const VolumeRegion& region, size_t maxBytes);
+// payload is laid out as desc describes, the preview covers region of it.
+void ExtractVolumePreview(const uint8_t* payload, const VolumeDesc& desc, const VolumeRegion& region, int stride, VolumePreview& preview);
+// Render thread. The caller owns the returned texture.
+GLuint CreatePreviewTexture(const VolumePreview& preview, const TextureFormat& format, bool swapBytes);
@@ -2,6 +2,23 @@
 //
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_sdl_gl3.h"
+#include "brickcache.h"
+#include "brickfile.h"
+#include "derivedcache.h"
+#include "folderwatch.h"
+#include "gradienthistogram.h"
+#include "imagestack.h"
+#include "ingest.h"
+#include "liveingest.h"
+#include "log.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+#include "timeseries.h"
+#include "volumeformat.h"
+#include "volumepreview.h"
+#include "volumestats.h"
+#include "volumeupload.h"
+#include "zarr.h"
 
 SDL_Window* window_;
 GLuint cubeVertexBuffer_;
@@ -10,12 +27,70 @@ GLuint edgesVertexBuffer_;
 GLuint intersectionPointBuffer_;
 GLuint intersectionTriangleBuffer_;
 GLuint texture_;
+// Strided stand-in shown for the slices of texture_ not uploaded yet.
+GLuint previewTexture_;
 int numIntersectionPoints_;
 int numIntersectionTriangles_;
 glm::mat4 projection_;
 glm::mat4 model_;
 std::vector<float> histData_;
 glm::vec2 histDataRange_;
+VolumeDesc volumeDesc_;
+glm::vec2 volumeValueRange_;
+// Multiplier from voxel values to what the shader samples (normalized formats).
+float textureValueScale_ = 1.0f;
+VolumeUploader volumeUploader_;
+// Set while an image stack is being decoded into the volume texture.
+std::shared_ptr<ImageStackLoad> imageStackLoad_;
+// Set instead while following an image stack that is still being written.
+std::shared_ptr<ImageStackWatch> imageStackWatch_;
+std::unique_ptr<FolderWatch> folderWatch_;
+int watchedSlices_ = 0;
+// SDL_GetTicks of the last listing of a watched stack's folder, which stands
+// in for the FolderWatch if it stops working.
+uint32_t lastStackListing_ = 0;
+// Set instead while chunks of a Zarr array are being read into the volume.
+std::shared_ptr<ZarrLoad> zarrLoad_;
+// Set while a mapped volume is copied into the texture, until every slice
+// has gone through it. With ingestTakesStats_ the histogram comes from it,
+// and is cached under ingestCacheKey_ if that is set.
+std::shared_ptr<IngestSweep> ingestSweep_;
+bool ingestTakesStats_ = false;
+std::string ingestCacheKey_;
+// Value against gradient magnitude, counted on the loader pool once the value
+// range is known, and the image of the counts so far.
+std::shared_ptr<GradientHistogram> gradientHistogram_;
+GLuint gradientHistogramTexture_ = 0;
+// Payload of the volume being loaded, held for the gradient histogram until
+// its value range is known.
+std::shared_ptr<const uint8_t> gradientPayload_;
+// Smallest and largest value of each IngestBrickSize brick of texture_, in
+// sampled units and widened by a brick, once the sweep has seen them all.
+GLuint brickRangeTexture_ = 0;
+// Presets from quantiles of the volume's values, gathered by the sweep or
+// else read off the histogram: a window over the 1st to 99th percentile, and
+// the alpha threshold that hides the darker half of the voxels under it.
+bool hasAutoWindow_ = false;
+glm::vec2 autoWindow_;
+float suggestedAlphaThreshold_ = 0.0f;
+// Set instead of texture_ for brick files, which are paged in by view.
+std::unique_ptr<BrickCache> brickCache_;
+// Set instead of texture_ for volumes with more than one timestep.
+std::unique_ptr<TimeSeriesPlayer> timeSeries_;
+// Listening for live volumes, with --live. Its volume replaces whatever is
+// shown when a producer starts one, and is shown until another load.
+std::unique_ptr<LiveIngest> liveIngest_;
+int liveStream_ = 0;
+bool showingLive_ = false;
+// Bytes copied into volume textures by the last frame.
+size_t frameUploadBytes_ = 0;
+MainThreadQueue mainThreadQueue_;
+// Declared after the queue so it is torn down first, workers may still Post().
+ThreadPool loaderPool_;
+// Bumped by every new load; workers still busy with an older one give up.
+std::atomic<int> loadGeneration_ = 0;
+// Last file opened, so a new crop box can be applied to it.
+std::experimental::filesystem::path volumePath_;
 
 const char* AppName = "Volumetric Data Visualizer";
 
@@ -31,6 +106,8 @@ struct {
 	bool drawTexturedVolume = true;
 	bool updateIntersections = true;
 	bool fullscreen = false;
+	bool halfFloatTextures = false;
+	bool watchImageStacks = false;
 	int cubeNumSlices = 256;
 	float mouseSensitivity = 0.1f;
 	float mouseWheelSensitivity = 0.1f;
@@ -38,6 +115,15 @@ struct {
 	float cameraDistance = 4.0f;
 	float alphaThreshold = 0.2f;
 	float alphaScale = 1.0f;
+	bool skipEmptyBricks = true;
+	int uploadBudgetMB = 64;
+	int hostCacheMB = 2048;
+	int gpuCacheMB = 1024;
+	CropBox crop;
+	float playbackRate = 15.0f;
+	bool loopPlayback = true;
+	int prefetchTimesteps = 4;
+	glm::vec2 window = glm::vec2(0.0f, 255.0f);
 	glm::vec4 backgroundColor = glm::vec4(0.15f, 0.15f, 0.20f, 1.0f);
 } imguiSettings_;
 
@@ -47,10 +133,25 @@ struct Shader {
 	GLint mvpLoc;
 	GLint alphaThresholdLoc;
 	GLint alphaScaleLoc;
+	GLint windowMinLoc;
+	GLint windowMaxLoc;
+	GLint loadedDepthLoc;
+	GLint rgbaVolumeLoc;
+	GLint previewTexLoc;
+	GLint hasPreviewLoc;
+	GLint brickRangesLoc;
+	GLint brickScaleLoc;
+	GLint hasBrickRangesLoc;
+	GLint pageTableLoc;
+	GLint regionOriginLoc;
+	GLint regionDimsLoc;
+	GLint atlasSizeLoc;
+	GLint brickSizeLoc;
 };
 
 Shader debugColorShader_;
 Shader texturedVolumeShader_;
+Shader brickedVolumeShader_;
 
 glm::vec2 windowSize_ = glm::vec2(1280, 720);
 
@@ -184,12 +285,29 @@ void LoadShaders()
 		"#version 330 core\n"
 		"in vec3 texcoord;\n"
 		"uniform sampler3D volumeTex;\n"
+		"uniform sampler3D previewTex;\n"
 		"uniform float alphaThreshold;\n"
 		"uniform float alphaScale;\n"
+		"uniform float windowMin;\n"
+		"uniform float windowMax;\n"
+		"uniform float loadedDepth;\n"
+		"uniform bool hasPreview;\n"
+		"uniform bool rgbaVolume;\n"
+		"uniform sampler3D brickRanges;\n"
+		"uniform vec3 brickScale;\n"
+		"uniform bool hasBrickRanges;\n"
 		"out vec4 color; \n"
 		"void main() { \n"
 		"	vec3 uvw = vec3(texcoord.x, 1-texcoord.y, texcoord.z);\n"
-		"	color = texture(volumeTex, uvw).rrrr;\n"
+		"	if (uvw.z > loadedDepth && !hasPreview) discard;\n"
+		"	if (hasBrickRanges) {\n"
+		"		ivec3 brick = clamp(ivec3(uvw * brickScale), ivec3(0), textureSize(brickRanges, 0) - 1);\n"
+		"		float brickMax = texelFetch(brickRanges, brick, 0).g;\n"
+		"		if ((brickMax - windowMin) / max(windowMax - windowMin, 1e-6) < alphaThreshold) discard;\n"
+		"	}\n"
+		"	vec4 texel = uvw.z > loadedDepth ? texture(previewTex, uvw) : texture(volumeTex, uvw);\n"
+		"	color = rgbaVolume ? texel : texel.rrrr;\n"
+		"	color = clamp((color - windowMin) / max(windowMax - windowMin, 1e-6), 0, 1);\n"
 		"if(color.a < alphaThreshold) color.a = 0;\n"
 		"color.a *= alphaScale;\n"
 		"}"
@@ -199,6 +317,65 @@ void LoadShaders()
 	texturedVolumeShader_.mvpLoc = glGetUniformLocation(texturedVolumeShader_.program, "mvp");
 	texturedVolumeShader_.alphaThresholdLoc = glGetUniformLocation(texturedVolumeShader_.program, "alphaThreshold");
 	texturedVolumeShader_.alphaScaleLoc = glGetUniformLocation(texturedVolumeShader_.program, "alphaScale");
+	texturedVolumeShader_.windowMinLoc = glGetUniformLocation(texturedVolumeShader_.program, "windowMin");
+	texturedVolumeShader_.windowMaxLoc = glGetUniformLocation(texturedVolumeShader_.program, "windowMax");
+	texturedVolumeShader_.loadedDepthLoc = glGetUniformLocation(texturedVolumeShader_.program, "loadedDepth");
+	texturedVolumeShader_.rgbaVolumeLoc = glGetUniformLocation(texturedVolumeShader_.program, "rgbaVolume");
+	texturedVolumeShader_.previewTexLoc = glGetUniformLocation(texturedVolumeShader_.program, "previewTex");
+	texturedVolumeShader_.hasPreviewLoc = glGetUniformLocation(texturedVolumeShader_.program, "hasPreview");
+	texturedVolumeShader_.brickRangesLoc = glGetUniformLocation(texturedVolumeShader_.program, "brickRanges");
+	texturedVolumeShader_.brickScaleLoc = glGetUniformLocation(texturedVolumeShader_.program, "brickScale");
+	texturedVolumeShader_.hasBrickRangesLoc = glGetUniformLocation(texturedVolumeShader_.program, "hasBrickRanges");
+
+	// Same as the textured shader, but the volume is looked up through the
+	// brick cache's page table: the page for the level 0 brick under the
+	// sample names an atlas slot and the level of the brick in it. Samples are
+	// kept half a voxel inside the brick so filtering never reads a neighbouring
+	// slot. The proxy cube spans the cropped region of the volume.
+	std::string brickedFragmentShaderStr =
+		"#version 330 core\n"
+		"in vec3 texcoord;\n"
+		"uniform sampler3D volumeTex;\n"
+		"uniform usampler3D pageTable;\n"
+		"uniform vec3 regionOrigin;\n"
+		"uniform vec3 regionDims;\n"
+		"uniform vec3 atlasSize;\n"
+		"uniform float brickSize;\n"
+		"uniform float alphaThreshold;\n"
+		"uniform float alphaScale;\n"
+		"uniform float windowMin;\n"
+		"uniform float windowMax;\n"
+		"uniform bool rgbaVolume;\n"
+		"out vec4 color; \n"
+		"void main() { \n"
+		"	vec3 uvw = vec3(texcoord.x, 1-texcoord.y, texcoord.z);\n"
+		"	vec3 voxel = regionOrigin + clamp(uvw, 0, 1) * regionDims;\n"
+		"	ivec3 page = min(ivec3(voxel / brickSize), textureSize(pageTable, 0) - 1);\n"
+		"	uvec4 entry = texelFetch(pageTable, page, 0);\n"
+		"	if (entry.a == 255u) discard;\n"
+		"	int level = int(entry.a);\n"
+		"	vec3 local = voxel / float(1 << level) - vec3(page >> level) * brickSize;\n"
+		"	local = clamp(local, 0.5, brickSize - 0.5);\n"
+		"	vec4 texel = texture(volumeTex, (vec3(entry.xyz) * brickSize + local) / atlasSize);\n"
+		"	color = rgbaVolume ? texel : texel.rrrr;\n"
+		"	color = clamp((color - windowMin) / max(windowMax - windowMin, 1e-6), 0, 1);\n"
+		"if(color.a < alphaThreshold) color.a = 0;\n"
+		"color.a *= alphaScale;\n"
+		"}"
+		;
+
+	brickedVolumeShader_.program = CompileAndLinkShaders(texturedVertexShaderStr, brickedFragmentShaderStr);
+	brickedVolumeShader_.mvpLoc = glGetUniformLocation(brickedVolumeShader_.program, "mvp");
+	brickedVolumeShader_.alphaThresholdLoc = glGetUniformLocation(brickedVolumeShader_.program, "alphaThreshold");
+	brickedVolumeShader_.alphaScaleLoc = glGetUniformLocation(brickedVolumeShader_.program, "alphaScale");
+	brickedVolumeShader_.windowMinLoc = glGetUniformLocation(brickedVolumeShader_.program, "windowMin");
+	brickedVolumeShader_.windowMaxLoc = glGetUniformLocation(brickedVolumeShader_.program, "windowMax");
+	brickedVolumeShader_.rgbaVolumeLoc = glGetUniformLocation(brickedVolumeShader_.program, "rgbaVolume");
+	brickedVolumeShader_.pageTableLoc = glGetUniformLocation(brickedVolumeShader_.program, "pageTable");
+	brickedVolumeShader_.regionOriginLoc = glGetUniformLocation(brickedVolumeShader_.program, "regionOrigin");
+	brickedVolumeShader_.regionDimsLoc = glGetUniformLocation(brickedVolumeShader_.program, "regionDims");
+	brickedVolumeShader_.atlasSizeLoc = glGetUniformLocation(brickedVolumeShader_.program, "atlasSize");
+	brickedVolumeShader_.brickSizeLoc = glGetUniformLocation(brickedVolumeShader_.program, "brickSize");
 }
 
 const glm::vec3 cubePos_LBF = { -1.0f, -1.0f, -1.0f };
@@ -273,17 +450,13 @@ void BindShader(const Shader& shader)
 	glEnableVertexAttribArray(shader.positionLoc);
 }
 
-void CalculateHistogramData(std::vector<char> &textureData)
+void CalculateHistogramData(const VolumeStats& stats)
 {
-	histData_ = std::vector<float>(256, 0);
-	for (unsigned char val : textureData)
-	{
-		histData_[val] += 0.01f;
-	}
-
+	histData_ = std::vector<float>(stats.histogram.size(), 0);
 	for (int i = 0; i < histData_.size(); ++i)
 	{
-		histData_[i] = glm::log(histData_[i] + 1.0f);
+		// In double, as float stops resolving single voxels of a bin past 2^24.
+		histData_[i] = (float)glm::log(stats.histogram[i] * 0.01 + 1.0);
 	}
 
 	histDataRange_ = glm::vec2(histData_[0]);
@@ -294,28 +467,574 @@ void CalculateHistogramData(std::vector<char> &textureData)
 	}
 }
 
-void LoadTexture()
+// Scales the unit proxy cube to the physical extent of the volume, so
+// anisotropic spacing and non-cubic dimensions are displayed correctly.
+void UpdateModelForVolume(const VolumeDesc& desc)
 {
-	std::string path = "head256x256x109";
-	auto rwOps = SDL_RWFromFile(path.c_str(), "rb");
-	
-	auto depth = 109;
-	auto width = 256;
-	auto height = 256;
-	auto size = width*height*depth;
-	std::vector<char> textureData(size, 'x');
-	SDL_RWread(rwOps, textureData.data(), 1, size);
+	auto extent = glm::vec3(desc.dims) * desc.spacing;
+	model_ = glm::scale(glm::mat4(1.0f), extent / glm::max(extent.x, glm::max(extent.y, extent.z)));
+}
 
-	CalculateHistogramData(textureData);
+bool IsLoadCurrent(int generation)
+{
+	return generation == loadGeneration_;
+}
+
+void ReleasePreview()
+{
+	if (previewTexture_) {
+		glDeleteTextures(1, &previewTexture_);
+		previewTexture_ = 0;
+	}
+}
 
-	glGenTextures(1, &texture_);
-	glBindTexture(GL_TEXTURE_3D, texture_);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RED, width, height, depth, 0, GL_RED, GL_UNSIGNED_BYTE, textureData.data());
+// Render thread. Drops whatever the previous load left behind.
+void ReleaseVolume()
+{
+	if (imageStackLoad_) {
+		imageStackLoad_->Cancel();
+		imageStackLoad_.reset();
+	}
+	if (imageStackWatch_) {
+		imageStackWatch_->Cancel();
+		imageStackWatch_.reset();
+		folderWatch_.reset();
+	}
+	if (zarrLoad_) {
+		zarrLoad_->Cancel();
+		zarrLoad_.reset();
+	}
+	ingestSweep_.reset();
+	if (gradientHistogram_) {
+		gradientHistogram_->Cancel();
+		gradientHistogram_.reset();
+	}
+	if (gradientHistogramTexture_) {
+		glDeleteTextures(1, &gradientHistogramTexture_);
+		gradientHistogramTexture_ = 0;
+	}
+	gradientPayload_.reset();
+	hasAutoWindow_ = false;
+	if (brickRangeTexture_) {
+		glDeleteTextures(1, &brickRangeTexture_);
+		brickRangeTexture_ = 0;
+	}
+	if (texture_) {
+		glDeleteTextures(1, &texture_);
+		texture_ = 0;
+	}
+	ReleasePreview();
+	volumeUploader_.Cancel();
+	brickCache_.reset();
+	timeSeries_.reset();
+	showingLive_ = false;
+}
+
+// Render thread. Replaces the volume texture with an empty one for desc and
+// starts streaming slices into it from source, which is run on fillPool if
+// one is given.
+void BeginVolume(const VolumeDesc& desc, const TextureFormat& format, VolumeUploader::SlabSource source, ThreadPool* fillPool = nullptr)
+{
+	ReleaseVolume();
+	texture_ = volumeUploader_.Begin(desc, format, source, fillPool);
+	volumeDesc_ = desc;
+	textureValueScale_ = format.valueScale;
+	// Until the histogram pass has found the real range.
+	volumeValueRange_ = VoxelTypeRange(desc.voxelType);
+	imguiSettings_.window = volumeValueRange_;
+	UpdateModelForVolume(desc);
+}
+
+// Render thread. Narrows the window to the percentile preset, unless it has
+// been moved off the full range by hand.
+void ApplyAutoWindow()
+{
+	if (hasAutoWindow_ && imguiSettings_.window == volumeValueRange_) {
+		imguiSettings_.window = autoWindow_;
+	}
+}
+
+// Render thread. Sets the presets from the 1st, 50th and 99th percentile.
+void SetAutoWindow(float low, float median, float high)
+{
+	hasAutoWindow_ = high > low;
+	if (hasAutoWindow_) {
+		autoWindow_ = glm::vec2(low, high);
+		suggestedAlphaThreshold_ = glm::clamp((median - low) / (high - low), 0.0f, 1.0f);
+	}
+}
+
+// Render thread. Presets for loads without a sweep, which have nothing finer
+// to go on than their histogram.
+void SetAutoWindow(const VolumeStats& stats)
+{
+	SetAutoWindow(HistogramQuantile(stats, 0.01), HistogramQuantile(stats, 0.5), HistogramQuantile(stats, 0.99));
+}
+
+// Render thread. For volumes whose stats change as they arrive, the window
+// keeps to the preset, or the full range without one, until moved by hand.
+void FollowAutoWindow(const VolumeStats& stats)
+{
+	auto following = imguiSettings_.window == volumeValueRange_ || (hasAutoWindow_ && imguiSettings_.window == autoWindow_);
+	volumeValueRange_ = stats.valueRange;
+	SetAutoWindow(stats);
+	if (following) {
+		imguiSettings_.window = hasAutoWindow_ ? autoWindow_ : stats.valueRange;
+	}
+}
+
+// Render thread. Starts counting the gradient histogram of the volume being
+// loaded, now that its value range is known.
+void StartGradientHistogram(glm::vec2 valueRange)
+{
+	if (!gradientPayload_) {
+		return;
+	}
+	gradientHistogram_ = std::make_shared<GradientHistogram>(gradientPayload_, volumeDesc_, valueRange);
+	gradientHistogram_->Start(loaderPool_);
+	gradientPayload_.reset();
+}
+
+// Render thread, once per frame. Redraws the gradient histogram image when
+// more slabs have been counted. Counts are on a log scale, like the 1D
+// histogram, with the steepest gradients at the top.
+void UpdateGradientHistogram()
+{
+	if (!gradientHistogram_) {
+		return;
+	}
+	auto finished = gradientHistogram_->Finished();
+	std::vector<uint64_t> counts;
+	if (gradientHistogram_->TakeCounts(counts)) {
+		std::vector<float> levels(counts.size());
+		auto maxLevel = 0.0f;
+		for (size_t bin = 0; bin < counts.size(); ++bin) {
+			levels[bin] = (float)glm::log(counts[bin] + 1.0);
+			maxLevel = glm::max(maxLevel, levels[bin]);
+		}
+		std::vector<uint8_t> pixels(counts.size() * 4);
+		for (int row = 0; row < GradientMagnitudeBins; ++row) {
+			auto src = levels.data() + (GradientMagnitudeBins - 1 - row) * GradientValueBins;
+			auto dst = pixels.data() + row * GradientValueBins * 4;
+			for (int bin = 0; bin < GradientValueBins; ++bin) {
+				auto level = maxLevel > 0.0f ? (uint8_t)(255.0f * src[bin] / maxLevel) : 0;
+				dst[bin * 4 + 0] = level;
+				dst[bin * 4 + 1] = level;
+				dst[bin * 4 + 2] = level;
+				dst[bin * 4 + 3] = 255;
+			}
+		}
+		if (!gradientHistogramTexture_) {
+			glGenTextures(1, &gradientHistogramTexture_);
+			glBindTexture(GL_TEXTURE_2D, gradientHistogramTexture_);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, GradientValueBins, GradientMagnitudeBins, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+		glBindTexture(GL_TEXTURE_2D, gradientHistogramTexture_);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GradientValueBins, GradientMagnitudeBins, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+	}
+	if (finished) {
+		gradientHistogram_.reset();
+	}
+}
+
+// Render thread. Brick files are never uploaded whole; the cache pages in
+// the bricks each view needs, up to the GPU budget.
+void BeginBrickedVolume(std::shared_ptr<BrickFile> file, const VolumeRegion& region, const TextureFormat& format)
+{
+	ReleaseVolume();
+	auto& desc = file->Desc();
+	brickCache_ = std::make_unique<BrickCache>(file, region, format, loaderPool_, (size_t)imguiSettings_.gpuCacheMB * 1024 * 1024);
+	volumeDesc_ = desc.volume;
+	volumeDesc_.dims = region.dims;
+	textureValueScale_ = format.valueScale;
+	CalculateHistogramData(desc.stats);
+	volumeValueRange_ = desc.stats.valueRange;
+	imguiSettings_.window = desc.stats.valueRange;
+	SetAutoWindow(desc.stats);
+	ApplyAutoWindow();
+	UpdateModelForVolume(volumeDesc_);
+}
+
+// Render thread. Time series get their own pair of textures, which the
+// player swaps between as it steps through the timesteps.
+void BeginTimeSeries(std::shared_ptr<MappedFile> file, const VolumeDesc& desc, const VolumeRegion& region, const TextureFormat& format, const VolumeStats& stats)
+{
+	ReleaseVolume();
+	timeSeries_ = std::make_unique<TimeSeriesPlayer>(file, desc, region, format, loaderPool_, imguiSettings_.prefetchTimesteps);
+	volumeDesc_ = desc;
+	volumeDesc_.dims = region.dims;
+	textureValueScale_ = format.valueScale;
+	CalculateHistogramData(stats);
+	volumeValueRange_ = stats.valueRange;
+	imguiSettings_.window = stats.valueRange;
+	SetAutoWindow(stats);
+	ApplyAutoWindow();
+	UpdateModelForVolume(volumeDesc_);
+}
+
+// Render thread. The live texture belongs to liveIngest_, which fills it as
+// slices arrive; any load still in flight is dropped.
+void BeginLiveVolume()
+{
+	ReleaseVolume();
+	++loadGeneration_;
+	showingLive_ = true;
+	volumeDesc_ = liveIngest_->Desc();
+	textureValueScale_ = liveIngest_->Format().valueScale;
+	volumeValueRange_ = VoxelTypeRange(volumeDesc_.voxelType);
+	imguiSettings_.window = volumeValueRange_;
+	UpdateModelForVolume(volumeDesc_);
+}
+
+// Render thread, once per frame.
+size_t UpdateLiveVolume(size_t byteBudget)
+{
+	auto uploaded = liveIngest_->Update(byteBudget);
+	if (liveIngest_->Stream() != liveStream_) {
+		liveStream_ = liveIngest_->Stream();
+		BeginLiveVolume();
+	}
+	VolumeStats stats;
+	if (showingLive_ && liveIngest_->TakeStats(stats)) {
+		CalculateHistogramData(stats);
+		FollowAutoWindow(stats);
+	}
+	return uploaded;
+}
+
+// Runs on a loader thread. Nothing but the first timestep is read up front,
+// for the histogram, which then stands for the whole series; the player
+// streams the rest as it plays.
+void LoadTimeSeries(const std::experimental::filesystem::path& path, int generation, std::shared_ptr<MappedFile> file,
+	const VolumeDesc& desc, const TextureFormat& format, const CropBox& crop)
+{
+	auto region = crop.Resolve(desc.dims);
+	auto loadedDesc = desc;
+	loadedDesc.dims = region.dims;
+	std::vector<uint8_t> firstTimestep(loadedDesc.PayloadSize());
+	CopyRegionSlices(file->Data() + desc.dataOffset, desc, region, 0, region.dims.z, firstTimestep.data());
+	VolumeStats stats;
+	if (!CalculateVolumeStats(firstTimestep.data(), loadedDesc, stats, 0, [generation] { return !IsLoadCurrent(generation); })) {
+		return;
+	}
+
+	Log("Opened %s (%dx%dx%d %s, %d timesteps)\n", path.string().c_str(),
+		region.dims.x, region.dims.y, region.dims.z, VoxelTypeName(desc.voxelType), desc.timesteps);
+	mainThreadQueue_.Post([generation, file, desc, region, format, stats] {
+		if (IsLoadCurrent(generation)) {
+			BeginTimeSeries(file, desc, region, format, stats);
+		}
+	});
+}
+
+// Runs on a loader thread. Brick files carry their own stats, so opening one
+// only reads the header and table; bricks are read as the view asks for them.
+// A crop only narrows which bricks the view can ask for.
+void LoadBrickFile(const std::experimental::filesystem::path& path, int generation, bool halfFloatTextures, const CropBox& crop)
+{
+	auto file = std::make_shared<BrickFile>();
+	std::string error;
+	if (!file->Open(path, error)) {
+		Log("Failed to open brick file: %s\n", error.c_str());
+		return;
+	}
+	auto& desc = file->Desc().volume;
+	TextureFormat format;
+	if (!GetTextureFormat(desc.voxelType, desc.channels, halfFloatTextures, format)) {
+		Log("Unsupported voxel type %s in %s\n", VoxelTypeName(desc.voxelType), path.string().c_str());
+		return;
+	}
+
+	Log("Opened %s (%dx%dx%d %s, %u bricks of %d^3 in %d levels)\n", path.string().c_str(),
+		desc.dims.x, desc.dims.y, desc.dims.z, VoxelTypeName(desc.voxelType), file->BrickCount(), file->Desc().brickSize, file->Desc().levelCount);
+	auto region = crop.Resolve(desc.dims);
+	mainThreadQueue_.Post([generation, file, region, format] {
+		if (IsLoadCurrent(generation)) {
+			BeginBrickedVolume(file, region, format);
+		}
+	});
+}
+
+// The part of a level of the pyramid that covers region of its finest level.
+VolumeRegion ScaleRegionToLevel(const VolumeRegion& region, glm::ivec3 finestDims, glm::ivec3 levelDims)
+{
+	auto scale = glm::vec3(levelDims) / glm::vec3(finestDims);
+	VolumeRegion scaled;
+	scaled.origin = glm::ivec3(glm::floor(glm::vec3(region.origin) * scale));
+	auto end = glm::min(glm::ivec3(glm::ceil(glm::vec3(region.origin + region.dims) * scale)), levelDims);
+	scaled.dims = glm::max(end - scaled.origin, glm::ivec3(1));
+	return scaled;
+}
+
+// Runs on a loader thread. The finest level of the pyramid that fits in a
+// preview is read here, straight away, and stands in for the volume and its
+// histogram while a ZarrLoad reads the full resolution chunks in parallel.
+void LoadZarr(const std::experimental::filesystem::path& path, int generation, bool halfFloatTextures, const CropBox& crop)
+{
+	auto startTime = SDL_GetPerformanceCounter();
+
+	ZarrPyramid pyramid;
+	std::string error;
+	if (!OpenZarrPyramid(path, pyramid, error)) {
+		Log("Failed to open Zarr dataset: %s\n", error.c_str());
+		return;
+	}
+	auto& finest = pyramid.levels.front();
+	auto& desc = finest.desc;
+	TextureFormat format;
+	if (!GetTextureFormat(desc.voxelType, desc.channels, halfFloatTextures, format)) {
+		Log("Unsupported voxel type %s in %s\n", VoxelTypeName(desc.voxelType), path.string().c_str());
+		return;
+	}
+	if (finest.hiddenVolumes > 1) {
+		Log("Showing the first of %d timesteps and channels\n", finest.hiddenVolumes);
+	}
+	auto region = crop.Resolve(desc.dims);
+	auto loadedDesc = desc;
+	loadedDesc.dims = region.dims;
+	Log("Opened %s (%dx%dx%d %s, %zu levels, %dx%dx%d chunks)\n", path.string().c_str(),
+		region.dims.x, region.dims.y, region.dims.z, VoxelTypeName(desc.voxelType), pyramid.levels.size(),
+		finest.chunkDims.x, finest.chunkDims.y, finest.chunkDims.z);
+
+	std::shared_ptr<VolumePreview> preview;
+	VolumeStats previewStats;
+	if (loadedDesc.PayloadSize() > DefaultPreviewBytes) {
+		for (size_t i = 1; i < pyramid.levels.size(); ++i) {
+			auto& level = pyramid.levels[i];
+			auto levelRegion = ScaleRegionToLevel(region, desc.dims, level.desc.dims);
+			auto previewDesc = level.desc;
+			previewDesc.dims = levelRegion.dims;
+			auto last = i == pyramid.levels.size() - 1;
+			if (level.desc.voxelType != desc.voxelType || (previewDesc.PayloadSize() > DefaultPreviewBytes && !last)) {
+				continue;
+			}
+			preview = std::make_shared<VolumePreview>();
+			preview->dims = levelRegion.dims;
+			preview->stride = glm::max(1, desc.dims.x / level.desc.dims.x);
+			preview->voxels.resize(previewDesc.PayloadSize());
+			if (!ReadZarrRegion(level, levelRegion, preview->voxels.data(), error)) {
+				Log("Failed to read preview level: %s\n", error.c_str());
+				preview.reset();
+				break;
+			}
+			CalculateVolumeStats(preview->voxels.data(), previewDesc, previewStats);
+			auto previewSeconds = (double)(SDL_GetPerformanceCounter() - startTime) / SDL_GetPerformanceFrequency();
+			Log("Preview of %s from level %zu: %dx%dx%d in %.3f s\n", path.string().c_str(), i,
+				preview->dims.x, preview->dims.y, preview->dims.z, previewSeconds);
+			break;
+		}
+	}
+
+	auto swapBytes = desc.bigEndian && VoxelSize(desc.voxelType) > 1;
+	mainThreadQueue_.Post([generation, finest, region, loadedDesc, format, preview, previewStats, swapBytes] {
+		if (!IsLoadCurrent(generation)) {
+			return;
+		}
+		auto load = std::make_shared<ZarrLoad>(finest, region, preview ? previewStats.valueRange : glm::vec2(0.0f), loaderPool_);
+		BeginVolume(loadedDesc, format, [load](int firstSlice, int sliceCount, uint8_t* dst) {
+			load->CopySlices(firstSlice, sliceCount, dst);
+		});
+		zarrLoad_ = load;
+		if (preview) {
+			previewTexture_ = CreatePreviewTexture(*preview, format, swapBytes);
+			CalculateHistogramData(previewStats);
+			volumeValueRange_ = previewStats.valueRange;
+			imguiSettings_.window = previewStats.valueRange;
+		}
+	});
+}
+
+// Runs on a loader thread. GL work is posted back to the render thread, which
+// allocates the texture straight away and fills it as slabs get paged in.
+void LoadTexture(const std::experimental::filesystem::path& path, int generation, bool halfFloatTextures, const CropBox& crop)
+{
+	if (path.extension() == ".bricks") {
+		LoadBrickFile(path, generation, halfFloatTextures, crop);
+		return;
+	}
+	if (IsZarrPath(path)) {
+		LoadZarr(path, generation, halfFloatTextures, crop);
+		return;
+	}
+
+	auto startTime = SDL_GetPerformanceCounter();
+
+	VolumeDesc desc;
+	std::string error;
+	if (!ReadVolumeHeader(path, desc, error)) {
+		Log("Failed to read volume header: %s\n", error.c_str());
+		return;
+	}
+	TextureFormat format;
+	if (!GetTextureFormat(desc.voxelType, desc.channels, halfFloatTextures, format)) {
+		Log("Unsupported voxel type %s in %s\n", VoxelTypeName(desc.voxelType), path.string().c_str());
+		return;
+	}
+
+	// The file is mapped rather than read, so the histogram pass and the
+	// texture upload both read straight out of the page cache. Mapping is lazy,
+	// nothing past the header has been touched yet.
+	auto file = std::make_shared<MappedFile>();
+	if (!file->Open(desc.dataFile)) {
+		Log("Failed to open volume data %s\n", desc.dataFile.string().c_str());
+		return;
+	}
+
+	auto size = desc.PayloadSize();
+	if (file->Size() < desc.dataOffset + desc.SeriesSize()) {
+		Log("Volume %s is %zu bytes, expected %zu\n", desc.dataFile.string().c_str(), file->Size(), (size_t)desc.dataOffset + desc.SeriesSize());
+		return;
+	}
+	if (desc.timesteps > 1) {
+		LoadTimeSeries(path, generation, file, desc, format, crop);
+		return;
+	}
+	auto data = file->Data() + desc.dataOffset;
+
+	// A cropped load only ever reads the rows inside the box, gathering them
+	// into a buffer of its own as the slabs go by. Everything past this point
+	// sees just the box.
+	auto region = crop.Resolve(desc.dims);
+	auto cropped = region.dims != desc.dims;
+	auto loadedDesc = desc;
+	loadedDesc.dims = region.dims;
+	auto sliceBytes = (size_t)region.dims.x * region.dims.y * desc.VoxelBytes();
+
+	// Stats only depend on the payload, so a dataset seen before gets its
+	// histogram from the derived data cache instead of a pass over every voxel.
+	// The cache holds stats of whole datasets; crops are small enough to redo.
+	auto cacheKey = cropped ? std::string() : DerivedDataKey(desc, data);
+	VolumeStats stats;
+	auto cachedStats = !cropped && FindCachedStats(cacheKey, stats);
+
+	// Slabs go through the sweep on their way into the staging buffers, on the
+	// loader pool, which reads them once for everything derived from them and
+	// the copy. 8 and 16 bit data gets its histogram there too.
+	auto sweep = std::make_shared<IngestSweep>(loadedDesc);
+	auto sweepStats = sweep->HasHistogram() && !cachedStats;
+	std::shared_ptr<std::vector<uint8_t>> croppedVoxels;
+	VolumeUploader::SlabSource source;
+	if (cropped) {
+		croppedVoxels = std::make_shared<std::vector<uint8_t>>(loadedDesc.PayloadSize());
+		source = [croppedVoxels, sweep, sliceBytes](int firstSlice, int sliceCount, uint8_t* dst) {
+			sweep->CopySlices(croppedVoxels->data() + firstSlice * sliceBytes, firstSlice, sliceCount, dst);
+		};
+		Log("Cropping %s to %dx%dx%d at %d,%d,%d\n", path.string().c_str(),
+			region.dims.x, region.dims.y, region.dims.z, region.origin.x, region.origin.y, region.origin.z);
+	} else {
+		// The mapping is kept alive by the source until the last slab is copied
+		// into a staging buffer.
+		source = [file, data, sweep, sliceBytes](int firstSlice, int sliceCount, uint8_t* dst) {
+			sweep->CopySlices(data + firstSlice * sliceBytes, firstSlice, sliceCount, dst);
+		};
+	}
+	// Aliases the mapping or the cropped copy, whichever holds the voxels.
+	auto payload = cropped ? std::shared_ptr<const uint8_t>(croppedVoxels, croppedVoxels->data()) : std::shared_ptr<const uint8_t>(file, data);
+	mainThreadQueue_.Post([generation, loadedDesc, format, source, sweep, sweepStats, cacheKey, payload] {
+		if (IsLoadCurrent(generation)) {
+			BeginVolume(loadedDesc, format, source, &loaderPool_);
+			ingestSweep_ = sweep;
+			ingestTakesStats_ = sweepStats;
+			ingestCacheKey_ = cacheKey;
+			gradientPayload_ = payload;
+		}
+	});
+
+	auto postStats = [generation](const VolumeStats& stats) {
+		mainThreadQueue_.Post([generation, stats] {
+			if (!IsLoadCurrent(generation)) {
+				return;
+			}
+			CalculateHistogramData(stats);
+			volumeValueRange_ = stats.valueRange;
+			imguiSettings_.window = stats.valueRange;
+			ApplyAutoWindow();
+			// Every slice has been read by now, or was cached.
+			StartGradientHistogram(stats.valueRange);
+		});
+	};
+	// A strided subset goes up first so there is a whole volume to look at
+	// straight away. Full resolution slabs replace it from the bottom up as the
+	// uploader gets to them.
+	auto previewStride = PreviewStride(desc, region, DefaultPreviewBytes);
+	if (previewStride > 1) {
+		auto preview = std::make_shared<VolumePreview>();
+		ExtractVolumePreview(data, desc, region, previewStride, *preview);
+		auto swapBytes = desc.bigEndian && VoxelSize(desc.voxelType) > 1;
+		mainThreadQueue_.Post([generation, preview, format, swapBytes] {
+			if (IsLoadCurrent(generation) && volumeUploader_.IsActive()) {
+				ReleasePreview();
+				previewTexture_ = CreatePreviewTexture(*preview, format, swapBytes);
+			}
+		});
+		auto previewSeconds = (double)(SDL_GetPerformanceCounter() - startTime) / SDL_GetPerformanceFrequency();
+		Log("Preview of %s at 1/%d: %dx%dx%d in %.3f s\n", path.string().c_str(), previewStride,
+			preview->dims.x, preview->dims.y, preview->dims.z, previewSeconds);
+	}
+
+	if (cachedStats) {
+		postStats(stats);
+	}
+
+	// Page the payload in a slab at a time and release each slab to the
+	// uploader once it is resident, so the volume builds up on screen.
+	auto slabSlices = (int)glm::clamp(((size_t)16 << 20) / sliceBytes, (size_t)1, (size_t)region.dims.z);
+	for (int firstSlice = 0; firstSlice < region.dims.z; firstSlice += slabSlices) {
+		if (!IsLoadCurrent(generation)) {
+			return;
+		}
+		auto sliceCount = glm::min(slabSlices, region.dims.z - firstSlice);
+		if (cropped) {
+			CopyRegionSlices(data, desc, region, firstSlice, sliceCount, croppedVoxels->data() + firstSlice * sliceBytes);
+		} else {
+			auto offset = desc.dataOffset + firstSlice * sliceBytes;
+			file->AdviseSequential(offset, 2 * slabSlices * sliceBytes);
+			file->Touch(offset, sliceCount * sliceBytes);
+		}
+		auto availableSlices = firstSlice + sliceCount;
+		mainThreadQueue_.Post([generation, availableSlices] {
+			if (IsLoadCurrent(generation)) {
+				volumeUploader_.SetAvailableSlices(availableSlices);
+			}
+		});
+	}
+
+	// 8 and 16 bit data has its stats taken from the sweep once the uploader
+	// is done. The full pass over the rest gives up as soon as another load
+	// starts.
+	auto superseded = [generation] { return !IsLoadCurrent(generation); };
+	if (!sweep->HasHistogram()) {
+		if (cropped) {
+			if (!CalculateVolumeStats(croppedVoxels->data(), loadedDesc, stats, 0, superseded)) {
+				return;
+			}
+			postStats(stats);
+		} else if (!cachedStats) {
+			if (!CalculateVolumeStats(data, desc, stats, 0, superseded)) {
+				return;
+			}
+			postStats(stats);
+			CacheStats(cacheKey, stats);
+		}
+	}
+
+	size = loadedDesc.PayloadSize();
+	auto seconds = (double)(SDL_GetPerformanceCounter() - startTime) / SDL_GetPerformanceFrequency();
+	Log("Loaded %s (%dx%dx%d %s): %.1f MB in %.3f s (%.1f MB/s)\n", path.string().c_str(),
+		region.dims.x, region.dims.y, region.dims.z, VoxelTypeName(desc.voxelType),
+		size / 1.0e6, seconds, size / 1.0e6 / seconds);
+}
+
+void LoadTextureAsync(const std::experimental::filesystem::path& path)
+{
+	auto generation = ++loadGeneration_;
+	auto halfFloatTextures = imguiSettings_.halfFloatTextures;
+	auto crop = imguiSettings_.crop;
+	loaderPool_.Submit([path, generation, halfFloatTextures, crop] {
+		LoadTexture(path, generation, halfFloatTextures, crop);
+	});
 }
 
 void PostResizeGlSetup() {
@@ -332,11 +1051,12 @@ void HandleWindowResize(int width, int height) {
 	PostResizeGlSetup();
 }
 
-void SetupGLState()
+void SetupGLState(const std::experimental::filesystem::path& volumePath)
 {
 	LoadShaders();
 	CreateVertexBuffers();
-	LoadTexture();
+	volumePath_ = volumePath;
+	LoadTextureAsync(volumePath);
 
 	glClearColor(
 		imguiSettings_.backgroundColor.r,
@@ -350,30 +1070,271 @@ void SetupGLState()
 
 using namespace std::experimental::filesystem;
 
-void LoadImageStack(path filepath) {
-	auto filename = filepath.filename();
-	auto filenameStr = filename.string();
-	auto sliceItr = filenameStr.find("slice");
-	auto filenameStart = filenameStr.substr(0, sliceItr + 5);
-	int sliceCount = 0;
-	while (true) {
-		auto toTest = filepath.parent_path() / path(filenameStart + std::to_string(sliceCount) + "_channel0.tiff");
-		if (exists(toTest)) {
-			sliceCount++;
-		} else {
-			break;
+// Deepest 3D texture there can be, so the most slices a watched stack can grow to.
+int MaxTextureDepth()
+{
+	GLint depth = 0;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &depth);
+	return depth;
+}
+
+// How often a watched stack's folder is listed once its FolderWatch has died.
+const uint32_t StackListingIntervalMs = 1000;
+
+// Slices a watched stack's texture has room for, some past those there are.
+int WatchedStackDepth(int slices)
+{
+	return glm::min(slices + glm::max(slices / 2, 16), MaxTextureDepth());
+}
+
+VolumeUploader::SlabSource WatchedStackSource(std::shared_ptr<ImageStackWatch> watch)
+{
+	return [watch](int firstSlice, int sliceCount, uint8_t* dst) {
+		watch->CopySlices(firstSlice, sliceCount, dst);
+	};
+}
+
+// Render thread. The texture is made deeper than the stack is so far, and
+// is replaced by a deeper one again whenever the stack outgrows it.
+void BeginWatchedImageStack(const path& filepath, const std::vector<SliceChannels>& slices, const VolumeDesc& desc, const TextureFormat& format)
+{
+	auto watch = std::make_shared<ImageStackWatch>(filepath, slices, desc, loaderPool_, MaxTextureDepth());
+	auto textureDesc = desc;
+	textureDesc.dims.z = WatchedStackDepth(desc.dims.z);
+	BeginVolume(textureDesc, format, WatchedStackSource(watch));
+	imageStackWatch_ = watch;
+	watchedSlices_ = 0;
+	folderWatch_ = std::make_unique<FolderWatch>(filepath.parent_path());
+	if (!GLEW_ARB_copy_image) {
+		Log("No ARB_copy_image, slices past %d will not be shown\n", textureDesc.dims.z);
+	}
+}
+
+// Render thread, once per frame. Feeds the watch the files that changed and
+// the uploader the slices that are ready.
+void UpdateImageStackWatch()
+{
+	if (!imageStackWatch_) {
+		return;
+	}
+	std::vector<path> changed;
+	auto now = SDL_GetTicks();
+	auto complete = folderWatch_->TakeChanges(changed);
+	// Notifications were lost, and one listing of the folder catches up, or
+	// the watch has died, and the folder is listed every so often instead.
+	if (!complete && (folderWatch_->IsWatching() || now - lastStackListing_ >= StackListingIntervalMs)) {
+		lastStackListing_ = now;
+		ImageStackIndex index;
+		std::string error;
+		if (IndexImageStack(volumePath_, index, error)) {
+			for (auto& channels : index.slices) {
+				changed.insert(changed.end(), channels.begin(), channels.end());
+			}
 		}
 	}
-	int32_t width = -1;
-	int32_t height = -1;
-	for (int sliceIdx = 0; sliceIdx < sliceCount; sliceIdx++) {
-		auto thisSliceChannelStart = (filepath.parent_path() / path(filenameStart + std::to_string(sliceIdx) + "_channel")).string();
-		auto redChannelPath = thisSliceChannelStart + "3.tiff";
-		auto greenChannelPath = thisSliceChannelStart + "2.tiff";
-		auto blueChannelPath = thisSliceChannelStart + "0.tiff";
+	for (auto& file : changed) {
+		imageStackWatch_->FileChanged(file);
+	}
+	imageStackWatch_->Pump();
+
+	auto sliceCount = imageStackWatch_->SliceCount();
+	if (sliceCount > volumeDesc_.dims.z && GLEW_ARB_copy_image) {
+		volumeDesc_.dims.z = WatchedStackDepth(sliceCount);
+		texture_ = volumeUploader_.Extend(volumeDesc_.dims.z, WatchedStackSource(imageStackWatch_));
+		UpdateModelForVolume(volumeDesc_);
+	}
+	auto availableSlices = imageStackWatch_->AvailableSlices();
+	volumeUploader_.SetAvailableSlices(availableSlices);
+	if (availableSlices != watchedSlices_) {
+		watchedSlices_ = availableSlices;
+		VolumeStats stats;
+		imageStackWatch_->GetStats(stats);
+		CalculateHistogramData(stats);
+		FollowAutoWindow(stats);
+	}
+}
+
+// Runs on a loader thread. Finds the channel files of every slice, then hands
+// them to an ImageStackLoad on the render thread which decodes them in parallel.
+// Slices outside the crop box are never opened. A watched stack is followed
+// as it grows instead, and always whole.
+void LoadImageStack(path filepath, int generation, const CropBox& crop, bool watch) {
+	std::vector<SliceChannels> slices;
+	VolumeDesc desc;
+	std::string error;
+	if (!DescribeImageStack(filepath, slices, desc, error)) {
+		Log("%s\n", error.c_str());
+		return;
+	}
+	TextureFormat format;
+	GetTextureFormat(desc.voxelType, desc.channels, false, format);
+	auto region = crop.Resolve(desc.dims);
+	auto loadedDesc = desc;
+	loadedDesc.dims = region.dims;
+	if (watch) {
+		Log("Watching %d slice %dx%d image stack\n", desc.dims.z, desc.dims.x, desc.dims.y);
+		mainThreadQueue_.Post([generation, filepath, slices, desc, format] {
+			if (IsLoadCurrent(generation)) {
+				BeginWatchedImageStack(filepath, slices, desc, format);
+			}
+		});
+		return;
+	}
+	Log("Loading %d slice %dx%d image stack\n", region.dims.z, region.dims.x, region.dims.y);
+
+	mainThreadQueue_.Post([generation, slices, desc, region, loadedDesc, format] {
+		if (!IsLoadCurrent(generation)) {
+			return;
+		}
+		auto load = std::make_shared<ImageStackLoad>(slices, desc, region, loaderPool_);
+		BeginVolume(loadedDesc, format, [load](int firstSlice, int sliceCount, uint8_t* dst) {
+			load->CopySlices(firstSlice, sliceCount, dst);
+		});
+		imageStackLoad_ = load;
+	});
+}
+
+void LoadImageStackAsync(const path& filepath)
+{
+	auto generation = ++loadGeneration_;
+	auto crop = imguiSettings_.crop;
+	auto watch = imguiSettings_.watchImageStacks;
+	loaderPool_.Submit([filepath, generation, crop, watch] {
+		LoadImageStack(filepath, generation, crop, watch);
+	});
+}
+
+// Picks the loader from the extension.
+void OpenVolumeAsync(const path& filepath)
+{
+	volumePath_ = filepath;
+	auto extension = filepath.extension().string();
+	if (extension == ".tiff" || extension == ".tif") {
+		LoadImageStackAsync(filepath);
+	} else {
+		LoadTextureAsync(filepath);
+	}
+}
+
+// Render thread. Brick ranges let the textured shader discard samples in
+// bricks with nothing bright enough to pass the alpha threshold, without
+// reading the volume. Ranges are widened by a brick first, as filtering
+// blends in voxels across brick edges.
+void CreateBrickRangeTexture(const IngestSweep& sweep)
+{
+	auto grid = sweep.BrickGrid();
+	auto ranges = DilateBrickRanges(sweep.BrickRanges(), grid);
+	for (auto& range : ranges) {
+		range *= textureValueScale_;
+	}
+	glGenTextures(1, &brickRangeTexture_);
+	glBindTexture(GL_TEXTURE_3D, brickRangeTexture_);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RG32F, grid.x, grid.y, grid.z, 0, GL_RG, GL_FLOAT, ranges.data());
+}
+
+// Loader thread. The cache key only samples the payload, but the sweep has
+// read all of it, so an entry made from other data under the same key is
+// caught here and dropped. 8 and 16 bit data then has the swept stats shown
+// and cached in place of the ones that came from it.
+void CheckDerivedData(const std::string& key, uint64_t checksum, std::shared_ptr<VolumeStats> swept, bool cacheSwept, int generation)
+{
+	uint64_t cachedChecksum;
+	if (FindCachedChecksum(key, cachedChecksum) && cachedChecksum != checksum) {
+		Log("Cached data for this volume was made from other data, dropping it\n");
+		DropDerivedData(key);
+		if (swept && !cacheSwept) {
+			cacheSwept = true;
+			mainThreadQueue_.Post([generation, swept] {
+				if (IsLoadCurrent(generation)) {
+					CalculateHistogramData(*swept);
+					volumeValueRange_ = swept->valueRange;
+					imguiSettings_.window = swept->valueRange;
+					ApplyAutoWindow();
+				}
+			});
+		}
+	}
+	if (cacheSwept) {
+		CacheStats(key, *swept);
+	}
+	CacheChecksum(key, checksum);
+}
+
+// Render thread, once per frame. Takes what the sweep gathered once the
+// uploader has copied every slice through it.
+void UpdateIngestSweep()
+{
+	if (!ingestSweep_ || !ingestSweep_->Finished()) {
+		return;
+	}
+	std::shared_ptr<VolumeStats> swept;
+	if (ingestSweep_->HasHistogram()) {
+		swept = std::make_shared<VolumeStats>();
+		ingestSweep_->GetStats(*swept);
+	}
+	if (ingestTakesStats_) {
+		CalculateHistogramData(*swept);
+		volumeValueRange_ = swept->valueRange;
+		imguiSettings_.window = swept->valueRange;
+		StartGradientHistogram(swept->valueRange);
+	}
+	if (!ingestCacheKey_.empty()) {
+		auto key = ingestCacheKey_;
+		auto checksum = ingestSweep_->Checksum();
+		auto cacheSwept = ingestTakesStats_;
+		int generation = loadGeneration_;
+		loaderPool_.Submit([key, checksum, swept, cacheSwept, generation] {
+			CheckDerivedData(key, checksum, swept, cacheSwept, generation);
+		});
+	}
+	CreateBrickRangeTexture(*ingestSweep_);
+	SetAutoWindow(ingestSweep_->Quantile(0.01), ingestSweep_->Quantile(0.5), ingestSweep_->Quantile(0.99));
+	ApplyAutoWindow();
+	ingestSweep_.reset();
+}
+
+// Render thread, once per frame. Feeds the uploader the Zarr chunks read so
+// far; the histogram of the preview level is swapped for the full one once
+// every chunk is in.
+void UpdateZarrLoad()
+{
+	if (!zarrLoad_) {
+		return;
+	}
+	zarrLoad_->Pump();
+	volumeUploader_.SetAvailableSlices(zarrLoad_->AvailableSlices());
+	if (zarrLoad_->Finished()) {
+		VolumeStats stats;
+		zarrLoad_->GetStats(stats);
+		CalculateHistogramData(stats);
+		volumeValueRange_ = stats.valueRange;
+		imguiSettings_.window = stats.valueRange;
+		SetAutoWindow(stats);
+		ApplyAutoWindow();
+		zarrLoad_.reset();
+	}
+}
+
+// Render thread, once per frame. Keeps the decoders fed and lets the uploader
+// know how far the contiguous run of decoded slices reaches.
+void UpdateImageStackLoad()
+{
+	if (!imageStackLoad_) {
+		return;
+	}
+	imageStackLoad_->Pump();
+	volumeUploader_.SetAvailableSlices(imageStackLoad_->AvailableSlices());
+	if (imageStackLoad_->Finished()) {
+		VolumeStats stats;
+		imageStackLoad_->GetStats(stats);
+		CalculateHistogramData(stats);
+		SetAutoWindow(stats);
+		ApplyAutoWindow();
+		imageStackLoad_.reset();
 	}
-	
-	auto ret = 0;
 }
 
 void RenderMenus()
@@ -394,8 +1355,7 @@ void RenderMenus()
 					nfdchar_t* outPath;
 					auto result = NFD_OpenDialog(nullptr, nullptr, &outPath);
 					if (result == NFD_OKAY) {
-						std::experimental::filesystem::path path(outPath);
-						LoadImageStack(path);
+						OpenVolumeAsync(outPath);
 					}
 				}
 				ImGui::EndMenu();
@@ -408,6 +1368,10 @@ void RenderMenus()
 			ImGui::EndMenuBar();
 		}
 
+		if (volumeUploader_.IsActive()) {
+			ImGui::ProgressBar(volumeUploader_.Progress(), ImVec2(-1, 0), "Loading volume");
+		}
+
 		if (ImGui::CollapsingHeader("Camera Controls"))
 		{
 			ImGui::SliderFloat("Mouse sensitivity", &imguiSettings_.mouseSensitivity, 0.01f, 0.5f);
@@ -438,16 +1402,107 @@ void RenderMenus()
 		if (ImGui::CollapsingHeader("Data insights"))
 		{
 			ImGui::PlotHistogram("Distribution", histData_.data(), histData_.size(), 0, "Log scale", histDataRange_.x, histDataRange_.y, ImVec2(0, 80));
+			ImGui::Text("Value range: %g to %g", volumeValueRange_.x, volumeValueRange_.y);
+			auto windowSpeed = glm::max((volumeValueRange_.y - volumeValueRange_.x) / 500.0f, 1e-6f);
+			ImGui::DragFloatRange2("Window", &imguiSettings_.window.x, &imguiSettings_.window.y, windowSpeed, volumeValueRange_.x, volumeValueRange_.y, "%g");
+			if (hasAutoWindow_) {
+				if (ImGui::Button("Full range")) {
+					imguiSettings_.window = volumeValueRange_;
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("1st to 99th percentile")) {
+					imguiSettings_.window = autoWindow_;
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("Suggested alpha threshold")) {
+					imguiSettings_.alphaThreshold = suggestedAlphaThreshold_;
+				}
+			}
+			if (gradientHistogramTexture_) {
+				ImGui::Text("Gradient magnitude against value");
+				ImGui::Image((ImTextureID)(intptr_t)gradientHistogramTexture_, ImVec2((float)GradientValueBins, (float)GradientMagnitudeBins));
+			}
 		}
 
 		if (ImGui::CollapsingHeader("Debug"))
 		{
 			ImGui::SliderInt("Num slices", &imguiSettings_.cubeNumSlices, 1, 512);
 			ImGui::SliderFloat("Alpha threshold", &imguiSettings_.alphaThreshold, 0.0f, 1.0f);
+			ImGui::Checkbox("Skip empty bricks", &imguiSettings_.skipEmptyBricks);
 			ImGui::SliderFloat("Alpha scale", &imguiSettings_.alphaScale, 0.0f, 1.0f);
 			ImGui::Checkbox("Draw cube", &imguiSettings_.drawCube);
 			ImGui::Checkbox("Draw intersection points", &imguiSettings_.drawIntersectionPoints);
 			ImGui::Checkbox("Draw intersection geometry", &imguiSettings_.drawIntersectionGeometry);
+			ImGui::Checkbox("Half float textures (next load)", &imguiSettings_.halfFloatTextures);
+			ImGui::Checkbox("Watch image stacks for new slices (next load)", &imguiSettings_.watchImageStacks);
+			ImGui::SliderInt("Upload MB per frame", &imguiSettings_.uploadBudgetMB, 1, 512);
+			ImGui::Text("Uploaded: %.2f MB this frame", frameUploadBytes_ / (1024.0 * 1024.0));
+		}
+
+		if (timeSeries_ && ImGui::CollapsingHeader("Playback", ImGuiTreeNodeFlags_DefaultOpen))
+		{
+			if (ImGui::Button(timeSeries_->IsPlaying() ? "Pause" : "Play")) {
+				timeSeries_->SetPlaying(!timeSeries_->IsPlaying());
+			}
+			ImGui::SameLine();
+			ImGui::Checkbox("Loop", &imguiSettings_.loopPlayback);
+			auto timestep = timeSeries_->TargetTimestep();
+			if (ImGui::SliderInt("Timestep", &timestep, 0, timeSeries_->Timesteps() - 1)) {
+				timeSeries_->Seek(timestep);
+			}
+			ImGui::SliderFloat("Timesteps per second", &imguiSettings_.playbackRate, 1.0f, 60.0f);
+			ImGui::SliderInt("Prefetch (next load)", &imguiSettings_.prefetchTimesteps, 2, 16);
+			ImGui::Text("Showing %d, %d staged ahead", timeSeries_->DisplayedTimestep(), timeSeries_->ReadyTimesteps());
+			ImGui::Text("Dropped: %d timesteps, %d late frames", timeSeries_->DroppedTimesteps(), timeSeries_->LateFrames());
+			ImGui::Text("Last upload: %d of %d bricks", timeSeries_->DirtyBricks(), timeSeries_->BrickCount());
+		}
+
+		if (imageStackWatch_ && ImGui::CollapsingHeader("Watch", ImGuiTreeNodeFlags_DefaultOpen))
+		{
+			ImGui::Text("Following %d slices, %d shown", imageStackWatch_->SliceCount(), watchedSlices_);
+			if (folderWatch_->IsWatching()) {
+				ImGui::Text("Watching the folder for new slices");
+			} else {
+				ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "Folder watch failed, listing the folder every %u ms", StackListingIntervalMs);
+			}
+		}
+
+		if (liveIngest_ && ImGui::CollapsingHeader("Live", ImGuiTreeNodeFlags_DefaultOpen))
+		{
+			ImGui::Text(liveIngest_->IsConnected() ? "Producer connected" : "Waiting for a producer");
+			if (liveIngest_->Stream()) {
+				ImGui::Text("Received %d of %d slices, %d from the bottom", liveIngest_->ReceivedSlices(),
+					liveIngest_->Desc().dims.z, liveIngest_->ContiguousSlices());
+			}
+			if (!showingLive_ && liveIngest_->Texture() && ImGui::Button("Show live volume")) {
+				BeginLiveVolume();
+			}
+		}
+
+		if (ImGui::CollapsingHeader("Crop"))
+		{
+			ImGui::DragInt3("Begin", &imguiSettings_.crop.begin.x, 1.0f, 0, INT_MAX);
+			ImGui::DragInt3("End (0 = far edge)", &imguiSettings_.crop.end.x);
+			if (ImGui::Button("Apply")) {
+				OpenVolumeAsync(volumePath_);
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Whole volume")) {
+				imguiSettings_.crop = CropBox();
+				OpenVolumeAsync(volumePath_);
+			}
+			ImGui::Text("Showing %dx%dx%d voxels", volumeDesc_.dims.x, volumeDesc_.dims.y, volumeDesc_.dims.z);
+		}
+
+		if (ImGui::CollapsingHeader("Brick cache"))
+		{
+			ImGui::SliderInt("Host MB", &imguiSettings_.hostCacheMB, 64, 65536);
+			ImGui::SliderInt("GPU MB (next load)", &imguiSettings_.gpuCacheMB, 64, 16384);
+			if (brickCache_) {
+				ImGui::Text("Wanted: %d bricks", brickCache_->WantedBricks());
+				ImGui::Text("GPU: %d of %d slots", brickCache_->GpuBricks(), brickCache_->SlotCount());
+				ImGui::Text("Host: %d bricks, %d loading", brickCache_->HostBricks(), brickCache_->LoadingBricks());
+			}
 		}
 
 		if (imguiSettings_.showAppAbout)
@@ -563,6 +1618,23 @@ void UpdateIntersections(glm::mat4 modelView) {
 void Render() {
 	ImGui_ImplSdlGL3_NewFrame(window_);
 
+	mainThreadQueue_.Drain();
+	UpdateImageStackLoad();
+	UpdateImageStackWatch();
+	UpdateZarrLoad();
+	UpdateIngestSweep();
+	UpdateGradientHistogram();
+	frameUploadBytes_ = volumeUploader_.Update((size_t)imguiSettings_.uploadBudgetMB * 1024 * 1024);
+	if (timeSeries_) {
+		frameUploadBytes_ += timeSeries_->Update(imguiSettings_.playbackRate, imguiSettings_.loopPlayback);
+	}
+	if (liveIngest_) {
+		frameUploadBytes_ += UpdateLiveVolume((size_t)imguiSettings_.uploadBudgetMB * 1024 * 1024);
+	}
+	if (previewTexture_ && !volumeUploader_.IsActive()) {
+		ReleasePreview();
+	}
+
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	auto viewPos = glm::vec3(0.0f, 0.0f, imguiSettings_.cameraDistance);
@@ -577,6 +1649,11 @@ void Render() {
 
 	auto mvp = projection_ * modelView;
 
+	if (brickCache_) {
+		auto megabyte = (size_t)1024 * 1024;
+		frameUploadBytes_ += brickCache_->Update(mvp, windowSize_, imguiSettings_.hostCacheMB * megabyte, imguiSettings_.uploadBudgetMB * megabyte);
+	}
+
 	if (imguiSettings_.drawCube) {
 		BindShader(debugColorShader_);
 		glBindBuffer(GL_ARRAY_BUFFER, cubeVertexBuffer_);
@@ -615,14 +1692,73 @@ void Render() {
 		glDisable(GL_BLEND);
 		glDrawArrays(GL_POINTS, 0, numIntersectionPoints_);
 	}
-	if (imguiSettings_.drawTexturedVolume) {
+	if (imguiSettings_.drawTexturedVolume && brickCache_) {
+		auto regionOrigin = glm::vec3(brickCache_->Region().origin);
+		auto regionDims = glm::vec3(brickCache_->Region().dims);
+		auto atlasSize = glm::vec3(brickCache_->AtlasSize());
+		BindShader(brickedVolumeShader_);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_3D, brickCache_->PageTable());
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_3D, brickCache_->Atlas());
+		glBindBuffer(GL_ARRAY_BUFFER, intersectionTriangleBuffer_);
+		glVertexAttribPointer(brickedVolumeShader_.positionLoc, 3, GL_FLOAT, false, sizeof(glm::vec3), 0);
+		glUniformMatrix4fv(brickedVolumeShader_.mvpLoc, 1, false, (GLfloat*)&mvp);
+		glUniform1i(brickedVolumeShader_.pageTableLoc, 1);
+		glUniform3fv(brickedVolumeShader_.regionOriginLoc, 1, (GLfloat*)&regionOrigin);
+		glUniform3fv(brickedVolumeShader_.regionDimsLoc, 1, (GLfloat*)&regionDims);
+		glUniform3fv(brickedVolumeShader_.atlasSizeLoc, 1, (GLfloat*)&atlasSize);
+		glUniform1f(brickedVolumeShader_.brickSizeLoc, (float)brickCache_->Desc().brickSize);
+		glUniform1f(brickedVolumeShader_.alphaThresholdLoc, imguiSettings_.alphaThreshold);
+		glUniform1f(brickedVolumeShader_.alphaScaleLoc, imguiSettings_.alphaScale);
+		glUniform1f(brickedVolumeShader_.windowMinLoc, imguiSettings_.window.x * textureValueScale_);
+		glUniform1f(brickedVolumeShader_.windowMaxLoc, imguiSettings_.window.y * textureValueScale_);
+		glUniform1i(brickedVolumeShader_.rgbaVolumeLoc, volumeDesc_.channels == 4);
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glDrawArrays(GL_TRIANGLES, 0, numIntersectionTriangles_);
+	} else if (imguiSettings_.drawTexturedVolume) {
 		BindShader(texturedVolumeShader_);
-		glBindTexture(GL_TEXTURE_3D, texture_);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_3D, previewTexture_);
+		glActiveTexture(GL_TEXTURE0);
+		auto volumeTexture = texture_;
+		if (timeSeries_) {
+			volumeTexture = timeSeries_->Texture();
+		} else if (showingLive_) {
+			volumeTexture = liveIngest_->Texture();
+		}
+		glBindTexture(GL_TEXTURE_3D, volumeTexture);
 		glBindBuffer(GL_ARRAY_BUFFER, intersectionTriangleBuffer_);
 		glVertexAttribPointer(texturedVolumeShader_.positionLoc, 3, GL_FLOAT, false, sizeof(glm::vec3), 0);
 		glUniformMatrix4fv(texturedVolumeShader_.mvpLoc, 1, false, (GLfloat*)&mvp);
 		glUniform1f(texturedVolumeShader_.alphaThresholdLoc, imguiSettings_.alphaThreshold);
 		glUniform1f(texturedVolumeShader_.alphaScaleLoc, imguiSettings_.alphaScale);
+		glUniform1f(texturedVolumeShader_.windowMinLoc, imguiSettings_.window.x * textureValueScale_);
+		glUniform1f(texturedVolumeShader_.windowMaxLoc, imguiSettings_.window.y * textureValueScale_);
+		glUniform1i(texturedVolumeShader_.rgbaVolumeLoc, volumeDesc_.channels == 4);
+		auto loadedDepth = volumeUploader_.IsActive() ? volumeUploader_.Progress() : 1.0f;
+		if (timeSeries_ && timeSeries_->DisplayedTimestep() < 0) {
+			loadedDepth = 0.0f;
+		}
+		if (showingLive_) {
+			loadedDepth = (float)liveIngest_->ContiguousSlices() / volumeDesc_.dims.z;
+		}
+		glUniform1f(texturedVolumeShader_.loadedDepthLoc, loadedDepth);
+		glUniform1i(texturedVolumeShader_.previewTexLoc, 1);
+		glUniform1i(texturedVolumeShader_.hasPreviewLoc, previewTexture_ != 0);
+		// Only ever made for texture_, once it is complete.
+		auto skipBricks = imguiSettings_.skipEmptyBricks && brickRangeTexture_ && volumeTexture == texture_;
+		if (skipBricks) {
+			auto brickScale = glm::vec3(volumeDesc_.dims) / (float)IngestBrickSize;
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_3D, brickRangeTexture_);
+			glActiveTexture(GL_TEXTURE0);
+			glUniform1i(texturedVolumeShader_.brickRangesLoc, 2);
+			glUniform3fv(texturedVolumeShader_.brickScaleLoc, 1, (GLfloat*)&brickScale);
+		}
+		glUniform1i(texturedVolumeShader_.hasBrickRangesLoc, skipBricks);
 		glDisable(GL_DEPTH_TEST);
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -657,6 +1793,11 @@ void MessagePump() {
 		switch (event.type)
 		{
 		case SDL_QUIT:
+			// The brick cache, time series and uploader wait for tasks they
+			// queued on loaderPool_ when torn down, and the pool drops its
+			// queue when it goes, so they have to go first.
+			ReleaseVolume();
+			liveIngest_.reset();
 			exit(0);
 			break;
 
@@ -706,9 +1847,55 @@ void MessagePump() {
 
 int main(int argc, char** argv)
 {
+	// Volume to open on startup, any format ReadVolumeHeader understands,
+	// optionally followed by --crop x0,y0,z0,x1,y1,z1 to load just that box.
+	// --watch follows image stacks as new slices are written next to them.
+	// --live also listens for live volumes on --pipe, or the default pipe.
+	// --send-live streams the volume into a viewer listening on that pipe
+	// instead of showing it, --rate slices per second.
+	std::string volumePath = "head256x256x109";
+	std::string pipeName = DefaultLivePipe;
+	auto live = false;
+	auto sendLive = false;
+	auto sliceRate = 0.0f;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--watch") {
+			imguiSettings_.watchImageStacks = true;
+		} else if (arg == "--live") {
+			live = true;
+		} else if (arg == "--send-live") {
+			sendLive = true;
+		} else if (arg == "--pipe" && i + 1 < argc) {
+			pipeName = argv[++i];
+		} else if (arg == "--rate" && i + 1 < argc) {
+			sliceRate = (float)atof(argv[++i]);
+		} else if (arg == "--crop" && i + 1 < argc) {
+			auto& crop = imguiSettings_.crop;
+			if (sscanf(argv[++i], "%d,%d,%d,%d,%d,%d", &crop.begin.x, &crop.begin.y, &crop.begin.z, &crop.end.x, &crop.end.y, &crop.end.z) != 6) {
+				Log("Ignoring --crop %s, expected x0,y0,z0,x1,y1,z1\n", argv[i]);
+				crop = CropBox();
+			}
+		} else {
+			volumePath = arg;
+		}
+	}
+
+	if (sendLive) {
+		std::string error;
+		if (!SendLiveVolume(pipeName, volumePath, sliceRate, error)) {
+			Log("Failed to send %s: %s\n", volumePath.c_str(), error.c_str());
+			return 1;
+		}
+		return 0;
+	}
+
 	SetupWindow();
 
-	SetupGLState();
+	SetupGLState(volumePath);
+	if (live) {
+		liveIngest_ = std::make_unique<LiveIngest>(pipeName);
+	}
 
 	while (true) {
 		MessagePump();
@@ -0,0 +1,629 @@
+#include "volumestats.h"
+
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+#include <limits>
+#include <thread>
+#include <type_traits>
+
+namespace {
+
+template<typename T>
+VoxelType TypeOf()
+{
+	if (std::is_same<T, uint8_t>::value) return VoxelType::UInt8;
+	if (std::is_same<T, int8_t>::value) return VoxelType::Int8;
+	if (std::is_same<T, uint16_t>::value) return VoxelType::UInt16;
+	return VoxelType::Int16;
+}
+
+// Quantile sketch buckets are the top 16 bits of a SketchKey.
+const int SketchKeyShift = 16;
+
+// Float bit patterns reordered so that comparing them as unsigned integers
+// orders the values: negatives have every bit flipped, positives the sign.
+uint32_t SketchKey(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+float SketchValue(uint32_t key)
+{
+	auto bits = key & 0x80000000u ? key & 0x7FFFFFFFu : ~key;
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Range and histogram from a count of each representable value, the lowest
+// of them first.
+void FoldValueCounts(const std::vector<uint64_t>& counts, int64_t lowest, VolumeStats& stats)
+{
+	auto valueCount = counts.size();
+	stats.histogram.assign(HistogramBins, 0);
+	size_t first = 0;
+	while (first < valueCount && !counts[first]) {
+		++first;
+	}
+	if (first == valueCount) {
+		stats.valueRange = glm::vec2(0.0f);
+		return;
+	}
+	size_t last = valueCount - 1;
+	while (!counts[last]) {
+		--last;
+	}
+	stats.valueRange = glm::vec2((float)((int64_t)first + lowest), (float)((int64_t)last + lowest));
+
+	auto span = last - first + 1;
+	for (size_t value = first; value <= last; ++value) {
+		stats.histogram[(value - first) * HistogramBins / span] += counts[value];
+	}
+}
+
+// Below this much data per thread, starting the thread costs more than it saves.
+const size_t MinBytesPerThread = 4 * 1024 * 1024;
+// Data each thread gets through between polls of the cancel check.
+const size_t CancelCheckBytes = 16 * 1024 * 1024;
+// Samples counted into the 32 bit sub-histograms between flushes into the
+// 64 bit totals, low enough that a bin cannot wrap in between.
+const size_t FlushSamples = (size_t)1 << 31;
+
+// Splits [0, count) into one range per thread and runs task(range, first,
+// samples) on each, the calling thread taking the first. Ranges start on a
+// multiple of 64 samples so the vector loops mostly see whole vectors.
+template<typename Task>
+void ParallelRanges(size_t count, size_t sampleBytes, unsigned threadCount, size_t& rangeCount, Task task)
+{
+	rangeCount = glm::clamp(count * sampleBytes / MinBytesPerThread, (size_t)1, (size_t)threadCount);
+	auto rangeSize = glm::max((size_t)64, ((count + rangeCount - 1) / rangeCount + 63) & ~(size_t)63);
+	rangeCount = glm::max((size_t)1, (count + rangeSize - 1) / rangeSize);
+
+	std::vector<std::thread> threads;
+	for (size_t range = 1; range < rangeCount; ++range) {
+		auto first = range * rangeSize;
+		threads.emplace_back(task, range, first, glm::min(rangeSize, count - first));
+	}
+	task(0, 0, glm::min(rangeSize, count));
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+// Runs block(first, samples) over [first, first + samples) a few MB at a
+// time, stopping early once cancelled returns true. Blocks after the first
+// start on a multiple of 64 samples, as ranges do.
+template<typename Block>
+void ForEachBlock(size_t first, size_t samples, size_t sampleBytes, const std::function<bool()>& cancelled, Block block)
+{
+	auto blockSize = cancelled ? glm::max((size_t)64, CancelCheckBytes / sampleBytes & ~(size_t)63) : samples;
+	for (size_t done = 0; done < samples; done += blockSize) {
+		if (cancelled && cancelled()) {
+			return;
+		}
+		block(first + done, glm::min(blockSize, samples - done));
+	}
+}
+
+// Eight bytes of samples in native order with their sign bits flipped, which
+// makes each one its distance from the lowest representable value. Done on
+// the whole word at once, which beats SSE2 here as the samples have to come
+// out into scalar registers to be counted anyway.
+template<typename T, bool Swap>
+uint64_t LoadValueIndices(const uint8_t* data)
+{
+	uint64_t word;
+	memcpy(&word, data, sizeof(word));
+	if (Swap) {
+		word = (word & 0x00FF00FF00FF00FFull) << 8 | (word >> 8 & 0x00FF00FF00FF00FFull);
+	}
+	if (std::is_signed<T>::value) {
+		word ^= sizeof(T) == 1 ? 0x8080808080808080ull : 0x8000800080008000ull;
+	}
+	return word;
+}
+
+template<typename T, bool Swap>
+void SmallIntegerStats(const uint8_t* data, size_t count, unsigned threadCount, const std::function<bool()>& cancelled, VolumeStats& stats)
+{
+	std::vector<std::vector<uint64_t>> rangeCounts(threadCount);
+	size_t rangeCount;
+	ParallelRanges(count, sizeof(T), (unsigned)rangeCounts.size(), rangeCount, [data, &cancelled, &rangeCounts](size_t range, size_t first, size_t samples) {
+		ValueCounter counter(TypeOf<T>(), Swap);
+		ForEachBlock(first, samples, sizeof(T), cancelled, [data, &counter](size_t blockFirst, size_t blockSamples) {
+			counter.Add(data + blockFirst * sizeof(T), blockSamples);
+		});
+		counter.AddTo(rangeCounts[range]);
+	});
+	if (cancelled && cancelled()) {
+		return;
+	}
+
+	auto& counts = rangeCounts[0];
+	for (size_t range = 1; range < rangeCount; ++range) {
+		for (size_t value = 0; value < counts.size(); ++value) {
+			counts[value] += rangeCounts[range][value];
+		}
+	}
+	FoldValueCounts(counts, std::numeric_limits<T>::lowest(), stats);
+}
+
+struct ValueRange
+{
+	double minValue = std::numeric_limits<double>::max();
+	double maxValue = std::numeric_limits<double>::lowest();
+};
+
+template<typename T, bool Swap>
+void FindRange(const uint8_t* data, size_t first, size_t count, ValueRange& range)
+{
+	auto samples = data + first * sizeof(T);
+	size_t i = 0;
+	if (std::is_same<T, float>::value && !Swap) {
+		// v - v is 0 for finite values and NaN for the rest, which drops them.
+		auto minValues = _mm_set1_ps(std::numeric_limits<float>::max());
+		auto maxValues = _mm_set1_ps(std::numeric_limits<float>::lowest());
+		for (; i + 4 <= count; i += 4) {
+			auto values = _mm_loadu_ps((const float*)samples + i);
+			auto finite = _mm_cmpeq_ps(_mm_sub_ps(values, values), _mm_setzero_ps());
+			minValues = _mm_min_ps(minValues, _mm_or_ps(_mm_and_ps(finite, values), _mm_andnot_ps(finite, minValues)));
+			maxValues = _mm_max_ps(maxValues, _mm_or_ps(_mm_and_ps(finite, values), _mm_andnot_ps(finite, maxValues)));
+		}
+		alignas(16) float lanes[2][4];
+		_mm_store_ps(lanes[0], minValues);
+		_mm_store_ps(lanes[1], maxValues);
+		for (int lane = 0; lane < 4; ++lane) {
+			range.minValue = glm::min(range.minValue, (double)lanes[0][lane]);
+			range.maxValue = glm::max(range.maxValue, (double)lanes[1][lane]);
+		}
+	}
+	for (; i < count; ++i) {
+		auto value = (double)LoadVoxel<T, Swap>(samples + i * sizeof(T));
+		if (std::isfinite(value)) {
+			range.minValue = glm::min(range.minValue, value);
+			range.maxValue = glm::max(range.maxValue, value);
+		}
+	}
+}
+
+template<typename T, bool Swap>
+void BinValues(const uint8_t* data, size_t first, size_t count, double minValue, double scale, std::vector<uint64_t>& histogram)
+{
+	uint64_t subBins[4][HistogramBins] = {};
+	auto samples = data + first * sizeof(T);
+	size_t i = 0;
+	if (std::is_same<T, float>::value && !Swap) {
+		// Same double precision arithmetic as the scalar loop, two lanes at a time.
+		auto offset = _mm_set1_pd(minValue);
+		auto scales = _mm_set1_pd(scale);
+		auto lastBin = _mm_set1_pd(HistogramBins - 1);
+		alignas(16) int32_t bins[4];
+		for (; i + 4 <= count; i += 4) {
+			auto values = _mm_loadu_ps((const float*)samples + i);
+			auto finite = _mm_movemask_ps(_mm_cmpeq_ps(_mm_sub_ps(values, values), _mm_setzero_ps()));
+			auto low = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(values), offset), scales), lastBin);
+			auto high = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(values, values)), offset), scales), lastBin);
+			_mm_store_si128((__m128i*)bins, _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high)));
+			if (finite == 0xF) {
+				subBins[0][bins[0]]++;
+				subBins[1][bins[1]]++;
+				subBins[2][bins[2]]++;
+				subBins[3][bins[3]]++;
+			} else {
+				for (int lane = 0; lane < 4; ++lane) {
+					if (finite & (1 << lane)) {
+						subBins[lane][bins[lane]]++;
+					}
+				}
+			}
+		}
+	}
+	for (; i < count; ++i) {
+		auto value = (double)LoadVoxel<T, Swap>(samples + i * sizeof(T));
+		if (std::isfinite(value)) {
+			auto bin = glm::min((int)((value - minValue) * scale), HistogramBins - 1);
+			subBins[i & 3][bin]++;
+		}
+	}
+
+	histogram.resize(HistogramBins, 0);
+	for (int bin = 0; bin < HistogramBins; ++bin) {
+		histogram[bin] += subBins[0][bin] + subBins[1][bin] + subBins[2][bin] + subBins[3][bin];
+	}
+}
+
+// Everything else: one parallel pass for the range, one to bin against it.
+template<typename T, bool Swap>
+void RangedStats(const uint8_t* data, size_t count, unsigned threadCount, const std::function<bool()>& cancelled, VolumeStats& stats)
+{
+	std::vector<ValueRange> ranges(threadCount);
+	size_t rangeCount;
+	ParallelRanges(count, sizeof(T), (unsigned)ranges.size(), rangeCount, [data, &cancelled, &ranges](size_t range, size_t first, size_t samples) {
+		ForEachBlock(first, samples, sizeof(T), cancelled, [data, &ranges, range](size_t blockFirst, size_t blockSamples) {
+			FindRange<T, Swap>(data, blockFirst, blockSamples, ranges[range]);
+		});
+	});
+	if (cancelled && cancelled()) {
+		return;
+	}
+	ValueRange total;
+	for (size_t range = 0; range < rangeCount; ++range) {
+		total.minValue = glm::min(total.minValue, ranges[range].minValue);
+		total.maxValue = glm::max(total.maxValue, ranges[range].maxValue);
+	}
+
+	stats.histogram.assign(HistogramBins, 0);
+	if (total.minValue > total.maxValue) {
+		stats.valueRange = glm::vec2(0.0f);
+		return;
+	}
+	stats.valueRange = glm::vec2((float)total.minValue, (float)total.maxValue);
+
+	auto minValue = total.minValue;
+	auto scale = total.maxValue > minValue ? HistogramBins / (total.maxValue - minValue) : 0.0;
+	std::vector<std::vector<uint64_t>> histograms(ranges.size());
+	ParallelRanges(count, sizeof(T), (unsigned)ranges.size(), rangeCount, [data, minValue, scale, &cancelled, &histograms](size_t range, size_t first, size_t samples) {
+		ForEachBlock(first, samples, sizeof(T), cancelled, [data, minValue, scale, &histograms, range](size_t blockFirst, size_t blockSamples) {
+			BinValues<T, Swap>(data, blockFirst, blockSamples, minValue, scale, histograms[range]);
+		});
+	});
+	if (cancelled && cancelled()) {
+		return;
+	}
+	for (size_t range = 0; range < rangeCount; ++range) {
+		for (int bin = 0; bin < HistogramBins; ++bin) {
+			stats.histogram[bin] += histograms[range][bin];
+		}
+	}
+}
+
+template<typename T>
+void StatsForType(const uint8_t* data, size_t count, bool swapBytes, unsigned threadCount, const std::function<bool()>& cancelled, VolumeStats& stats)
+{
+	if constexpr (std::is_integral<T>::value && sizeof(T) <= 2) {
+		swapBytes ? SmallIntegerStats<T, true>(data, count, threadCount, cancelled, stats) : SmallIntegerStats<T, false>(data, count, threadCount, cancelled, stats);
+	} else {
+		swapBytes ? RangedStats<T, true>(data, count, threadCount, cancelled, stats) : RangedStats<T, false>(data, count, threadCount, cancelled, stats);
+	}
+}
+
+}
+
+bool CalculateVolumeStats(const uint8_t* data, const VolumeDesc& desc, VolumeStats& stats, unsigned threadCount, const std::function<bool()>& cancelled)
+{
+	auto count = desc.VoxelCount();
+	auto swapBytes = desc.bigEndian && VoxelSize(desc.voxelType) > 1;
+	if (threadCount == 0) {
+		threadCount = glm::max(1u, std::thread::hardware_concurrency());
+	}
+	switch (desc.voxelType) {
+	case VoxelType::UInt8: StatsForType<uint8_t>(data, count, false, threadCount, cancelled, stats); break;
+	case VoxelType::Int8: StatsForType<int8_t>(data, count, false, threadCount, cancelled, stats); break;
+	case VoxelType::UInt16: StatsForType<uint16_t>(data, count, swapBytes, threadCount, cancelled, stats); break;
+	case VoxelType::Int16: StatsForType<int16_t>(data, count, swapBytes, threadCount, cancelled, stats); break;
+	case VoxelType::UInt32: StatsForType<uint32_t>(data, count, swapBytes, threadCount, cancelled, stats); break;
+	case VoxelType::Int32: StatsForType<int32_t>(data, count, swapBytes, threadCount, cancelled, stats); break;
+	case VoxelType::Float32: StatsForType<float>(data, count, swapBytes, threadCount, cancelled, stats); break;
+	case VoxelType::Float64: StatsForType<double>(data, count, swapBytes, threadCount, cancelled, stats); break;
+	}
+	return !cancelled || !cancelled();
+}
+
+ValueCounter::ValueCounter(VoxelType type, bool swapBytes)
+	: voxelType_(type)
+	, swapBytes_(swapBytes && VoxelSize(type) > 1)
+{
+	auto valueCount = (size_t)1 << (8 * VoxelSize(type));
+	subCounts_.assign(4 * valueCount, 0);
+	counts_.assign(valueCount, 0);
+}
+
+void ValueCounter::Add(const uint8_t* data, size_t samples)
+{
+	while (samples > 0) {
+		auto block = glm::min(samples, FlushSamples - pendingSamples_);
+		switch (voxelType_) {
+		case VoxelType::UInt8: CountSamples<uint8_t, false>(data, block); break;
+		case VoxelType::Int8: CountSamples<int8_t, false>(data, block); break;
+		case VoxelType::UInt16: swapBytes_ ? CountSamples<uint16_t, true>(data, block) : CountSamples<uint16_t, false>(data, block); break;
+		case VoxelType::Int16: swapBytes_ ? CountSamples<int16_t, true>(data, block) : CountSamples<int16_t, false>(data, block); break;
+		default: return;
+		}
+		data += block * VoxelSize(voxelType_);
+		samples -= block;
+		pendingSamples_ += block;
+		if (pendingSamples_ == FlushSamples) {
+			Flush();
+		}
+	}
+}
+
+void ValueCounter::AddTo(std::vector<uint64_t>& counts)
+{
+	Flush();
+	counts.resize(counts_.size(), 0);
+	for (size_t value = 0; value < counts_.size(); ++value) {
+		counts[value] += counts_[value];
+	}
+}
+
+void ValueCounter::Flush()
+{
+	auto valueCount = counts_.size();
+	auto sub = subCounts_.data();
+	for (size_t value = 0; value < valueCount; ++value) {
+		counts_[value] += (uint64_t)sub[value] + sub[valueCount + value] + sub[2 * valueCount + value] + sub[3 * valueCount + value];
+	}
+	std::fill(subCounts_.begin(), subCounts_.end(), 0);
+	pendingSamples_ = 0;
+}
+
+// Consecutive samples go to four separate sub-histograms, so runs of one
+// value, which volumes are full of, don't stall each increment on the store
+// of the one before.
+template<typename T, bool Swap>
+void ValueCounter::CountSamples(const uint8_t* data, size_t samples)
+{
+	const size_t valueCount = (size_t)1 << (8 * sizeof(T));
+	const size_t perWord = 8 / sizeof(T);
+	const uint64_t valueMask = valueCount - 1;
+	const int valueBits = 8 * sizeof(T);
+	auto sub0 = subCounts_.data();
+	auto sub1 = sub0 + valueCount;
+	auto sub2 = sub1 + valueCount;
+	auto sub3 = sub2 + valueCount;
+
+	size_t i = 0;
+	for (; i + perWord <= samples; i += perWord) {
+		auto indices = LoadValueIndices<T, Swap>(data + i * sizeof(T));
+		sub0[indices & valueMask]++;
+		sub1[indices >> valueBits & valueMask]++;
+		sub2[indices >> 2 * valueBits & valueMask]++;
+		sub3[indices >> 3 * valueBits & valueMask]++;
+		if (sizeof(T) == 1) {
+			sub0[indices >> 32 & valueMask]++;
+			sub1[indices >> 40 & valueMask]++;
+			sub2[indices >> 48 & valueMask]++;
+			sub3[indices >> 56]++;
+		}
+	}
+	const int64_t lowest = std::numeric_limits<T>::lowest();
+	for (; i < samples; ++i) {
+		sub0[(size_t)((int64_t)LoadVoxel<T, Swap>(data + i * sizeof(T)) - lowest)]++;
+	}
+}
+
+void StatsFromValueCounts(const std::vector<uint64_t>& counts, VoxelType type, VolumeStats& stats)
+{
+	switch (type) {
+	case VoxelType::Int8: FoldValueCounts(counts, -128, stats); break;
+	case VoxelType::Int16: FoldValueCounts(counts, -32768, stats); break;
+	default: FoldValueCounts(counts, 0, stats); break;
+	}
+}
+
+float ValueCountsQuantile(const std::vector<uint64_t>& counts, VoxelType type, double q)
+{
+	uint64_t total = 0;
+	for (auto count : counts) {
+		total += count;
+	}
+	if (!total) {
+		return 0.0f;
+	}
+	auto lowest = type == VoxelType::Int8 ? -128 : type == VoxelType::Int16 ? -32768 : 0;
+	auto rank = (uint64_t)(glm::clamp(q, 0.0, 1.0) * (total - 1));
+	uint64_t below = 0;
+	size_t value = 0;
+	while (below + counts[value] <= rank) {
+		below += counts[value++];
+	}
+	return (float)((int64_t)value + lowest);
+}
+
+float HistogramQuantile(const VolumeStats& stats, double q)
+{
+	uint64_t total = 0;
+	for (auto count : stats.histogram) {
+		total += count;
+	}
+	if (!total) {
+		return stats.valueRange.x;
+	}
+	auto rank = glm::clamp(q, 0.0, 1.0) * total;
+	auto binWidth = ((double)stats.valueRange.y - stats.valueRange.x) / stats.histogram.size();
+	uint64_t below = 0;
+	for (size_t bin = 0; bin < stats.histogram.size(); ++bin) {
+		auto count = stats.histogram[bin];
+		if (count && below + count >= rank) {
+			auto fraction = (rank - below) / count;
+			return (float)(stats.valueRange.x + (bin + fraction) * binWidth);
+		}
+		below += count;
+	}
+	return stats.valueRange.y;
+}
+
+QuantileSketch::QuantileSketch()
+	: counts_((size_t)1 << (32 - SketchKeyShift), 0)
+{
+}
+
+void QuantileSketch::Add(const uint8_t* data, size_t samples, VoxelType type, bool swapBytes)
+{
+	swapBytes = swapBytes && VoxelSize(type) > 1;
+	switch (type) {
+	case VoxelType::UInt8: AddSamples<uint8_t, false>(data, samples); break;
+	case VoxelType::Int8: AddSamples<int8_t, false>(data, samples); break;
+	case VoxelType::UInt16: swapBytes ? AddSamples<uint16_t, true>(data, samples) : AddSamples<uint16_t, false>(data, samples); break;
+	case VoxelType::Int16: swapBytes ? AddSamples<int16_t, true>(data, samples) : AddSamples<int16_t, false>(data, samples); break;
+	case VoxelType::UInt32: swapBytes ? AddSamples<uint32_t, true>(data, samples) : AddSamples<uint32_t, false>(data, samples); break;
+	case VoxelType::Int32: swapBytes ? AddSamples<int32_t, true>(data, samples) : AddSamples<int32_t, false>(data, samples); break;
+	case VoxelType::Float32: swapBytes ? AddSamples<float, true>(data, samples) : AddSamples<float, false>(data, samples); break;
+	case VoxelType::Float64: swapBytes ? AddSamples<double, true>(data, samples) : AddSamples<double, false>(data, samples); break;
+	}
+}
+
+template<typename T, bool Swap>
+void QuantileSketch::AddSamples(const uint8_t* data, size_t samples)
+{
+	for (size_t i = 0; i < samples; ++i) {
+		auto value = (float)LoadVoxel<T, Swap>(data + i * sizeof(T));
+		if (std::isfinite(value)) {
+			counts_[SketchKey(value) >> SketchKeyShift]++;
+		}
+	}
+}
+
+void QuantileSketch::Merge(const QuantileSketch& other)
+{
+	for (size_t bucket = 0; bucket < counts_.size(); ++bucket) {
+		counts_[bucket] += other.counts_[bucket];
+	}
+}
+
+uint64_t QuantileSketch::Count() const
+{
+	uint64_t total = 0;
+	for (auto count : counts_) {
+		total += count;
+	}
+	return total;
+}
+
+float QuantileSketch::Quantile(double q) const
+{
+	auto total = Count();
+	if (!total) {
+		return 0.0f;
+	}
+	auto rank = glm::clamp(q, 0.0, 1.0) * (total - 1);
+	uint64_t below = 0;
+	size_t bucket = 0;
+	while (below + counts_[bucket] <= rank) {
+		below += counts_[bucket++];
+	}
+	auto first = SketchValue((uint32_t)bucket << SketchKeyShift);
+	auto last = SketchValue((uint32_t)((bucket + 1) << SketchKeyShift) - 1);
+	auto fraction = (rank - below + 0.5) / counts_[bucket];
+	return (float)(first + (last - first) * glm::min(fraction, 1.0));
+}
+
+IncrementalStats::IncrementalStats(const VolumeDesc& desc, glm::vec2 range)
+	: voxelType_(desc.voxelType)
+	, swapBytes_(desc.bigEndian && VoxelSize(desc.voxelType) > 1)
+	, range_(range)
+{
+	if (VoxelSize(voxelType_) <= 2) {
+		counts_.assign((size_t)1 << (8 * VoxelSize(voxelType_)), 0);
+	} else {
+		counts_.assign(HistogramBins, 0);
+	}
+	sliceCounts_.resize(desc.dims.z);
+}
+
+void IncrementalStats::Add(const uint8_t* data, size_t samples)
+{
+	TakeRange(data, samples);
+	Count(data, samples, 1, counts_);
+}
+
+void IncrementalStats::Remove(const uint8_t* data, size_t samples)
+{
+	// Counts are unsigned, adding all ones wraps around to a decrement.
+	Count(data, samples, ~(uint64_t)0, counts_);
+}
+
+void IncrementalStats::BeginSlice(int z)
+{
+	auto& previous = sliceCounts_[z];
+	for (auto& count : previous) {
+		counts_[count.first] -= count.second;
+	}
+	previous.clear();
+	pendingCounts_.assign(counts_.size(), 0);
+	pendingSlice_ = z;
+}
+
+void IncrementalStats::AddToSlice(const uint8_t* data, size_t samples)
+{
+	TakeRange(data, samples);
+	Count(data, samples, 1, pendingCounts_);
+}
+
+void IncrementalStats::EndSlice()
+{
+	auto& added = sliceCounts_[pendingSlice_];
+	for (size_t i = 0; i < pendingCounts_.size(); ++i) {
+		if (pendingCounts_[i]) {
+			counts_[i] += pendingCounts_[i];
+			added.push_back({ (uint32_t)i, (uint32_t)pendingCounts_[i] });
+		}
+	}
+	pendingSlice_ = -1;
+}
+
+void IncrementalStats::TakeRange(const uint8_t* data, size_t samples)
+{
+	// Wider types without a range take that of the first data added.
+	if (VoxelSize(voxelType_) > 2 && range_.x >= range_.y) {
+		VolumeStats first;
+		VolumeDesc desc;
+		desc.voxelType = voxelType_;
+		desc.bigEndian = swapBytes_;
+		desc.dims = glm::ivec3((int)samples, 1, 1);
+		CalculateVolumeStats(data, desc, first);
+		range_ = first.valueRange;
+		if (range_.x >= range_.y) {
+			range_.y = range_.x + 1.0f;
+		}
+	}
+}
+
+void IncrementalStats::Get(VolumeStats& stats) const
+{
+	if (VoxelSize(voxelType_) <= 2) {
+		StatsFromValueCounts(counts_, voxelType_, stats);
+		return;
+	}
+	stats.histogram = counts_;
+	stats.valueRange = range_;
+}
+
+void IncrementalStats::Count(const uint8_t* data, size_t samples, uint64_t delta, std::vector<uint64_t>& counts)
+{
+	switch (voxelType_) {
+	case VoxelType::UInt8: CountSamples<uint8_t, false>(data, samples, delta, counts); break;
+	case VoxelType::Int8: CountSamples<int8_t, false>(data, samples, delta, counts); break;
+	case VoxelType::UInt16: swapBytes_ ? CountSamples<uint16_t, true>(data, samples, delta, counts) : CountSamples<uint16_t, false>(data, samples, delta, counts); break;
+	case VoxelType::Int16: swapBytes_ ? CountSamples<int16_t, true>(data, samples, delta, counts) : CountSamples<int16_t, false>(data, samples, delta, counts); break;
+	case VoxelType::UInt32: swapBytes_ ? CountSamples<uint32_t, true>(data, samples, delta, counts) : CountSamples<uint32_t, false>(data, samples, delta, counts); break;
+	case VoxelType::Int32: swapBytes_ ? CountSamples<int32_t, true>(data, samples, delta, counts) : CountSamples<int32_t, false>(data, samples, delta, counts); break;
+	case VoxelType::Float32: swapBytes_ ? CountSamples<float, true>(data, samples, delta, counts) : CountSamples<float, false>(data, samples, delta, counts); break;
+	case VoxelType::Float64: swapBytes_ ? CountSamples<double, true>(data, samples, delta, counts) : CountSamples<double, false>(data, samples, delta, counts); break;
+	}
+}
+
+template<typename T, bool Swap>
+void IncrementalStats::CountSamples(const uint8_t* data, size_t samples, uint64_t delta, std::vector<uint64_t>& counts)
+{
+	if constexpr (std::is_integral<T>::value && sizeof(T) <= 2) {
+		const int64_t lowest = std::numeric_limits<T>::lowest();
+		for (size_t i = 0; i < samples; ++i) {
+			counts[(size_t)((int64_t)LoadVoxel<T, Swap>(data + i * sizeof(T)) - lowest)] += delta;
+		}
+	} else {
+		// Values outside the range land in the end bins.
+		auto scale = HistogramBins / ((double)range_.y - range_.x);
+		for (size_t i = 0; i < samples; ++i) {
+			auto value = (double)LoadVoxel<T, Swap>(data + i * sizeof(T));
+			if (std::isfinite(value)) {
+				auto bin = glm::clamp((int)((value - range_.x) * scale), 0, HistogramBins - 1);
+				counts[bin] += delta;
+			}
+		}
+	}
+}
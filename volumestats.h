@@ -0,0 +1,128 @@
+#pragma once
+
+#include "volumeformat.h"
+
+#include <functional>
+
+const int HistogramBins = 256;
+
+struct VolumeStats
+{
+	// Smallest and largest voxel value, NaNs excluded.
+	glm::vec2 valueRange = glm::vec2(0.0f);
+	// HistogramBins voxel counts spread evenly over valueRange.
+	std::vector<uint64_t> histogram;
+};
+
+// Computes the value range and histogram of a payload laid out as described
+// by desc, byte swapping on the fly for big endian data. 8 and 16 bit integer
+// data is done in a single pass, float data needs a range pass first. Large
+// payloads are split over threadCount threads, 0 for one per core, each
+// counting into integer bins of its own that are summed at the end.
+//
+// cancelled, if set, is polled from every thread between blocks of a few MB.
+// Once it returns true the pass gives up and returns false, leaving stats
+// unset.
+bool CalculateVolumeStats(const uint8_t* data, const VolumeDesc& desc, VolumeStats& stats, unsigned threadCount = 0,
+	const std::function<bool()>& cancelled = nullptr);
+
+// Count of every representable value of 8 or 16 bit integer samples, fed a
+// chunk at a time. Wider types are ignored.
+class ValueCounter
+{
+public:
+	ValueCounter(VoxelType type, bool swapBytes);
+
+	void Add(const uint8_t* data, size_t samples);
+	// Adds the counts so far into counts, one per value from the lowest up.
+	void AddTo(std::vector<uint64_t>& counts);
+
+private:
+	template<typename T, bool Swap>
+	void CountSamples(const uint8_t* data, size_t samples);
+	void Flush();
+
+	VoxelType voxelType_;
+	bool swapBytes_;
+	// Four interleaved 32 bit counts per value, flushed into counts_ before
+	// they can wrap.
+	std::vector<uint32_t> subCounts_;
+	std::vector<uint64_t> counts_;
+	size_t pendingSamples_ = 0;
+};
+
+// Range and histogram from the counts of a ValueCounter.
+void StatsFromValueCounts(const std::vector<uint64_t>& counts, VoxelType type, VolumeStats& stats);
+
+// Value below which a fraction q of the values counted by a ValueCounter fall.
+float ValueCountsQuantile(const std::vector<uint64_t>& counts, VoxelType type, double q);
+
+// Same from a histogram, interpolated inside the bin it lands in, so only as
+// close as the bins are narrow.
+float HistogramQuantile(const VolumeStats& stats, double q);
+
+// Fixed size summary of a distribution of values that quantiles can be read
+// from, built in a single pass, so it works on volumes streamed from disk.
+// Each value is counted in a bucket named by the sign, exponent and top seven
+// mantissa bits of it as a float, so a bucket spans under 1% of the values in
+// it, whatever their magnitude, and the buckets cover every finite float.
+// Sketches of parts of a volume merge by adding up their counts.
+class QuantileSketch
+{
+public:
+	QuantileSketch();
+
+	// Non-finite values are skipped.
+	void Add(const uint8_t* data, size_t samples, VoxelType type, bool swapBytes);
+	void Merge(const QuantileSketch& other);
+	uint64_t Count() const;
+	// Value below which a fraction q of the values fall, interpolated inside
+	// its bucket. 0 if nothing has been added.
+	float Quantile(double q) const;
+
+private:
+	template<typename T, bool Swap>
+	void AddSamples(const uint8_t* data, size_t samples);
+
+	std::vector<uint64_t> counts_;
+};
+
+// Stats of a volume that arrives a slice at a time, where a slice may later
+// be replaced by a newer copy of itself. 8 and 16 bit integer data keeps a
+// count of every value, so it ends up matching CalculateVolumeStats. Wider
+// types are binned over a range fixed up front, or over the range of the
+// first data added if that is empty.
+class IncrementalStats
+{
+public:
+	IncrementalStats(const VolumeDesc& desc, glm::vec2 range);
+
+	// samples is the number of values in data, all channels included.
+	void Add(const uint8_t* data, size_t samples);
+	// Takes back an earlier Add() of the same data.
+	void Remove(const uint8_t* data, size_t samples);
+	// Counts slice z a piece at a time, in place of whatever was counted for
+	// it before. Only the counts each slice added are kept to take it back
+	// out, never its voxels.
+	void BeginSlice(int z);
+	void AddToSlice(const uint8_t* data, size_t samples);
+	void EndSlice();
+	void Get(VolumeStats& stats) const;
+
+private:
+	void TakeRange(const uint8_t* data, size_t samples);
+	void Count(const uint8_t* data, size_t samples, uint64_t delta, std::vector<uint64_t>& counts);
+	template<typename T, bool Swap>
+	void CountSamples(const uint8_t* data, size_t samples, uint64_t delta, std::vector<uint64_t>& counts);
+
+	VoxelType voxelType_;
+	bool swapBytes_;
+	// Per value for small integers, else per bin over range_.
+	std::vector<uint64_t> counts_;
+	glm::vec2 range_;
+	// Non-zero counts each slice added, by value or bin, and those of the
+	// slice being counted.
+	std::vector<std::vector<std::pair<uint32_t, uint32_t>>> sliceCounts_;
+	std::vector<uint64_t> pendingCounts_;
+	int pendingSlice_ = -1;
+};
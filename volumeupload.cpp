@@ -0,0 +1,258 @@
+#include "volumeupload.h"
+
+#include "log.h"
+
+#include <thread>
+
+namespace {
+
+// Big enough to amortise the per-call overhead, small enough that a frame
+// only ever copies a few of them.
+const size_t TargetSlabBytes = 16 * 1024 * 1024;
+
+GLuint CreateVolumeTexture(glm::ivec3 dims, const TextureFormat& format)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_3D, texture);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	if (GLEW_ARB_texture_storage) {
+		glTexStorage3D(GL_TEXTURE_3D, 1, format.internalFormat, dims.x, dims.y, dims.z);
+	} else {
+		glTexImage3D(GL_TEXTURE_3D, 0, format.internalFormat, dims.x, dims.y, dims.z, 0, format.pixelFormat, format.type, nullptr);
+	}
+	return texture;
+}
+
+}
+
+bool GetTextureFormat(VoxelType voxelType, int channels, bool halfFloat, TextureFormat& format)
+{
+	if (channels != 1 && channels != 4) {
+		return false;
+	}
+	auto rgba = channels == 4;
+	format.pixelFormat = rgba ? GL_RGBA : GL_RED;
+	switch (voxelType) {
+	case VoxelType::UInt8:
+		format.internalFormat = rgba ? GL_RGBA8 : GL_R8;
+		format.type = GL_UNSIGNED_BYTE;
+		format.valueScale = 1.0f / 255.0f;
+		return true;
+	case VoxelType::Int8:
+		format.internalFormat = rgba ? GL_RGBA8_SNORM : GL_R8_SNORM;
+		format.type = GL_BYTE;
+		format.valueScale = 1.0f / 127.0f;
+		return true;
+	case VoxelType::UInt16:
+		format.internalFormat = rgba ? GL_RGBA16 : GL_R16;
+		format.type = GL_UNSIGNED_SHORT;
+		format.valueScale = 1.0f / 65535.0f;
+		return true;
+	case VoxelType::Int16:
+		format.internalFormat = rgba ? GL_RGBA16_SNORM : GL_R16_SNORM;
+		format.type = GL_SHORT;
+		format.valueScale = 1.0f / 32767.0f;
+		return true;
+	case VoxelType::Float32:
+		if (rgba) {
+			format.internalFormat = halfFloat ? GL_RGBA16F : GL_RGBA32F;
+		} else {
+			format.internalFormat = halfFloat ? GL_R16F : GL_R32F;
+		}
+		format.type = GL_FLOAT;
+		format.valueScale = 1.0f;
+		return true;
+	default:
+		return false;
+	}
+}
+
+VolumeUploader::~VolumeUploader()
+{
+	ReleaseBuffers();
+}
+
+GLuint VolumeUploader::Begin(const VolumeDesc& desc, const TextureFormat& format, SlabSource source, ThreadPool* fillPool)
+{
+	Cancel();
+
+	dims_ = desc.dims;
+	format_ = format;
+	swapBytes_ = desc.bigEndian && VoxelSize(desc.voxelType) > 1;
+	sliceBytes_ = (size_t)dims_.x * dims_.y * desc.VoxelBytes();
+	slabSlices_ = (int)glm::clamp(TargetSlabBytes / sliceBytes_, (size_t)1, (size_t)dims_.z);
+	nextSlice_ = 0;
+	queuedSlice_ = 0;
+	availableSlices_ = 0;
+	source_ = std::move(source);
+	fillPool_ = fillPool;
+	startTime_ = SDL_GetPerformanceCounter();
+
+	texture_ = CreateVolumeTexture(dims_, format_);
+
+	auto slabBytes = sliceBytes_ * slabSlices_;
+	for (auto& staging : ring_) {
+		// Re-specifying the store orphans whatever the GPU was still reading.
+		if (staging.fence) {
+			glDeleteSync(staging.fence);
+			staging.fence = nullptr;
+		}
+		if (!staging.pbo) {
+			glGenBuffers(1, &staging.pbo);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, slabBytes, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return texture_;
+}
+
+size_t VolumeUploader::Update(size_t byteBudget)
+{
+	if (!source_) {
+		return 0;
+	}
+
+	glBindTexture(GL_TEXTURE_3D, texture_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, swapBytes_ ? GL_TRUE : GL_FALSE);
+
+	auto uploaded = FinishFills();
+	while (queuedSlice_ < availableSlices_ && uploaded < byteBudget) {
+		auto& staging = ring_[ringIndex_];
+		if (staging.filling) {
+			break;
+		}
+		// The GPU may still be copying out of this buffer from a previous frame.
+		if (staging.fence) {
+			if (glClientWaitSync(staging.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+				break;
+			}
+			glDeleteSync(staging.fence);
+			staging.fence = nullptr;
+		}
+
+		auto sliceCount = glm::min(slabSlices_, availableSlices_ - queuedSlice_);
+		auto bytes = sliceBytes_ * sliceCount;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		auto dst = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!dst) {
+			break;
+		}
+		ringIndex_ = (ringIndex_ + 1) % RingSize;
+		if (fillPool_) {
+			// Uploaded by FinishFills() once the pool is done with it.
+			staging.filling = true;
+			staging.filled = false;
+			staging.firstSlice = queuedSlice_;
+			staging.sliceCount = sliceCount;
+			++fillingBuffers_;
+			queuedSlice_ += sliceCount;
+			fillPool_->Submit([source = source_, &staging, dst] {
+				source(staging.firstSlice, staging.sliceCount, dst);
+				staging.filled = true;
+			});
+			continue;
+		}
+		source_(queuedSlice_, sliceCount, dst);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, queuedSlice_, dims_.x, dims_.y, sliceCount, format_.pixelFormat, format_.type, nullptr);
+		staging.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		queuedSlice_ += sliceCount;
+		nextSlice_ = queuedSlice_;
+		uploaded += bytes;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+
+	if (nextSlice_ == dims_.z) {
+		auto seconds = (double)(SDL_GetPerformanceCounter() - startTime_) / SDL_GetPerformanceFrequency();
+		auto megabytes = sliceBytes_ * dims_.z / 1.0e6;
+		Log("Uploaded %.1f MB in %.3f s (%.1f MB/s)\n", megabytes, seconds, megabytes / seconds);
+		source_ = nullptr;
+	}
+	return uploaded;
+}
+
+GLuint VolumeUploader::Extend(int depth, SlabSource source)
+{
+	auto texture = CreateVolumeTexture(glm::ivec3(dims_.x, dims_.y, depth), format_);
+	// Copies queued behind any uploads still in flight, so those land too.
+	if (nextSlice_ > 0) {
+		glCopyImageSubData(texture_, GL_TEXTURE_3D, 0, 0, 0, 0, texture, GL_TEXTURE_3D, 0, 0, 0, 0, dims_.x, dims_.y, nextSlice_);
+	}
+	glDeleteTextures(1, &texture_);
+	texture_ = texture;
+	dims_.z = depth;
+	source_ = std::move(source);
+	return texture_;
+}
+
+void VolumeUploader::Cancel()
+{
+	// The pool may still be writing into mapped buffers; they have to be
+	// unmapped before anything else can use them.
+	for (auto& staging : ring_) {
+		if (!staging.filling) {
+			continue;
+		}
+		while (!staging.filled) {
+			std::this_thread::yield();
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		staging.filling = false;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	fillingBuffers_ = 0;
+	source_ = nullptr;
+	fillPool_ = nullptr;
+	nextSlice_ = 0;
+	queuedSlice_ = 0;
+	availableSlices_ = 0;
+	dims_ = glm::ivec3(0);
+}
+
+// Uploads the buffers the pool has filled, in the order they were handed out
+// so the texture still fills from the bottom up. Returns the bytes uploaded.
+size_t VolumeUploader::FinishFills()
+{
+	size_t uploaded = 0;
+	while (fillingBuffers_ > 0) {
+		auto& staging = ring_[(ringIndex_ + RingSize - fillingBuffers_) % RingSize];
+		if (!staging.filled) {
+			break;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, staging.firstSlice, dims_.x, dims_.y, staging.sliceCount, format_.pixelFormat, format_.type, nullptr);
+		staging.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		staging.filling = false;
+		--fillingBuffers_;
+		nextSlice_ = staging.firstSlice + staging.sliceCount;
+		uploaded += sliceBytes_ * staging.sliceCount;
+	}
+	return uploaded;
+}
+
+void VolumeUploader::ReleaseBuffers()
+{
+	for (auto& staging : ring_) {
+		if (staging.fence) {
+			glDeleteSync(staging.fence);
+			staging.fence = nullptr;
+		}
+		if (staging.pbo) {
+			glDeleteBuffers(1, &staging.pbo);
+			staging.pbo = 0;
+		}
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "threadpool.h"
+#include "volumeformat.h"
+
+#include <atomic>
+#include <functional>
+
+struct TextureFormat
+{
+	GLint internalFormat;
+	GLenum pixelFormat;
+	GLenum type;
+	// Voxel value to sampled value, for the normalized integer formats.
+	float valueScale;
+};
+
+// channels is 1 for scalar volumes or 4 for RGBA ones.
+bool GetTextureFormat(VoxelType voxelType, int channels, bool halfFloat, TextureFormat& format);
+
+// Streams a volume into a 3D texture a Z slab at a time. The texture storage
+// is allocated once up front, then each slab is staged through a small ring
+// of pixel buffer objects and copied in with glTexSubImage3D. Update() is
+// called once per frame and never waits on the GPU, so a large volume trickles
+// in over several frames instead of stalling one.
+//
+// Sources that do real work per slab can be given a pool to run on. Staging
+// buffers are then mapped by Update() and handed to the pool to fill, several
+// at once, and uploaded by a later Update() once they are full.
+class VolumeUploader
+{
+public:
+	// Fills dst with slices [firstSlice, firstSlice + sliceCount), tightly packed.
+	using SlabSource = std::function<void(int firstSlice, int sliceCount, uint8_t* dst)>;
+
+	~VolumeUploader();
+
+	// Creates the texture for desc and starts streaming into it as slices are
+	// made available. The caller owns the returned texture; only the bottom
+	// UploadedSlices() are valid. With a fillPool, source is called on its
+	// threads and has to cope with several calls at once.
+	GLuint Begin(const VolumeDesc& desc, const TextureFormat& format, SlabSource source, ThreadPool* fillPool = nullptr);
+	// Slices below this have been produced and may be handed to the source.
+	void SetAvailableSlices(int slices) { availableSlices_ = glm::min(slices, dims_.z); }
+	// Returns the bytes copied into the texture.
+	size_t Update(size_t byteBudget);
+	// Replaces the texture with a deeper one holding the slices uploaded so
+	// far, for volumes that grow while they load, and streams on into it from
+	// source. The old texture is deleted. Needs ARB_copy_image, and a source
+	// filled on the render thread.
+	GLuint Extend(int depth, SlabSource source);
+	void Cancel();
+
+	bool IsActive() const { return source_ != nullptr; }
+	int UploadedSlices() const { return nextSlice_; }
+	float Progress() const { return dims_.z ? (float)nextSlice_ / dims_.z : 1.0f; }
+
+private:
+	struct StagingBuffer
+	{
+		GLuint pbo = 0;
+		GLsync fence = nullptr;
+		// Mapped and handed to the fill pool, for slices [firstSlice,
+		// firstSlice + sliceCount).
+		bool filling = false;
+		std::atomic<bool> filled = false;
+		int firstSlice = 0;
+		int sliceCount = 0;
+	};
+
+	size_t FinishFills();
+	void ReleaseBuffers();
+
+	static const int RingSize = 3;
+	StagingBuffer ring_[RingSize];
+	int ringIndex_ = 0;
+
+	SlabSource source_;
+	ThreadPool* fillPool_ = nullptr;
+	int fillingBuffers_ = 0;
+	GLuint texture_ = 0;
+	TextureFormat format_;
+	glm::ivec3 dims_ = glm::ivec3(0);
+	bool swapBytes_ = false;
+	size_t sliceBytes_ = 0;
+	int slabSlices_ = 0;
+	int nextSlice_ = 0;
+	// Slices handed to the source so far, ahead of nextSlice_ while buffers
+	// are being filled on the pool.
+	int queuedSlice_ = 0;
+	int availableSlices_ = 0;
+	uint64_t startTime_ = 0;
+};
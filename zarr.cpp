@@ -0,0 +1,600 @@
+#include "zarr.h"
+
+#include "blosc.h"
+#include "inflate.h"
+#include "log.h"
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace std::experimental::filesystem;
+
+namespace {
+
+// Layers of chunks are kept well under this while they wait for the uploader.
+const size_t MaxBytesInFlight = 256 * 1024 * 1024;
+
+// Just enough JSON for Zarr metadata.
+struct JsonValue
+{
+	enum Type
+	{
+		Null,
+		Bool,
+		Number,
+		String,
+		Array,
+		Object,
+	};
+
+	Type type = Null;
+	bool boolean = false;
+	double number = 0.0;
+	std::string string;
+	std::vector<JsonValue> items;
+	std::vector<std::pair<std::string, JsonValue>> members;
+
+	// Member by key, or a null value if there is none.
+	const JsonValue& operator[](const char* key) const
+	{
+		static const JsonValue null;
+		for (auto& member : members) {
+			if (member.first == key) {
+				return member.second;
+			}
+		}
+		return null;
+	}
+};
+
+class JsonParser
+{
+public:
+	explicit JsonParser(const std::string& text) : text_(text) {}
+
+	bool Parse(JsonValue& value, std::string& error)
+	{
+		if (!ParseValue(value, 0) || (SkipSpace(), pos_ != text_.size())) {
+			error = "Malformed JSON at offset " + std::to_string(pos_);
+			return false;
+		}
+		return true;
+	}
+
+private:
+	void SkipSpace()
+	{
+		while (pos_ < text_.size() && isspace((unsigned char)text_[pos_])) {
+			++pos_;
+		}
+	}
+
+	bool Consume(const char* literal)
+	{
+		auto length = strlen(literal);
+		if (text_.compare(pos_, length, literal) != 0) {
+			return false;
+		}
+		pos_ += length;
+		return true;
+	}
+
+	bool ParseValue(JsonValue& value, int depth)
+	{
+		SkipSpace();
+		if (pos_ == text_.size() || depth > 64) {
+			return false;
+		}
+		auto c = text_[pos_];
+		if (c == '{') {
+			++pos_;
+			value.type = JsonValue::Object;
+			SkipSpace();
+			if (Consume("}")) {
+				return true;
+			}
+			do {
+				std::pair<std::string, JsonValue> member;
+				SkipSpace();
+				if (!ParseString(member.first) || (SkipSpace(), !Consume(":")) || !ParseValue(member.second, depth + 1)) {
+					return false;
+				}
+				value.members.push_back(std::move(member));
+				SkipSpace();
+			} while (Consume(","));
+			return Consume("}");
+		}
+		if (c == '[') {
+			++pos_;
+			value.type = JsonValue::Array;
+			SkipSpace();
+			if (Consume("]")) {
+				return true;
+			}
+			do {
+				value.items.emplace_back();
+				if (!ParseValue(value.items.back(), depth + 1)) {
+					return false;
+				}
+				SkipSpace();
+			} while (Consume(","));
+			return Consume("]");
+		}
+		if (c == '"') {
+			value.type = JsonValue::String;
+			return ParseString(value.string);
+		}
+		if (Consume("null")) {
+			value.type = JsonValue::Null;
+			return true;
+		}
+		if (Consume("true") || Consume("false")) {
+			value.type = JsonValue::Bool;
+			value.boolean = c == 't';
+			return true;
+		}
+		// Python's json writes these for float fill values.
+		value.type = JsonValue::Number;
+		if (Consume("NaN")) {
+			value.number = NAN;
+			return true;
+		}
+		if (Consume("Infinity") || Consume("-Infinity")) {
+			value.number = c == '-' ? -INFINITY : INFINITY;
+			return true;
+		}
+		auto start = text_.c_str() + pos_;
+		char* end;
+		value.number = strtod(start, &end);
+		pos_ += end - start;
+		return end != start;
+	}
+
+	// Escapes outside ASCII come out as '?', none of the names we look at
+	// have them.
+	bool ParseString(std::string& string)
+	{
+		if (!Consume("\"")) {
+			return false;
+		}
+		while (pos_ < text_.size()) {
+			auto c = text_[pos_++];
+			if (c == '"') {
+				return true;
+			}
+			if (c != '\\') {
+				string += c;
+				continue;
+			}
+			if (pos_ == text_.size()) {
+				return false;
+			}
+			switch (text_[pos_++]) {
+			case 'b': string += '\b'; break;
+			case 'f': string += '\f'; break;
+			case 'n': string += '\n'; break;
+			case 'r': string += '\r'; break;
+			case 't': string += '\t'; break;
+			case 'u': {
+				if (pos_ + 4 > text_.size()) {
+					return false;
+				}
+				auto code = strtoul(text_.substr(pos_, 4).c_str(), nullptr, 16);
+				string += code < 0x80 ? (char)code : '?';
+				pos_ += 4;
+				break;
+			}
+			default: string += text_[pos_ - 1]; break;
+			}
+		}
+		return false;
+	}
+
+	const std::string& text_;
+	size_t pos_ = 0;
+};
+
+bool ReadJsonFile(const path& filepath, JsonValue& value, std::string& error)
+{
+	std::ifstream stream(filepath, std::ios::binary);
+	if (!stream) {
+		error = "Could not read " + filepath.string();
+		return false;
+	}
+	std::stringstream text;
+	text << stream.rdbuf();
+	if (!JsonParser(text.str()).Parse(value, error)) {
+		error = filepath.string() + ": " + error;
+		return false;
+	}
+	return true;
+}
+
+// NumPy style type strings, "<u2", ">f4", "|u1".
+bool ParseZarrType(const std::string& dtype, VoxelType& type, bool& bigEndian)
+{
+	if (dtype.size() < 3) {
+		return false;
+	}
+	bigEndian = dtype[0] == '>';
+	auto kind = dtype[1];
+	auto size = atoi(dtype.c_str() + 2);
+	if (kind == 'u' && size == 1) type = VoxelType::UInt8;
+	else if (kind == 'i' && size == 1) type = VoxelType::Int8;
+	else if (kind == 'u' && size == 2) type = VoxelType::UInt16;
+	else if (kind == 'i' && size == 2) type = VoxelType::Int16;
+	else if (kind == 'u' && size == 4) type = VoxelType::UInt32;
+	else if (kind == 'i' && size == 4) type = VoxelType::Int32;
+	else if (kind == 'f' && size == 4) type = VoxelType::Float32;
+	else if (kind == 'f' && size == 8) type = VoxelType::Float64;
+	else return false;
+	return true;
+}
+
+template<typename T>
+void StoreFillVoxel(double value, std::array<uint8_t, 8>& voxel)
+{
+	auto typed = (T)value;
+	memcpy(voxel.data(), &typed, sizeof(T));
+}
+
+void SetFillVoxel(const JsonValue& fillValue, ZarrLevel& level)
+{
+	auto value = fillValue.type == JsonValue::Number ? fillValue.number : 0.0;
+	if (fillValue.type == JsonValue::String && fillValue.string == "NaN") {
+		value = NAN;
+	}
+	switch (level.desc.voxelType) {
+	case VoxelType::UInt8: StoreFillVoxel<uint8_t>(value, level.fillVoxel); break;
+	case VoxelType::Int8: StoreFillVoxel<int8_t>(value, level.fillVoxel); break;
+	case VoxelType::UInt16: StoreFillVoxel<uint16_t>(value, level.fillVoxel); break;
+	case VoxelType::Int16: StoreFillVoxel<int16_t>(value, level.fillVoxel); break;
+	case VoxelType::UInt32: StoreFillVoxel<uint32_t>(value, level.fillVoxel); break;
+	case VoxelType::Int32: StoreFillVoxel<int32_t>(value, level.fillVoxel); break;
+	case VoxelType::Float32: StoreFillVoxel<float>(value, level.fillVoxel); break;
+	case VoxelType::Float64: StoreFillVoxel<double>(value, level.fillVoxel); break;
+	}
+	if (level.desc.bigEndian) {
+		std::reverse(level.fillVoxel.begin(), level.fillVoxel.begin() + VoxelSize(level.desc.voxelType));
+	}
+}
+
+// The last three of a list of per axis numbers, as x, y, z.
+bool ReadSpatialAxes(const JsonValue& list, glm::dvec3& xyz)
+{
+	if (list.type != JsonValue::Array || list.items.size() < 3) {
+		return false;
+	}
+	auto last = list.items.size() - 1;
+	for (int i = 0; i < 3; ++i) {
+		if (list.items[last - i].type != JsonValue::Number) {
+			return false;
+		}
+		xyz[i] = list.items[last - i].number;
+	}
+	return true;
+}
+
+bool OpenZarrArray(const path& dir, ZarrLevel& level, std::string& error)
+{
+	JsonValue meta;
+	if (!ReadJsonFile(dir / ".zarray", meta, error)) {
+		return false;
+	}
+	if (meta["zarr_format"].number != 2) {
+		error = dir.string() + " is not a version 2 Zarr array";
+		return false;
+	}
+	auto& shape = meta["shape"];
+	auto& chunks = meta["chunks"];
+	glm::dvec3 dims;
+	glm::dvec3 chunkDims;
+	if (!ReadSpatialAxes(shape, dims) || !ReadSpatialAxes(chunks, chunkDims) || chunks.items.size() != shape.items.size()) {
+		error = dir.string() + " does not have z, y and x axes";
+		return false;
+	}
+	if (!ParseZarrType(meta["dtype"].string, level.desc.voxelType, level.desc.bigEndian)) {
+		error = "Unsupported Zarr type " + meta["dtype"].string;
+		return false;
+	}
+	if (meta["order"].string != "C") {
+		error = dir.string() + " is not in C order";
+		return false;
+	}
+	if (!meta["filters"].items.empty()) {
+		error = dir.string() + " has filters, which are not supported";
+		return false;
+	}
+	auto& compressor = meta["compressor"];
+	auto& compressorId = compressor["id"].string;
+	if (compressor.type == JsonValue::Null) {
+		level.compressor = ZarrCompressor::None;
+	} else if (compressorId == "zlib") {
+		level.compressor = ZarrCompressor::Zlib;
+	} else if (compressorId == "gzip") {
+		level.compressor = ZarrCompressor::Gzip;
+	} else if (compressorId == "blosc") {
+		auto shuffle = compressor["shuffle"].type == JsonValue::Number ? (int)compressor["shuffle"].number : 1;
+		if (!CheckBloscSettings(compressor["cname"].string, shuffle, VoxelSize(level.desc.voxelType), error)) {
+			error = dir.string() + ": " + error;
+			return false;
+		}
+		level.compressor = ZarrCompressor::Blosc;
+	} else {
+		error = "Unsupported Zarr compressor " + compressorId;
+		return false;
+	}
+
+	level.dir = dir;
+	level.desc.dims = glm::ivec3(dims);
+	level.chunkDims = glm::ivec3(chunkDims);
+	if (glm::any(glm::lessThan(level.desc.dims, glm::ivec3(1))) || glm::any(glm::lessThan(level.chunkDims, glm::ivec3(1)))) {
+		error = dir.string() + " is empty";
+		return false;
+	}
+	if (meta["dimension_separator"].string == "/") {
+		level.separator = '/';
+	}
+	level.keyPrefix.clear();
+	level.hiddenVolumes = 1;
+	for (size_t i = 0; i + 3 < shape.items.size(); ++i) {
+		level.keyPrefix += std::string("0") + level.separator;
+		level.hiddenVolumes *= (int)shape.items[i].number;
+	}
+	SetFillVoxel(meta["fill_value"], level);
+	return true;
+}
+
+}
+
+path ZarrLevel::ChunkPath(glm::ivec3 chunk) const
+{
+	auto key = keyPrefix + std::to_string(chunk.z) + separator + std::to_string(chunk.y) + separator + std::to_string(chunk.x);
+	return dir / key;
+}
+
+bool IsZarrPath(const path& filepath)
+{
+	auto name = filepath.filename().string();
+	if (name == ".zattrs" || name == ".zgroup" || name == ".zarray") {
+		return true;
+	}
+	return is_directory(filepath) && (exists(filepath / ".zattrs") || exists(filepath / ".zarray"));
+}
+
+bool OpenZarrPyramid(const path& filepath, ZarrPyramid& pyramid, std::string& error)
+{
+	pyramid.levels.clear();
+	auto dir = is_directory(filepath) ? filepath : filepath.parent_path();
+	if (exists(dir / "zarr.json")) {
+		error = dir.string() + " is a Zarr version 3 store, only version 2 is supported";
+		return false;
+	}
+
+	JsonValue attrs;
+	if (exists(dir / ".zattrs") && !ReadJsonFile(dir / ".zattrs", attrs, error)) {
+		return false;
+	}
+	auto& multiscales = attrs["multiscales"];
+	if (multiscales.items.empty()) {
+		ZarrLevel level;
+		if (!OpenZarrArray(dir, level, error)) {
+			return false;
+		}
+		pyramid.levels.push_back(level);
+		return true;
+	}
+
+	// Only the first pyramid, which is the one OME-Zarr readers show.
+	auto& multiscale = multiscales.items[0];
+	glm::dvec3 globalScale(1.0);
+	for (auto& transform : multiscale["coordinateTransformations"].items) {
+		if (transform["type"].string == "scale") {
+			ReadSpatialAxes(transform["scale"], globalScale);
+		}
+	}
+	for (auto& dataset : multiscale["datasets"].items) {
+		ZarrLevel level;
+		if (!OpenZarrArray(dir / dataset["path"].string, level, error)) {
+			return false;
+		}
+		// Versions before 0.4 have no transformations; voxels are then cubes.
+		glm::dvec3 scale(1.0);
+		for (auto& transform : dataset["coordinateTransformations"].items) {
+			if (transform["type"].string == "scale") {
+				ReadSpatialAxes(transform["scale"], scale);
+			}
+		}
+		level.desc.spacing = glm::vec3(scale * globalScale);
+		pyramid.levels.push_back(level);
+	}
+	if (pyramid.levels.empty()) {
+		error = dir.string() + " has no datasets";
+		return false;
+	}
+	return true;
+}
+
+bool ReadZarrChunk(const ZarrLevel& level, glm::ivec3 chunk, const VolumeRegion& region, uint8_t* dst, std::vector<uint8_t>& scratch, std::string& error)
+{
+	auto chunkOrigin = chunk * level.chunkDims;
+	auto begin = glm::max(chunkOrigin, region.origin);
+	auto end = glm::min(glm::min(chunkOrigin + level.chunkDims, region.origin + region.dims), level.desc.dims);
+	if (glm::any(glm::lessThanEqual(end, begin))) {
+		return true;
+	}
+
+	auto voxelBytes = level.desc.VoxelBytes();
+	auto rowBytes = (end.x - begin.x) * voxelBytes;
+	auto dstOffset = [&region, voxelBytes](int x, int y, int z) {
+		return (((size_t)(z - region.origin.z) * region.dims.y + (y - region.origin.y)) * region.dims.x + (x - region.origin.x)) * voxelBytes;
+	};
+
+	auto chunkPath = level.ChunkPath(chunk);
+	MappedFile file;
+	if (!file.Open(chunkPath)) {
+		if (exists(chunkPath) && file_size(chunkPath) > 0) {
+			error = "Could not read " + chunkPath.string();
+			return false;
+		}
+		// Chunks that are all fill value are not written.
+		for (int z = begin.z; z < end.z; ++z) {
+			for (int y = begin.y; y < end.y; ++y) {
+				auto row = dst + dstOffset(begin.x, y, z);
+				for (size_t offset = 0; offset < rowBytes; offset += voxelBytes) {
+					memcpy(row + offset, level.fillVoxel.data(), voxelBytes);
+				}
+			}
+		}
+		return true;
+	}
+
+	// Leading axes are all at index 0, so the volume is the start of the
+	// chunk and nothing past it needs decompressing.
+	auto chunkBytes = level.ChunkBytes();
+	const uint8_t* src = file.Data();
+	size_t available = file.Size();
+	if (level.compressor != ZarrCompressor::None) {
+		scratch.resize(chunkBytes);
+		auto decompress = level.compressor == ZarrCompressor::Zlib ? InflateZlib
+			: level.compressor == ZarrCompressor::Gzip ? InflateGzip
+			: DecompressBlosc;
+		auto ok = decompress(file.Data(), file.Size(), scratch.data(), chunkBytes, available, error);
+		if (!ok) {
+			error = chunkPath.string() + ": " + error;
+			return false;
+		}
+		src = scratch.data();
+	}
+	if (available < chunkBytes) {
+		error = chunkPath.string() + " is short";
+		return false;
+	}
+
+	for (int z = begin.z; z < end.z; ++z) {
+		for (int y = begin.y; y < end.y; ++y) {
+			auto srcOffset = (((size_t)(z - chunkOrigin.z) * level.chunkDims.y + (y - chunkOrigin.y)) * level.chunkDims.x + (begin.x - chunkOrigin.x)) * voxelBytes;
+			memcpy(dst + dstOffset(begin.x, y, z), src + srcOffset, rowBytes);
+		}
+	}
+	return true;
+}
+
+bool ReadZarrRegion(const ZarrLevel& level, const VolumeRegion& region, uint8_t* dst, std::string& error)
+{
+	auto first = region.origin / level.chunkDims;
+	auto last = (region.origin + region.dims - 1) / level.chunkDims;
+	std::vector<uint8_t> scratch;
+	for (int z = first.z; z <= last.z; ++z) {
+		for (int y = first.y; y <= last.y; ++y) {
+			for (int x = first.x; x <= last.x; ++x) {
+				if (!ReadZarrChunk(level, glm::ivec3(x, y, z), region, dst, scratch, error)) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+ZarrLoad::ZarrLoad(const ZarrLevel& level, const VolumeRegion& region, glm::vec2 range, ThreadPool& pool)
+	: level_(level)
+	, region_(region)
+	, pool_(pool)
+	, stats_(level.desc, range)
+{
+	sliceBytes_ = (size_t)region_.dims.x * region_.dims.y * level_.desc.VoxelBytes();
+	firstChunk_ = region_.origin / level_.chunkDims;
+	chunkCount_ = (region_.origin + region_.dims - 1) / level_.chunkDims - firstChunk_ + 1;
+
+	// Enough chunks in flight to keep every worker busy, as long as that
+	// doesn't mean holding too many slices.
+	auto chunksPerLayer = chunkCount_.x * chunkCount_.y;
+	auto wanted = (int)(2 * pool_.ThreadCount() + chunksPerLayer - 1) / chunksPerLayer;
+	auto affordable = (int)(MaxBytesInFlight / (sliceBytes_ * level_.chunkDims.z));
+	maxLayersInFlight_ = glm::max(2, glm::min(wanted, affordable));
+
+	auto regionEnd = region_.origin.z + region_.dims.z;
+	for (int z = 0; z < chunkCount_.z; ++z) {
+		auto layer = std::make_unique<Layer>();
+		layer->region = region_;
+		layer->region.origin.z = glm::max((firstChunk_.z + z) * level_.chunkDims.z, region_.origin.z);
+		layer->region.dims.z = glm::min((firstChunk_.z + z + 1) * level_.chunkDims.z, regionEnd) - layer->region.origin.z;
+		layers_.push_back(std::move(layer));
+	}
+}
+
+void ZarrLoad::Pump()
+{
+	while (queuedLayers_ < (int)layers_.size() && queuedLayers_ - releasedLayers_ < maxLayersInFlight_) {
+		auto& layer = *layers_[queuedLayers_];
+		layer.data.resize(layer.region.dims.z * sliceBytes_);
+		// One more than there are chunks; the last chunk read takes it once the
+		// layer is in the histogram.
+		layer.pendingChunks = chunkCount_.x * chunkCount_.y + 1;
+
+		auto self = shared_from_this();
+		auto layerIndex = queuedLayers_;
+		for (int y = 0; y < chunkCount_.y; ++y) {
+			for (int x = 0; x < chunkCount_.x; ++x) {
+				auto chunk = firstChunk_ + glm::ivec3(x, y, layerIndex);
+				pool_.Submit([self, layerIndex, chunk] { self->ReadChunk(layerIndex, chunk); });
+			}
+		}
+		++queuedLayers_;
+	}
+}
+
+int ZarrLoad::AvailableSlices()
+{
+	while (readLayers_ < queuedLayers_ && layers_[readLayers_]->pendingChunks == 0) {
+		++readLayers_;
+	}
+	if (readLayers_ == (int)layers_.size()) {
+		return region_.dims.z;
+	}
+	return layers_[readLayers_]->region.origin.z - region_.origin.z;
+}
+
+void ZarrLoad::CopySlices(int firstSlice, int sliceCount, uint8_t* dst)
+{
+	for (int slice = firstSlice; slice < firstSlice + sliceCount; ++slice) {
+		auto z = region_.origin.z + slice;
+		auto& layer = *layers_[z / level_.chunkDims.z - firstChunk_.z];
+		auto sliceInLayer = z - layer.region.origin.z;
+		memcpy(dst, layer.data.data() + sliceInLayer * sliceBytes_, sliceBytes_);
+		dst += sliceBytes_;
+
+		if (sliceInLayer == layer.region.dims.z - 1) {
+			std::vector<uint8_t>().swap(layer.data);
+			++releasedLayers_;
+		}
+	}
+}
+
+void ZarrLoad::GetStats(VolumeStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(statsMutex_);
+	stats_.Get(stats);
+}
+
+void ZarrLoad::ReadChunk(int layerIndex, glm::ivec3 chunk)
+{
+	auto& layer = *layers_[layerIndex];
+	std::vector<uint8_t> scratch;
+	std::string error;
+	if (!cancelled_ && !ReadZarrChunk(level_, chunk, layer.region, layer.data.data(), scratch, error)) {
+		Log("Failed to read chunk: %s\n", error.c_str());
+	}
+	if (--layer.pendingChunks == 1) {
+		if (!cancelled_) {
+			std::lock_guard<std::mutex> lock(statsMutex_);
+			stats_.Add(layer.data.data(), layer.data.size() / VoxelSize(level_.desc.voxelType));
+		}
+		--layer.pendingChunks;
+	}
+}
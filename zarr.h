@@ -0,0 +1,113 @@
+#pragma once
+
+#include "threadpool.h"
+#include "volumeformat.h"
+#include "volumestats.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+
+// OME-Zarr datasets: a directory of Zarr (v2) arrays, each split into chunk
+// files, with the pyramid of resolution levels described by the
+// "multiscales" entry of the group's .zattrs. A bare array directory, with
+// just a .zarray, opens as a pyramid of one level.
+
+enum class ZarrCompressor
+{
+	None,
+	Zlib,
+	Gzip,
+	Blosc,
+};
+
+// One resolution level. Arrays may have leading time and channel axes in
+// front of z, y and x; only the first timestep and channel is read.
+struct ZarrLevel
+{
+	std::experimental::filesystem::path dir;
+	// dataFile and dataOffset are unused, the payload is in chunk files.
+	VolumeDesc desc;
+	glm::ivec3 chunkDims = glm::ivec3(0);
+	ZarrCompressor compressor = ZarrCompressor::None;
+	// Name of chunk (0, 0, 0) with the leading axes filled in, e.g. "0.0.";
+	// the z, y and x chunk indices follow.
+	std::string keyPrefix;
+	char separator = '.';
+	// Leading axes dropped, as a count of volumes.
+	int hiddenVolumes = 1;
+	// One voxel of the fill value for missing chunks, in payload byte order.
+	std::array<uint8_t, 8> fillVoxel = {};
+
+	size_t ChunkBytes() const { return (size_t)chunkDims.x * chunkDims.y * chunkDims.z * desc.VoxelBytes(); }
+	glm::ivec3 ChunkGrid() const { return (desc.dims + chunkDims - 1) / chunkDims; }
+	std::experimental::filesystem::path ChunkPath(glm::ivec3 chunk) const;
+};
+
+// Finest level first.
+struct ZarrPyramid
+{
+	std::vector<ZarrLevel> levels;
+};
+
+// True for a directory with Zarr metadata in it, or one of the metadata files.
+bool IsZarrPath(const std::experimental::filesystem::path& path);
+// Parses the group or array metadata at path, which is the directory or one of
+// its .zgroup, .zattrs or .zarray files.
+bool OpenZarrPyramid(const std::experimental::filesystem::path& path, ZarrPyramid& pyramid, std::string& error);
+
+// Reads the chunk and copies the part of it inside region into dst, which
+// holds region tightly packed. Missing chunks read as the fill value.
+// scratch is reused between calls to hold the decompressed chunk.
+bool ReadZarrChunk(const ZarrLevel& level, glm::ivec3 chunk, const VolumeRegion& region, uint8_t* dst, std::vector<uint8_t>& scratch, std::string& error);
+// Every chunk of region, one after the other, on the calling thread.
+bool ReadZarrRegion(const ZarrLevel& level, const VolumeRegion& region, uint8_t* dst, std::string& error);
+
+// Reads region of one level into the volume, a layer of chunks at a time, on a
+// thread pool with every chunk of a layer read side by side. Like
+// ImageStackLoad, only a bounded window of layers is read ahead of the
+// uploader, and each is freed once it has been copied out.
+class ZarrLoad : public std::enable_shared_from_this<ZarrLoad>
+{
+public:
+	// Histograms of 32 bit and float data are binned over range, or over the
+	// first layer's if it is empty.
+	ZarrLoad(const ZarrLevel& level, const VolumeRegion& region, glm::vec2 range, ThreadPool& pool);
+
+	// Render thread. Queues reads of every chunk of the layers in the window.
+	void Pump();
+	// Render thread. Slices of region below this are read.
+	int AvailableSlices();
+	// Render thread, used as the uploader's SlabSource.
+	void CopySlices(int firstSlice, int sliceCount, uint8_t* dst);
+	void Cancel() { cancelled_ = true; }
+	bool Finished() const { return releasedLayers_ == (int)layers_.size(); }
+	void GetStats(VolumeStats& stats) const;
+
+private:
+	struct Layer
+	{
+		// The slices of region the layer covers.
+		VolumeRegion region;
+		std::vector<uint8_t> data;
+		std::atomic<int> pendingChunks;
+	};
+
+	void ReadChunk(int layer, glm::ivec3 chunk);
+
+	ZarrLevel level_;
+	VolumeRegion region_;
+	ThreadPool& pool_;
+	size_t sliceBytes_;
+	glm::ivec3 firstChunk_;
+	glm::ivec3 chunkCount_;
+	int maxLayersInFlight_;
+
+	std::vector<std::unique_ptr<Layer>> layers_;
+	int queuedLayers_ = 0;
+	int readLayers_ = 0;
+	int releasedLayers_ = 0;
+	std::atomic<bool> cancelled_ = false;
+	mutable std::mutex statsMutex_;
+	IncrementalStats stats_;
+};